@@ -17,15 +17,90 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 
+#ifdef _WIN32
 #include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#include <fcntl.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#endif
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
+// build with NO_FTD2XX to get a simulator only binary (e.g. on a Linux build box)
+#ifndef NO_FTD2XX
 #include "ftd2xx.h"
+#endif
+// build with NO_ZLIB / NO_LZMA without the gzip / xz SVF readers
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
+#ifndef NO_LZMA
+#include <lzma.h>
+#endif
 
-// max queue length
+#ifndef _WIN32
+#include <errno.h>
+typedef int errno_t;
+// fopen_s of the MSVC runtime
+static errno_t fopen_s(FILE **fp, const char *name, const char *mode)
+{
+	*fp = fopen(name, mode);
+	return (*fp) ? 0 : errno;
+}
+#endif
+
+// default size / number of the USB transfer buffers
 #define USB_BUFSIZE 4096
+#define USB_QDEPTH 4
+// default latency timer in ms (the driver's is 16) : the read back of a
+// partly filled USB packet waits this long
+#define USB_LATENCY 2
+// bytes sent for each setting of the calibration
+#define CALIB_BYTES (1 << 18)
+// -c in bit bang mode : unchecked runs of at least this many bytes are
+// clocked in asynchronous mode (nothing read back); the adapter FIFOs are
+// drained before it goes back to synchronous mode
+#define HYBRID_MIN_BYTES 4096
+#define BITBANG_FIFO_BYTES 384
+// waveform image : file offset of the bytes, size of the replay writes
+#define IMAGE_ALIGN 4096
+#define IMAGE_WRITE (1 << 16)
 
-// max string length
-#define MAX_STR 256
+// threads and atomics of the USB I/O pipeline
+#ifdef _WIN32
+typedef HANDLE THREAD;
+#define THREAD_FUNC		DWORD WINAPI
+typedef DWORD (WINAPI *THREAD_PROC)(void *);
+#define ATOMIC_LOAD(p)		InterlockedOr((volatile LONG *)(p), 0)
+#define ATOMIC_STORE(p, v)	InterlockedExchange((volatile LONG *)(p), (v))
+#define ATOMIC_DEC(p)		InterlockedDecrement((volatile LONG *)(p))
+typedef CRITICAL_SECTION MUTEX;
+typedef CONDITION_VARIABLE COND;
+#else
+typedef pthread_t THREAD;
+#define THREAD_FUNC		void *
+typedef void *(*THREAD_PROC)(void *);
+#define ATOMIC_LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_DEC(p)		__atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+typedef pthread_mutex_t MUTEX;
+typedef pthread_cond_t COND;
+#endif
 
 // TAP STATES
 #define TEST_LOGIC_RESET	0
@@ -45,9 +120,650 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define EXIT2_IR		14
 #define UPDATE_IR		15
 
+// SVF names of the TAP states
+static const char *state_name[16] = {
+	"RESET", "IDLE", "DRSELECT", "DRCAPTURE", "DRSHIFT", "DREXIT1", "DRPAUSE", "DREXIT2",
+	"DRUPDATE", "IRSELECT", "IRCAPTURE", "IRSHIFT", "IREXIT1", "IRPAUSE", "IREXIT2", "IRUPDATE"
+};
+
+// shortest TMS sequence from one TAP state to another (bit 0 is clocked
+// first, at most 8 bits), generated by a breadth first search over the
+// 1149.1 state diagram; tms_path[from][to]
+typedef struct tms_path {
+	unsigned char tms, len;
+} TMS_PATH;
+
+static const TMS_PATH tms_path[16][16] = {
+	{{0x00, 0}, {0x00, 1}, {0x02, 2}, {0x02, 3}, {0x02, 4}, {0x0a, 4}, {0x0a, 5}, {0x2a, 6}, {0x1a, 5}, {0x06, 3}, {0x06, 4}, {0x06, 5}, {0x16, 5}, {0x16, 6}, {0x56, 7}, {0x36, 6}},	// TEST_LOGIC_RESET
+	{{0x07, 3}, {0x00, 0}, {0x01, 1}, {0x01, 2}, {0x01, 3}, {0x05, 3}, {0x05, 4}, {0x15, 5}, {0x0d, 4}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6}, {0x1b, 5}},	// RUN_TEST
+	{{0x03, 2}, {0x03, 3}, {0x00, 0}, {0x00, 1}, {0x00, 2}, {0x02, 2}, {0x02, 3}, {0x0a, 4}, {0x06, 3}, {0x01, 1}, {0x01, 2}, {0x01, 3}, {0x05, 3}, {0x05, 4}, {0x15, 5}, {0x0d, 4}},	// SELECT_DR_SCAN
+	{{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x00, 0}, {0x00, 1}, {0x01, 1}, {0x01, 2}, {0x05, 3}, {0x03, 2}, {0x0f, 4}, {0x0f, 5}, {0x0f, 6}, {0x2f, 6}, {0x2f, 7}, {0xaf, 8}, {0x6f, 7}},	// CAPTURE_DR
+	{{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x00, 0}, {0x01, 1}, {0x01, 2}, {0x05, 3}, {0x03, 2}, {0x0f, 4}, {0x0f, 5}, {0x0f, 6}, {0x2f, 6}, {0x2f, 7}, {0xaf, 8}, {0x6f, 7}},	// SHIFT_DR
+	{{0x0f, 4}, {0x01, 2}, {0x03, 2}, {0x03, 3}, {0x02, 3}, {0x00, 0}, {0x00, 1}, {0x02, 2}, {0x01, 1}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7}, {0x37, 6}},	// EXIT1_DR
+	{{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x01, 2}, {0x05, 3}, {0x00, 0}, {0x01, 1}, {0x03, 2}, {0x0f, 4}, {0x0f, 5}, {0x0f, 6}, {0x2f, 6}, {0x2f, 7}, {0xaf, 8}, {0x6f, 7}},	// PAUSE_DR
+	{{0x0f, 4}, {0x01, 2}, {0x03, 2}, {0x03, 3}, {0x00, 1}, {0x02, 2}, {0x02, 3}, {0x00, 0}, {0x01, 1}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7}, {0x37, 6}},	// EXIT2_DR
+	{{0x07, 3}, {0x00, 1}, {0x01, 1}, {0x01, 2}, {0x01, 3}, {0x05, 3}, {0x05, 4}, {0x15, 5}, {0x00, 0}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6}, {0x1b, 5}},	// UPDATE_DR
+	{{0x01, 1}, {0x01, 2}, {0x05, 3}, {0x05, 4}, {0x05, 5}, {0x15, 5}, {0x15, 6}, {0x55, 7}, {0x35, 6}, {0x00, 0}, {0x00, 1}, {0x00, 2}, {0x02, 2}, {0x02, 3}, {0x0a, 4}, {0x06, 3}},	// SELECT_IR_SCAN
+	{{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7}, {0x37, 6}, {0x0f, 4}, {0x00, 0}, {0x00, 1}, {0x01, 1}, {0x01, 2}, {0x05, 3}, {0x03, 2}},	// CAPTURE_IR
+	{{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7}, {0x37, 6}, {0x0f, 4}, {0x0f, 5}, {0x00, 0}, {0x01, 1}, {0x01, 2}, {0x05, 3}, {0x03, 2}},	// SHIFT_IR
+	{{0x0f, 4}, {0x01, 2}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6}, {0x1b, 5}, {0x07, 3}, {0x07, 4}, {0x02, 3}, {0x00, 0}, {0x00, 1}, {0x02, 2}, {0x01, 1}},	// EXIT1_IR
+	{{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7}, {0x37, 6}, {0x0f, 4}, {0x0f, 5}, {0x01, 2}, {0x05, 3}, {0x00, 0}, {0x01, 1}, {0x03, 2}},	// PAUSE_IR
+	{{0x0f, 4}, {0x01, 2}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6}, {0x1b, 5}, {0x07, 3}, {0x07, 4}, {0x00, 1}, {0x02, 2}, {0x02, 3}, {0x00, 0}, {0x01, 1}},	// EXIT2_IR
+	{{0x07, 3}, {0x00, 1}, {0x01, 1}, {0x01, 2}, {0x01, 3}, {0x05, 3}, {0x05, 4}, {0x15, 5}, {0x0d, 4}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6}, {0x00, 0}},	// UPDATE_IR
+};
+
+// FT232R/FT245R bit bang modes
+#define BITBANG_ASYNC	1
+#define BITBANG_SYNC	4
+
+// JTAG engines
+#define ENGINE_AUTO	-1
+#define ENGINE_BITBANG	0	// FT232R/FT245R bit bang : 2 bytes per TCK
+#define ENGINE_MPSSE	1	// FT2232H/FT4232H/FT232H MPSSE : 8 TCK per byte
+
+// adapter types
+#define DEV_UNKNOWN	0
+#define DEV_FT232R	1
+#define DEV_FT2232H	2
+#define DEV_FT4232H	3
+#define DEV_FT232H	4
+
+// MPSSE (ADBUS0 TCK, ADBUS1 TDI, ADBUS2 TDO, ADBUS3 TMS); data is clocked
+// out on the falling edge and TDO is sampled on the rising edge, LSB first
+#define MPSSE_MODE		2	// FT_SetBitMode mode
+#define MPSSE_WRITE_BYTES	0x19
+#define MPSSE_RW_BYTES		0x39
+#define MPSSE_WRITE_BITS	0x1b
+#define MPSSE_RW_BITS		0x3b
+#define MPSSE_WRITE_TMS		0x4b
+#define MPSSE_RW_TMS		0x6b
+#define MPSSE_SET_LOW		0x80
+#define MPSSE_LOOPBACK_OFF	0x85
+#define MPSSE_SET_DIVISOR	0x86
+#define MPSSE_SEND_IMMEDIATE	0x87
+#define MPSSE_DIV5_OFF		0x8a
+#define MPSSE_3PHASE_OFF	0x8d
+#define MPSSE_CLOCK_BITS	0x8e
+#define MPSSE_CLOCK_BYTES	0x8f
+#define MPSSE_ADAPTIVE_OFF	0x97
+#define MPSSE_BAD_COMMAND	0xfa
+// TCK = 60 MHz / ((1 + div) * 2)
+#define MPSSE_DEFAULT_DIV	4
+
+// upper bound of the bit bang TCK (3 MB/s at divisor 1, 2 bytes per TCK);
+// RUNTEST times are converted with it so that they are never too short
+#define BITBANG_TCK_HZ		1500000.0
+// bit bang RUNTEST longer than this is done by a host side sleep
+#define IDLE_SLEEP_CLKS		65536
+// -retry : shortest idle before an SDR is shifted again
+#define RETRY_MIN_SEC		0.001
+// -checkpoint : seconds between checkpoints (each waits for the read backs)
+#define CKPT_SEC		1.0
+
+// autotune : bits of each test scan, scans per rate, and the rate of
+// the reference read
+#define AUTOTUNE_BITS		2048
+// USERCODE instruction of the XC9500 / CoolRunner (8 bit IR), read when
+// the IDCODE is of Xilinx (other parts get no USERCODE and -skip runs the
+// verify SVF every time); the IR of every device of the chain is taken to
+// be 8 bits long
+#define XILINX_IDCODE_MFG	0x093
+#define USERCODE_IR_LEN		8
+#define USERCODE_INST		0xfd
+// ISC_ENABLE of the XC9500 / CoolRunner (8 bit IR) : -checkpoint takes
+// checkpoints only after it, and replays it on resume
+#define ISC_IR_LEN		8
+#define ISC_ENABLE_INST		0xe8
+#define AUTOTUNE_REPS		4
+#define AUTOTUNE_REF_HZ		100000.0
+
+// SVF command types / TCK kinds of the run report
+#define CMD_SIR			0
+#define CMD_SDR			1
+#define CMD_RUNTEST		2
+#define CMD_STATE		3
+#define CMD_HEADER		4	// HIR / TIR / HDR / TDR
+#define CMD_FREQUENCY		5
+#define CMD_OTHER		6	// ENDIR / ENDDR / TRST
+#define NUM_CMD			7
+#define TCK_SIR			0
+#define TCK_SDR			1
+#define TCK_RUNTEST		2
+#define TCK_STATE		3
+#define NUM_TCK			4
+// XSVF commands (Xilinx XAPP503), the TAP states of XSTATE / XWAIT are
+// numbered like the TAP STATES above
+#define XCOMPLETE		0x00
+#define XTDOMASK		0x01
+#define XSIR			0x02
+#define XSDR			0x03
+#define XRUNTEST		0x04
+#define XREPEAT			0x07
+#define XSDRSIZE		0x08
+#define XSDRTDO			0x09
+#define XSETSDRMASKS		0x0a
+#define XSDRINC			0x0b
+#define XSDRB			0x0c
+#define XSDRC			0x0d
+#define XSDRE			0x0e
+#define XSDRTDOB		0x0f
+#define XSDRTDOC		0x10
+#define XSDRTDOE		0x11
+#define XSTATE			0x12
+#define XENDIR			0x13
+#define XENDDR			0x14
+#define XSIR2			0x15
+#define XCOMMENT		0x16
+#define XWAIT			0x17
+#define NUM_XCMD		0x18
+// bytes is_xsvf looks at to tell SVF text from XSVF
+#define XSVF_SNIFF		64
+// longest XSDRSIZE taken
+#define XSVF_MAX_BITS		(1 << 27)
+// USB call latency histogram : bin k counts the calls up to 2^k usec
+#define LAT_BINS		24
+// interval of the progress line
+#define PROGRESS_SEC		0.5
+
+// ========== transport ==========
+// the USB adapter (or its simulator) behind outBit / reset_tap / transit
+typedef struct transport {
+	const char *name;
+	void *handle;
+	int (*open)(struct transport *tp);
+	void (*close)(struct transport *tp);
+	int (*set_bit_mode)(struct transport *tp, int mask, int mode);
+	int (*set_divisor)(struct transport *tp, int div);
+	int (*write)(struct transport *tp, unsigned char *buf, int len);
+	int (*read)(struct transport *tp, unsigned char *buf, int len);
+	int (*purge)(struct transport *tp);
+	int (*device_type)(struct transport *tp);
+	// driver transfer size and latency timer in ms (0 : leave as is)
+	int (*set_usb)(struct transport *tp, int xfer, int latency);
+	int dev_type;
+	char id[64];		// serial number or description ("" : first device)
+	// statistics
+	double bytes_written, bytes_read;
+	long write_calls, read_calls;
+	double write_sec, read_sec;	// time in the driver calls
+	long lat_hist[2][LAT_BINS];	// write / read latency
+} TRANSPORT;
+
+// simulated FT232R with a single CPLD (8 bit IR) on its bit bang port
+#define SIM_IR_LEN		8
+#define SIM_INST_BYPASS		0xff
+#define SIM_INST_IDCODE		0xfe
+#define SIM_INST_USERCODE	0xfd
+#define SIM_IDCODE		0x59604093
+#define SIM_USERCODE		0xffffffff
+
+// one CPLD of the simulated chain
+typedef struct sim_tap {
+	int state;
+	unsigned int ir, ir_shift;
+	// DR shift register (one byte per bit, head is next TDO);
+	// BYPASS/IDCODE/USERCODE have fixed length, other registers
+	// grow to the length of the scan
+	unsigned char *dr;
+	int dr_head, dr_tail, dr_cap, dr_fixed, dr_captured;
+	// in a chain, registers keep the length of their first update
+	int chained, dr_keep;
+	// CPLD registers, indexed by instruction
+	unsigned char *reg[1 << SIM_IR_LEN];
+	int reg_len[1 << SIM_IR_LEN];
+} SIM_TAP;
+
+typedef struct sim_device {
+	int bit_mode, mask, pins;
+	// MPSSE : pending command bytes, TMS / TDI pins
+	unsigned char *mcmd;
+	int mlen, mcap, mtms, mtdi;
+	// read FIFO of synchronous bit bang mode
+	unsigned char *rfifo;
+	int rhead, rtail, rcap;
+	// TCK rate, TDO is unreliable above g_sim_tck
+	double tck_hz;
+	uint64_t noise;
+	// the chain, tap[0] is next to TDI
+	SIM_TAP *tap;
+	int ntap;
+	// TDI bits of the current DR scan of a chain
+	unsigned char *scan;
+	int shifted, scan_cap;
+	// bit bang pins of the chain (as IMAGE_PINS), next chain of -slice
+	int board_pins;
+	struct sim_device *next;
+} SIM_DEVICE;
+
+// ========== bit vectors ==========
+// SIR/SDR data packed LSB first (bit 0 is shifted first) into 64 bit words
+typedef struct bitvec {
+	uint64_t *w;
+	int bits;
+	int cap;	// allocated words
+} BITVEC;
+
+#define BV_WORDS(bits)	(((bits) + 63) >> 6)
+// longest SIR / SDR / HIR / TIR / HDR / TDR taken
+#define SCAN_MAX_BITS	(1 << 27)
+#define BV_GET(bv, i)	((int)(((bv)->w[(i) >> 6] >> ((i) & 63)) & 1))
+#ifdef _MSC_VER
+#include <intrin.h>
+#define POPCOUNT64(x)	((int)__popcnt64(x))
+#else
+#define POPCOUNT64(x)	__builtin_popcountll(x)
+#endif
+
+// TDI / TDO / MASK / SMASK of SIR or SDR, kept for the next scan of the
+// same length
+typedef struct scan_param {
+	BITVEC tdi, tdo, mask, smask;
+	int bits;
+	int tdo_valid;		// TDO was given (HIR/TIR/HDR/TDR are compared then)
+} SCAN_PARAM;
+
+// RUNTEST [run_state] [run_count TCK] [min_time SEC] [MAXIMUM max_time SEC]
+// [ENDSTATE end_state]; the states are kept for the next RUNTEST
+typedef struct runtest_param {
+	int run_state, run_end;
+	int clks;		// run_count (0 : not given)
+	double min_time, max_time;	// (0 : not given)
+} RUNTEST_PARAM;
+
+// SVF optimizer : TAP state as the written SVF leaves it, STATE paths and a
+// RUNTEST held back to be dropped or merged, and the last instruction
+#define OPT_MAX_PATH	64
+typedef struct svf_opt {
+	FILE *fp;
+	int state;		// -1 : unknown
+	int clean;		// reset and no scan since (the IR holds its reset value)
+	int end_ir, end_dr;	// ENDIR / ENDDR given, written
+	int w_end_ir, w_end_dr;
+	int path[OPT_MAX_PATH], npath;	// STATE not written yet
+	RUNTEST_PARAM rt;		// RUNTEST not written yet
+	int has_rt;
+	SCAN_PARAM ir;		// HIR + SIR + TIR last shifted
+	int ir_valid;
+	// report
+	long cmds, sir_drop, state_drop, end_drop, rt_merge;
+	double tcks_saved;
+} SVF_OPT;
+
+// ========== SVF tokenizer ==========
+// read buffer size used when the SVF can't be memory mapped (pipes)
+#define SVF_READ_SIZE	(1024 * 1024)
+// longest token the window grows to : the hex of a SCAN_MAX_BITS scan,
+// with room for line feeds
+#define SVF_TOKEN_MAX	(SCAN_MAX_BITS / 2)
+
+// tokenizer context : tokens are slices of the input window, they are
+// valid until the next get_word
+typedef struct svf_parser {
+	const char *buf;	// input window
+	size_t len, pos;	// window length, read position
+	size_t mark;		// start of the current token (kept on refill)
+	double consumed;	// bytes dropped from the front of the window
+	double size;		// file size (0 : unknown)
+	int line;		// current line number
+	long tokens;		// number of tokens read
+	// sticky SIR / SDR parameters
+	SCAN_PARAM sir, sdr;
+	SCAN_PARAM hir, tir, hdr, tdr;	// header / trailer of the other devices
+	SCAN_PARAM scan;		// header, payload(s) and trailer of one scan
+	SCAN_PARAM xseg;		// XSDRB / XSDRC / XSDRE segments of one XSVF shift
+	BITVEC retry_tdi;		// -retry : TDI of the SDR before (bits 0 : an SIR,
+					// STATE or header change since)
+	// backing store
+	FILE *fp;
+	struct svf_reader *rd;	// reader thread of fp
+	struct ckpt_header *resume;	// state of the checkpoint it resumes at
+	double enable_ofs, enable_end;	// -checkpoint : the last ISC_ENABLE group (end < 0 : open)
+	int enable_line;		// its line (0 : none yet)
+	double limit;			// parse commands up to this offset (0 : to the end)
+	char *rbuf;
+	size_t rcap;
+	int mapped;
+	int read_error;		// 31 : the SVF couldn't be read / decompressed, 34 : a token is over SVF_TOKEN_MAX
+#ifdef _WIN32
+	HANDLE hfile, hmap;
+#endif
+} SVF_PARSER;
+
+typedef struct token {
+	const char *str;
+	int len;
+	int line;
+} TOKEN;
+
+// identical devices of one chain in the broadcast mode
+#define MAX_CHAIN	32
+
+// TDO compare of one SIR/SDR whose read back starts at rd_start
+typedef struct vrec {
+	struct vrec *next;
+	BITVEC tdo, mask;
+	int bits;
+	int64_t rd_start;
+	int engine;
+	int line, ir;		// origin in the SVF
+	int hbits, unit, units;	// header bits, payload bits x devices (broadcast)
+} VREC;
+
+// TDO compare of one adapter : the read back bits of the head scan are
+// packed into got and compared 64 bits at a time
+typedef struct verifier {
+	VREC *head, *tail;
+	int own;		// free the scans once compared (not shared)
+	int done;		// bits of head in got
+	BITVEC got;
+	int64_t rd_pos;		// stream offset of the next read back byte
+	int no_match, reported;
+	int64_t compared;	// TDO bits compared (set in the mask)
+	int unit_no_match[MAX_CHAIN];	// mismatches of each broadcast device
+	const char *name;	// adapter in the reports (NULL : the only one)
+	BITVEC *capture;	// copy of the read back bits (sized by the caller)
+	int quiet;		// a scan that may be shifted again : count, don't list
+} VERIFIER;
+
+// SVF encoded once for one engine and replayed on several adapters;
+// a chunk is one USB write (or a RUNTEST sleep if sleep > 0, a bit bang
+// TCK divisor change if div >= 0, a bit bang mode change if mode >= 0)
+typedef struct chunk {
+	int64_t ofs;
+	int length, rlength;
+	double sleep;
+	int div, mode;
+} CHUNK;
+
+// read only mapping of a whole file
+typedef struct mapped_file {
+	const unsigned char *buf;
+	size_t len;
+#ifdef _WIN32
+	HANDLE hfile, hmap;
+#endif
+} MAPPED_FILE;
+
+typedef struct cmd_stream {
+	int engine;
+	unsigned char *data;
+	int64_t len, cap;
+	CHUNK *chunk;
+	int nchunk, ccap, max_rlength;
+	VREC *vhead;		// TDO compares, read only while replayed
+	MAPPED_FILE map;	// data is in the mapped cache file
+} CMD_STREAM;
+
+// compiled SVF cache : the header, the stream data (padded to 8 bytes),
+// the chunks, then per TDO compare a CACHE_VREC and its TDO / MASK words
+#define CACHE_MAGIC		"PCSVFC2"
+typedef struct cache_header {
+	char magic[8];
+	uint64_t svf_hash;	// FNV-1a of the SVF
+	double svf_size;
+	double tck_max;		// settings the stream depends on
+	int32_t engine, mode, broadcast, fullsync;
+	int64_t data_len;
+	int32_t nchunk, max_rlength, nvrec, pad;
+} CACHE_HEADER;
+
+// pre-rendered bit bang waveform : the header, the sleep / divisor events
+// and (at an IMAGE_ALIGN offset) the bytes
+#define IMAGE_MAGIC		"PCWAVE1"
+#define IMAGE_PINS		0x3210	// bits of (TDO,TCK,TMS,TDI)
+typedef struct image_header {
+	char magic[8];
+	uint64_t sum;		// FNV-1a of the header (sum = 0), events and bytes
+	int32_t engine, pins, mode, nevent;
+	int64_t data_ofs, data_len;
+} IMAGE_HEADER;
+
+typedef struct image_event {
+	int64_t ofs;		// after the bytes up to ofs
+	double sleep;
+	int32_t div, pad;
+} IMAGE_EVENT;
+
+// a device known to hold the design of an SVF (-skip) : adapter, IDCODE,
+// SVF and verify SVF name the file, the USERCODE has to match as well
+#define DONE_MAGIC		"PCDONE2"
+typedef struct done_rec {
+	char magic[8];
+	uint64_t svf_hash, verify_hash;
+	double svf_size, verify_size;
+	uint32_t idcode, usercode;
+	char adapter[64];
+} DONE_REC;
+
+// checkpoint of an SVF run (-checkpoint) : where the next command starts
+// and what the commands before left, the header followed by the sticky
+// SIR / SDR / HIR / TIR / HDR / TDR (bits, tdo_valid and the bits and
+// words of TDI / TDO / MASK / SMASK of each)
+#define CKPT_MAGIC		"PCCKPT2"
+typedef struct ckpt_header {
+	char magic[8];
+	uint64_t svf_hash;
+	double svf_size;
+	double offset;		// after the RUNTEST of the checkpoint
+	double enable_ofs, enable_end;	// the ISC_ENABLE group replayed on resume
+	int32_t line, state, end_ir, end_dr;
+	int32_t run_state, run_end, run_clks, enable_line;
+	double run_sec;		// the last RUNTEST (-retry)
+	double freq;		// FREQUENCY in effect
+} CKPT_HEADER;
+
+typedef struct cache_vrec {
+	int64_t rd_start;
+	int32_t bits, engine, line, ir, hbits, unit, units, pad;
+} CACHE_VREC;
+
+// JTAG chains of -slice on one bit bang port : they share TCK and take
+// 3 pins each, their SVFs are clocked out in the same bytes
+#define MAX_SLICES	2
+
+typedef struct slice {
+	const char *fname;
+	int pins;		// bits of (TDO,TCK,TMS,TDI) as IMAGE_PINS
+	unsigned char map[8];	// D0-D2 of the encoded bytes to the pins
+	CMD_STREAM cs;
+	VERIFIER ver;
+} SLICE;
+
+// adapter of the multi adapter mode
+#define MAX_DEVICES	64
+#define SIM_DEVICES	4	// adapters of "-sim -dev all"
+
+typedef struct devinfo {
+	char id[64];
+	int type;
+} DEVINFO;
+
+typedef struct worker {
+	TRANSPORT *tp;
+	CMD_STREAM *cs;
+	VERIFIER ver;
+	const char *error;
+	double elapsed;
+	THREAD thread;
+} WORKER;
+
+#ifndef _WIN32
+// adapter kept open and initialized by the daemon; the jobs for it queue
+// on its lock
+typedef struct adapter {
+	DEVINFO dev;
+	TRANSPORT *tp;
+	int engine;
+	long jobs;
+	int busy;		// a job runs on it (under the ad_lock of the daemon)
+} ADAPTER;
+
+// job defaults and the lock of the parser / encoder globals (g_mode,
+// g_engine, g_usb, g_stat ...) : taken while holding an adapter, never
+// before; a job waits on idle for a free adapter
+typedef struct daemon_ctx {
+	ADAPTER *ad;
+	int nad, v;
+	int mode, broadcast, fullsync;
+	double tck_max;
+	pthread_mutex_t lock;
+	pthread_mutex_t ad_lock;	// busy of the adapters
+	pthread_cond_t idle;		// signalled when an adapter is released
+} DAEMON;
+
+typedef struct daemon_conn {
+	DAEMON *d;
+	int fd;
+} DAEMON_CONN;
+#endif
+
+// USB transfer buffer
+typedef struct iobuf {
+	unsigned char *data;	// size + 1 bytes (room for MPSSE_SEND_IMMEDIATE)
+	unsigned char *result;	// read back bytes
+	int length, rlength;
+} IOBUF;
+
+// lock free single producer / single consumer ring; a consumer that
+// finds it empty sleeps on cond until the producer pushes
+typedef struct spsc_queue {
+	IOBUF **ring;
+	int size;
+	int head, tail;		// advanced by the consumer / the producer
+	MUTEX lock;
+	COND cond;
+} SPSC_QUEUE;
+
+// SVF from a pipe, stdin or a gzip / xz file : the reader thread reads
+// and decompresses into READ_DEPTH buffers of READ_BUFSIZE bytes that go
+// round between it (done) and the tokenizer (full), so reading,
+// decompression and USB transfers overlap in constant memory
+#define READ_BUFSIZE	(256 * 1024)
+#define READ_DEPTH	4
+#define READ_PLAIN	0
+#define READ_GZIP	1
+#define READ_XZ		2
+
+typedef struct svf_reader {
+	FILE *fp;
+	int format;
+	unsigned char *in;	// compressed input
+	size_t in_len, in_pos;
+	int in_eof, in_error, finished;
+#ifndef NO_ZLIB
+	z_stream zs;
+#endif
+#ifndef NO_LZMA
+	lzma_stream xs;
+#endif
+	IOBUF pool[READ_DEPTH];
+	SPSC_QUEUE full, done;
+	IOBUF *cur;		// tokenizer side : the buffer being copied
+	int cur_pos, end;
+	THREAD thread;
+	int started, stop, error;
+	int refs;		// the tokenizer and the thread, the last one frees
+} SVF_READER;
+
+// USB I/O pipeline : the parser fills buffers and passes them to the I/O
+// thread on 'full'; the I/O thread writes them, reads back the previous
+// buffer while the next one is on its way and returns them on 'done'
+typedef struct usb_queue {
+	int length, size;	// bytes in / capacity of buff
+	unsigned char *buff;	// data of cur
+	IOBUF *cur, *pool;
+	IOBUF **spare;		// free buffers on the parser side
+	int depth, nspare;
+	SPSC_QUEUE full, done;
+	TRANSPORT *tp;
+	int threaded, stop, io_error;
+	THREAD thread;
+	IOBUF *io_prev;		// written, not read back yet (I/O side)
+	double stall_parser;	// parser waiting for a free buffer
+	double stall_io;	// I/O thread waiting for a full buffer
+	int64_t rd_queued;	// read back bytes requested so far
+	VERIFIER ver;		// pending TDO compares
+	int scan_line, scan_ir;	// origin of the next scan
+	int scan_hbits, scan_unit, scan_units;
+	CMD_STREAM *record;	// buffers go to this stream instead of USB
+	int dry;		// buffers are thrown away (time estimate)
+	int64_t tcks, tck_mark;	// TCKs so far / at the last rate change
+	double tck_sec;		// time of the TCKs before tck_mark
+	double sleep_sec;	// host side sleeps
+	int sync;		// bit bang bytes are read back
+	int64_t rd_skipped;	// -c bit bang bytes clocked without read back
+	long mode_switches;
+} USB_QUEUE;
+
+// per SVF command type totals
+typedef struct cmd_stat {
+	long count;
+	int64_t tcks;
+	double sec;
+} CMD_STAT;
+
+// instrumentation of the parser thread
+typedef struct run_stat {
+	double parse_sec;	// tokenizing and decoding
+	double encode_sec;	// encoding, including the waits for USB buffers
+	double wait_sec;	// of encode_sec, waiting for USB buffers
+	int64_t tck[NUM_TCK];
+	CMD_STAT cmd[NUM_CMD];
+	double last_t;		// end of the previous command
+	int64_t last_tcks;
+	double last_stall;
+	double prog_t;		// previous progress line
+	int64_t prog_tcks;
+	long retries;		// XSVF scans shifted again (XREPEAT)
+} RUN_STAT;
+
+// TCK low / high byte pairs of the 4 TDI bits of a nibble (bit 0 first,
+// TMS = 0) for the bulk encoder
+static const unsigned char bb_nibble[16][8] = {
+	{0x00, 0x04, 0x00, 0x04, 0x00, 0x04, 0x00, 0x04},
+	{0x01, 0x05, 0x00, 0x04, 0x00, 0x04, 0x00, 0x04},
+	{0x00, 0x04, 0x01, 0x05, 0x00, 0x04, 0x00, 0x04},
+	{0x01, 0x05, 0x01, 0x05, 0x00, 0x04, 0x00, 0x04},
+	{0x00, 0x04, 0x00, 0x04, 0x01, 0x05, 0x00, 0x04},
+	{0x01, 0x05, 0x00, 0x04, 0x01, 0x05, 0x00, 0x04},
+	{0x00, 0x04, 0x01, 0x05, 0x01, 0x05, 0x00, 0x04},
+	{0x01, 0x05, 0x01, 0x05, 0x01, 0x05, 0x00, 0x04},
+	{0x00, 0x04, 0x00, 0x04, 0x00, 0x04, 0x01, 0x05},
+	{0x01, 0x05, 0x00, 0x04, 0x00, 0x04, 0x01, 0x05},
+	{0x00, 0x04, 0x01, 0x05, 0x00, 0x04, 0x01, 0x05},
+	{0x01, 0x05, 0x01, 0x05, 0x00, 0x04, 0x01, 0x05},
+	{0x00, 0x04, 0x00, 0x04, 0x01, 0x05, 0x01, 0x05},
+	{0x01, 0x05, 0x00, 0x04, 0x01, 0x05, 0x01, 0x05},
+	{0x00, 0x04, 0x01, 0x05, 0x01, 0x05, 0x01, 0x05},
+	{0x01, 0x05, 0x01, 0x05, 0x01, 0x05, 0x01, 0x05},
+};
+
 // ========== global variables ==========
-int g_no_match = 0;
+int g_max_report = 16;	// SIR/SDR with mismatches to list
+int g_broadcast = 1;	// identical devices programmed by each SIR/SDR
+int g_sim_chain = 1;	// CPLDs in the chain of the simulator
+double g_sim_tck = 0;	// fastest reliable TCK of the simulator (0 : any)
 int g_mode = 0;
+double g_tck_hz = BITBANG_TCK_HZ;	// TCK rate of the engine
+int g_tck_div = -1;	// TCK divisor of the engine (-1 : not set yet)
+double g_tck_max = 0;	// TCK limit of -freq / autotune (0 : engine default)
+double g_svf_freq = 0;	// TCK limit of the SVF FREQUENCY (0 : none)
+int g_usb_xfer = 0;	// USB transfer size of the driver (0 : driver default)
+int g_latency = USB_LATENCY;	// latency timer in ms (0 : driver default)
+int g_engine = ENGINE_AUTO;
+USB_QUEUE g_usb;
+RUN_STAT g_stat;
+int g_progress = 0;	// print the progress line
+int g_fullsync = 0;	// -c : keep bit bang synchronous (no async runs)
+const char *g_cache_dir = NULL;	// compiled SVF cache (NULL : off)
+int g_bb_mask = 7;	// bit bang output pins
+int g_nslice = 0;	// -slice chains (0 : one chain on D0-D3)
+int g_slice_pins[MAX_SLICES];	// their pins (the simulator wires them so)
+int g_retry = 0;	// -retry : shift a mismatching SDR again up to n times
+const char *g_ckpt_file = NULL;	// -checkpoint (NULL : off)
+CKPT_HEADER g_ckpt;	// the SVF of the run / the last checkpoint
+double g_ckpt_t;	// time of the last checkpoint
+int g_ckpt_saved = 0;	// the file holds a checkpoint of this SVF
 
 // ========== prototypes ==========
 // examine whether ch is blank character or not
@@ -56,59 +772,305 @@ int is_blank(int ch);
 // examine whether ch is semicolon or not
 int is_semi(int ch);
 
-// get word from file FP
-int get_word(FILE *fp, char *dst, int *end_semi);
+// open / close SVF file (memory mapped if possible)
+int svf_open(SVF_PARSER *ps, const char *fname);
+int svf_open_file(SVF_PARSER *ps, FILE *fp);
+void svf_close(SVF_PARSER *ps);
 
-// skip brace ()
-int skip_brace(char *src, char *dst);
+// format of a file starting with p (READ_PLAIN, READ_GZIP, READ_XZ)
+int svf_packed(const unsigned char *p, size_t n);
 
-// examine whether ch is a hex character or not
-int is_hex_char(int ch);
+// start / stop the reader thread of fp, copy its next bytes
+// (0 : end of the SVF or error)
+SVF_READER *reader_open(FILE *fp);
+void reader_close(SVF_READER *r);
+size_t reader_read(SVF_READER *r, char *dst, size_t n);
 
-// get the value of the hex character
+// get word from the SVF
+int get_word(SVF_PARSER *ps, TOKEN *t, int *end_semi);
+
+// examine whether the token is the string s
+int tok_is(TOKEN *t, const char *s);
+
+
+// get the value of the hex character (-1 if it's not a hex character)
 int value_of_hex_char(int ch);
 
 // get the hex character of the value
 int hex_char_of_value(int v);
 
 // examine whether keyw is the keyword that can be ignored
-int is_ignore(char *keyw);
+int is_ignore(TOKEN *keyw);
 
 // examine whether keyw is "SIR" or "SDR"
-int sir_sdr(char *keyw);
+int sir_sdr(TOKEN *keyw);
 
 // examine whether keyw is integer
-int is_integer(char *keyw);
+int is_integer(TOKEN *keyw);
+
+// examine whether keyw is a real number (e.g. 1.5E-3)
+int is_number(TOKEN *keyw);
+
+// get the value of the real number keyw
+double double_of_token(TOKEN *keyw);
+
+// get the integer value of keyw (-1 : it doesn't fit an int)
+int int_of_token(TOKEN *keyw);
+
+// resize bit vector (the buffer is only reallocated when it grows)
+int bv_resize(BITVEC *bv, int bits);
+
+// set all bits of the bit vector to v
+void bv_fill(BITVEC *bv, int v);
 
-// make default mask of w bits
-void make_mask(int w, char *dst);
+// whether any bit of the bit vector is 1
+int bv_any(BITVEC *bv);
 
-// make zero of w bits
-void make_zero(int w, char *dst);
+// decode (hex) into the bit vector
+int bv_of_hex(BITVEC *bv, TOKEN *t, int bits);
+
+// print the bit vector in hex
+void bv_print(FILE *fp, BITVEC *bv);
 
 // address TDI / TDO / SMASK / MASK
-int do_param(FILE *fp, char *keyw, char* kind, char* param, int *semi);
+int do_param(SVF_PARSER *ps, BITVEC *param, int bits, int *semi);
+
+// read the length and the parameters of SIR/SDR/HIR/TIR/HDR/TDR
+int read_scan(SVF_PARSER *ps, SCAN_PARAM *sp);
+
+// read the parameters of RUNTEST
+int read_runtest(SVF_PARSER *ps, RUNTEST_PARAM *rt);
+
+// copy n bits of src to dst from bit pos (dst is zero there)
+void bv_put(BITVEC *dst, int pos, BITVEC *src, int n);
+
+// header, n copies of the payload and trailer in one scan
+int compose_scan(SCAN_PARAM *dst, SCAN_PARAM *hd, SCAN_PARAM *sp, int n, SCAN_PARAM *tl);
 
 // reset TAP machine
-int reset_tap(FT_HANDLE ftHandle, int *current_state);
+int reset_tap(TRANSPORT *tp, int *current_state);
+
+// wait (TCK with TMS unchanged)
+int wait(TRANSPORT *tp, int tms, int wait_clks);
 
-// wait
-int wait(FT_HANDLE ftHandle, int wait_clks);
+// idle TCK of the bit bang engine
+int bb_clocks(TRANSPORT *tp, int tms, int clks);
+
+// switch -c between synchronous and asynchronous bit bang
+int bb_mode(TRANSPORT *tp, int sync);
+int bb_async(int n);
 
 // transit state
-int transit(FT_HANDLE ftHandle, int *current, int next, int wait_clks);
+int transit(TRANSPORT *tp, int *current, int next, int wait_clks);
+
+// queue the TDO compare of a scan
+int verify_add(BITVEC *tdo, BITVEC *mask, int bits, int64_t rd_start);
+
+// compare the read back bytes with the pending scans
+int verify_feed(VERIFIER *vf, unsigned char *data, int len);
+
+// compare a completed scan and report its mismatches
+void verify_vec(VERIFIER *vf, VREC *r);
+
+// free a list of scans
+void vrec_free(VREC *r);
+
+// start / stop the USB I/O pipeline
+int usb_open(TRANSPORT *tp, int depth, int size, int threaded);
+void usb_close(void);
+
+// pass the USB staging buffer to the I/O side (flush waits for all read backs)
+int usb_flush(TRANSPORT *tp, int flush);
+
+// sleep on the host after everything is clocked out
+int usb_sleep(TRANSPORT *tp, double sec);
+
+// put the adapter into the mode of the engine
+int engine_mode(TRANSPORT *tp, int engine);
+
+// initialize the adapter for the JTAG engine
+int engine_init(TRANSPORT *tp);
+
+// TCK rate of a divisor / divisor of the fastest rate up to hz
+double tck_rate(int engine, int div);
+int tck_div(int engine, double hz);
+
+// change the TCK divisor / apply the limits of -freq and FREQUENCY
+int set_tck(TRANSPORT *tp, int div);
+int apply_tck(TRANSPORT *tp);
+
+// seconds the TCKs and sleeps so far take
+double usb_tck_sec(void);
+
+// find the fastest TCK rate without TDO errors
+int autotune(TRANSPORT *tp);
+
+// find the fastest USB buffer size, transfer size and latency timer
+int calibrate(TRANSPORT *tp, int qdepth, int threaded, int *bufsize);
+
+// time to run the SVF at the current TCK limits (-1 : error)
+double estimate_svf(const char *fname);
+
+// start / join a thread
+int thread_start(THREAD *th, THREAD_PROC proc, void *arg);
+void thread_join(THREAD th);
+void thread_detach(THREAD th);
+
+// encode the SVF into a command stream / replay it on an adapter
+CHUNK *stream_chunk(CMD_STREAM *cs);
+int stream_add(CMD_STREAM *cs, unsigned char *data, int len, int rlength, double sleep, int div, int mode);
+int stream_record(SVF_PARSER *ps, CMD_STREAM *cs, int engine, int v);
+int stream_replay(TRANSPORT *tp, CMD_STREAM *cs, VERIFIER *vf);
+int stream_check(CMD_STREAM *cs);
+void stream_free(CMD_STREAM *cs);
+
+// map / unmap a whole file read only
+int map_file(MAPPED_FILE *mf, const char *fname);
+void unmap_file(MAPPED_FILE *mf);
+
+// the command stream of the SVF, from the cache or recorded (and cached);
+// returns the parse_svf error code (-1 out of memory, -2 can't open)
+int stream_compile(const char *fname, CMD_STREAM *cs, int engine, int v, int *line);
+
+// -skip : read the IDCODE / USERCODE of the device next to TDO, decide
+// whether the device holds the design of fname (1 : yes, 0 : no, -1 :
+// error) and remember a device verified after programming
+int read_ids(TRANSPORT *tp, uint32_t *idcode, uint32_t *usercode);
+int skip_check(TRANSPORT *tp, const char *fname, const char *verify, int v, DONE_REC *rec);
+int done_store(DONE_REC *rec);
+
+// -retry : shift an SDR again while its TDO doesn't match
+int retry_same(SVF_PARSER *ps, SCAN_PARAM *sp);
+int scan_try(SVF_PARSER *ps, TRANSPORT *tp, SCAN_PARAM *sp, int line, int *current_state, int *match);
+int svf_retry(SVF_PARSER *ps, TRANSPORT *tp, SCAN_PARAM *sp, int line, RUNTEST_PARAM *rt, int *current_state);
+
+// -checkpoint : look for a checkpoint of the SVF and skip to it (-1 : error,
+// 1 : resumed), restore the chain after the reset, take a checkpoint, and
+// remove it after a good run
+int ckpt_open(SVF_PARSER *ps, const char *fname);
+int ckpt_restore(SVF_PARSER *ps, TRANSPORT *tp, const char *fname, int *current_state);
+// -checkpoint : note an SIR at ofs (the ISC_ENABLE groups)
+void ckpt_sir(SVF_PARSER *ps, SCAN_PARAM *sp, double ofs, int line);
+int ckpt_take(SVF_PARSER *ps, TRANSPORT *tp, int state, int end_ir, int end_dr, RUNTEST_PARAM *rt);
+void ckpt_finish(int ok);
+
+// skip the SVF up to offset
+int svf_seek(SVF_PARSER *ps, double offset);
+
+// render the bit bang waveform of the SVF / stream it to the adapter
+int render_image(const char *fname, const char *image, int v);
+int image_load(CMD_STREAM *cs, const char *image);
+int image_replay(TRANSPORT *tp, const char *image);
+
+// write the SVF with redundant commands removed to fp and report the TCKs saved
+int optimize_svf(const char *fname, FILE *fp);
 
-// output bit data
-int outBit(FT_HANDLE ftHandle, int tms, int tdi, int tdo, int mask, int flush);
+// the adapters of list ("all" or ids separated by ','), returns how many
+int find_devices(DEVINFO *dev, const char *list, int sim);
+
+// program the adapters of list in parallel
+int run_multi(const char *fname, const char *list, int sim, int v);
+
+// keep the adapters of list open and run the jobs of the socket path
+int run_daemon(const char *path, const char *list, int sim, int v);
+
+// -slice : pins of an argument (-1 : bad), the bytes of all chains in one
+// stream / its replay with the TDO of each chain checked on its own
+int slice_pins(const char *arg);
+int slice_setup(SLICE *sl, int n);
+int slice_merge(SLICE *sl, int n, CMD_STREAM *cs);
+int slice_replay(TRANSPORT *tp, SLICE *sl, int n, CMD_STREAM *cs);
+int run_slices(SLICE *sl, int n, const char *id, int sim, int v);
+
+// output bit data (bit bang)
+int outBit(TRANSPORT *tp, int tms, int tdi);
+
+// output TMS sequence
+int outTMS(TRANSPORT *tp, int tms, int len);
+
+// expand TDI bits into bit bang bytes
+void encode_bits(unsigned char *dst, BITVEC *tdi, int start, int n);
 
 // output data
-int outData(FT_HANDLE ftHandle, int bitw, char *tdi, char *smask, char *tdo, char *mask);
+int outData(TRANSPORT *tp, int bitw, BITVEC *tdi, BITVEC *tdo, BITVEC *mask);
+
+// compare outBit and the bulk encoder
+int bench_encoder(int bits);
+
+// write a synthetic SVF of kind ("rows", "sir", "runtest", "verify")
+int gen_svf(const char *fname, const char *kind, double size);
+
+// parse / encode / full pipeline passes over the synthetic SVFs
+int bench_svf(double size);
+
+// MPSSE engine
+int mpsse_cmd(TRANSPORT *tp, int n, int c0, int c1, int c2);
+int mpsse_init(TRANSPORT *tp, int div);
+int mpsse_tms(TRANSPORT *tp, int tms, int len);
+int mpsse_shift(TRANSPORT *tp, int bitw, BITVEC *tdi, BITVEC *tdo, BITVEC *mask);
+int mpsse_clocks(TRANSPORT *tp, int clks);
 
 // get state from state name
-int state_of_string(char *n, int *s);
+int state_of_string(TOKEN *n, int *s);
 
-// parse SVF file
-int parse_svf(FILE *fp, FT_HANDLE ftHandle, int v, int *current_state);
+// TCKs of a RUNTEST at the actual TCK (*sleep : seconds to sleep instead)
+int run_clocks(int clks, double min_time, double *sleep);
+
+// shift a SIR / SDR with the header / trailer of the chain
+int shift_scan(SVF_PARSER *ps, TRANSPORT *tp, SCAN_PARAM *sp, int ir, int line, int *current_state);
+
+// parse SVF file (or XSVF, see is_xsvf)
+int parse_svf(SVF_PARSER *ps, TRANSPORT *tp, int v, int *current_state);
+
+// tokenize the whole SVF and report the tokenizer throughput
+int parse_only(SVF_PARSER *ps);
+
+// whether the input is XSVF / run it (exec 0 : only decode it)
+int is_xsvf(SVF_PARSER *ps);
+int xsvf_run(SVF_PARSER *ps, TRANSPORT *tp, int v, int *current_state, int exec);
+
+// write the SVF as XSVF
+int write_xsvf(const char *fname, FILE *fp, int repeat);
+
+// current time in seconds
+double now_sec(void);
+
+// sleep sec seconds
+void sleep_sec(double sec);
+
+// write to / read from the transport
+void lat_add(long *hist, double *total, double sec);
+int tp_write(TRANSPORT *tp, unsigned char *buf, int len);
+int tp_read(TRANSPORT *tp, unsigned char *buf, int len);
+
+// clear the statistics of the transport
+void tp_clear_stat(TRANSPORT *tp);
+
+// print transfer statistics
+void print_stat(TRANSPORT *tp, double elapsed);
+
+// start the instrumentation of a run / account the command just parsed
+void stat_start(void);
+void stat_cmd(SVF_PARSER *ps, int cmd, double t_enc);
+
+// print the progress line
+void progress(SVF_PARSER *ps, double t, int last);
+
+// write the JSON run report (path "-" : stdout)
+int write_report(const char *path, const char *fname, TRANSPORT *tp, double elapsed);
+
+// transport of the FTDI D2XX driver (NULL if not compiled in),
+// id is the serial number or the description (NULL : the first device)
+TRANSPORT *ftdi_transport(const char *id);
+
+// list the FTDI devices
+int ftdi_list(DEVINFO *list, int max);
+
+// transport of the simulated FT232R (or FT232H) / CPLD
+TRANSPORT *sim_transport(int dev_type);
+
+// transport that throws away the data (for benchmarks)
+TRANSPORT *null_transport(void);
 
 // ========== functions ==========
 // examine whether ch is blank character or not
@@ -128,70 +1090,229 @@ int is_lf(int ch)
 	return (ch == '\n' || ch == '\r');
 }
 
-// get a word from FILE* fp
+// open SVF file : a regular uncompressed file is memory mapped, anything
+// else ("-" is stdin) goes through the reader thread into a growing
+// read buffer
+int svf_open(SVF_PARSER *ps, const char *fname)
+{
+	FILE *fp;
+
+	memset(ps, 0, sizeof(SVF_PARSER));
+	ps->line = 1;
+#ifdef _WIN32
+	if (strcmp(fname, "-")) {
+		LARGE_INTEGER size;
+
+		ps->hfile = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (ps->hfile == INVALID_HANDLE_VALUE) return 0;
+		if (GetFileSizeEx(ps->hfile, &size) && size.QuadPart > 0) {
+			ps->hmap = CreateFileMappingA(ps->hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (ps->hmap) ps->buf = (const char *)MapViewOfFile(ps->hmap, FILE_MAP_READ, 0, 0, 0);
+			if (ps->buf && svf_packed((const unsigned char *)ps->buf, (size_t)size.QuadPart) != READ_PLAIN) {
+				UnmapViewOfFile(ps->buf);
+				ps->buf = NULL;
+			}
+			if (ps->buf) {
+				ps->len = (size_t)size.QuadPart;
+				ps->size = (double)ps->len;
+				ps->mapped = 1;
+				return 1;
+			}
+			if (ps->hmap) CloseHandle(ps->hmap);
+		}
+		CloseHandle(ps->hfile);
+		ps->hfile = NULL;
+		ps->hmap = NULL;
+	}
+#else
+	if (strcmp(fname, "-")) {
+		struct stat st;
+		int fd = open(fname, O_RDONLY);
+
+		if (fd < 0) return 0;
+		if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+			void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED && svf_packed((const unsigned char *)p, st.st_size) != READ_PLAIN) {
+				munmap(p, st.st_size);
+				p = MAP_FAILED;
+			}
+			if (p != MAP_FAILED) {
+				madvise(p, st.st_size, MADV_SEQUENTIAL);
+				close(fd);
+				ps->buf = (const char *)p;
+				ps->len = st.st_size;
+				ps->size = (double)ps->len;
+				ps->mapped = 1;
+				return 1;
+			}
+		}
+		close(fd);
+	}
+#endif
+	if (!strcmp(fname, "-")) return svf_open_file(ps, stdin);
+	if (fopen_s(&fp, fname, "rb")) return 0;
+	return svf_open_file(ps, fp);
+}
+
+// read the SVF from fp (closed by the reader unless it is stdin, or by
+// svf_close if this fails)
+int svf_open_file(SVF_PARSER *ps, FILE *fp)
+{
+	memset(ps, 0, sizeof(SVF_PARSER));
+	ps->line = 1;
+	ps->fp = fp;
+	ps->rcap = SVF_READ_SIZE;
+	ps->rbuf = (char *)malloc(ps->rcap);
+#ifdef _WIN32
+	if (fp == stdin) _setmode(_fileno(stdin), _O_BINARY);
+#endif
+	if (!ps->rbuf || !(ps->rd = reader_open(fp))) {
+		svf_close(ps);
+		return 0;
+	}
+	ps->fp = NULL;
+	ps->buf = ps->rbuf;
+	return 1;
+}
+
+// close SVF file
+void svf_close(SVF_PARSER *ps)
+{
+	SCAN_PARAM *sp;
+
+	if (ps->mapped) {
+#ifdef _WIN32
+		UnmapViewOfFile(ps->buf);
+		CloseHandle(ps->hmap);
+		CloseHandle(ps->hfile);
+#else
+		munmap((void *)ps->buf, ps->len);
+#endif
+	}
+	if (ps->rd) reader_close(ps->rd);
+	if (ps->fp && ps->fp != stdin) fclose(ps->fp);
+	free(ps->rbuf);
+	for (sp = &ps->sir; sp <= &ps->xseg; sp++) {
+		free(sp->tdi.w);
+		free(sp->tdo.w);
+		free(sp->mask.w);
+		free(sp->smask.w);
+	}
+	free(ps->retry_tdi.w);
+	memset(ps, 0, sizeof(SVF_PARSER));
+}
+
+// read more of the SVF into the window, the bytes from ps->mark on are kept
+// return 0 at the end of file
+int svf_fill(SVF_PARSER *ps)
+{
+	size_t n;
+
+	if (ps->mapped || !ps->rd) return 0;
+	if (ps->mark > 0) {
+		memmove(ps->rbuf, ps->rbuf + ps->mark, ps->len - ps->mark);
+		ps->consumed += ps->mark;
+		ps->len -= ps->mark;
+		ps->pos -= ps->mark;
+		ps->mark = 0;
+	}
+	if (ps->len == ps->rcap) {
+		char *p;
+
+		if (ps->rcap >= SVF_TOKEN_MAX) {
+			ps->read_error = 34;
+			return 0;
+		}
+		if (!(p = (char *)realloc(ps->rbuf, ps->rcap * 2))) return 0;
+		ps->rbuf = p;
+		ps->rcap *= 2;
+	}
+	ps->buf = ps->rbuf;
+	n = reader_read(ps->rd, ps->rbuf + ps->len, ps->rcap - ps->len);
+	if (n == 0 && ATOMIC_LOAD(&ps->rd->error)) ps->read_error = 31;
+	ps->len += n;
+	return (n > 0);
+}
+
+// skip the SVF up to offset (the window is dropped on the way)
+int svf_seek(SVF_PARSER *ps, double offset)
+{
+	while (ps->consumed + ps->len < offset) {
+		ps->mark = ps->pos = ps->len;
+		if (!svf_fill(ps)) return 0;
+	}
+	ps->pos = ps->mark = (size_t)(offset - ps->consumed);
+	return 1;
+}
+
+// peek the character at ps->pos + ofs (-1 at the end of file)
+#define SVF_PEEK(ps, ofs) \
+	(((ps)->pos + (ofs) < (ps)->len || svf_fill(ps)) && (ps)->pos + (ofs) < (ps)->len ? \
+	(unsigned char)(ps)->buf[(ps)->pos + (ofs)] : -1)
+
+// get a word from the SVF
 // return 1 if success
-int get_word(FILE *fp, char *dst, int *end_semi)
+int get_word(SVF_PARSER *ps, TOKEN *t, int *end_semi)
 {
-	static char ch = 0;
-	int semi = 0;
+	int ch, semi = 0, len;
 
-	// pre read
-	if (!ch) ch = fgetc(fp);
 SCAN_START:
-	if (feof(fp)) return 0;
-	// skip blank
-	while (is_blank(ch) || is_lf(ch)) {
-		if (feof(fp)) return 0;
-		ch = fgetc(fp);
+	// skip blank (and the ';' of empty commands)
+	ps->mark = ps->pos;
+	while ((ch = SVF_PEEK(ps, 0)) >= 0 && (is_blank(ch) || is_lf(ch) || is_semi(ch))) {
+		if (ch == '\n') ps->line++;
+		ps->mark = ++ps->pos;
 	}
+	if (ch < 0) return 0;
 	// skip comment
-	if (ch == '/') {
-		ch = fgetc(fp);
-		if (ch == '/') {
-			while (!is_lf(ch)) {
-				if (feof(fp)) return 0;
-				ch = fgetc(fp);
-			};
-			goto SCAN_START;
-		} else *(dst++) = '/';
+	if (ch == '!' || (ch == '/' && SVF_PEEK(ps, 1) == '/')) {
+		while ((ch = SVF_PEEK(ps, 0)) >= 0 && !is_lf(ch)) ps->mark = ++ps->pos;
+		goto SCAN_START;
 	}
 	// actual read
-	while (!(is_blank(ch) || is_semi(ch))) {
-		if(!is_lf(ch)) *(dst++) = ch;
-		if (feof(fp)) break;
-		ch = fgetc(fp);
-	}
-	*dst = 0;
-	// skip blank again
-	while (is_blank(ch) || is_semi(ch) || is_lf(ch)) {
-		if (!semi && is_semi(ch)) semi = 1;
-		if (feof(fp)) break;
-		ch = fgetc(fp);
+	t->line = ps->line;
+	if (ch == '(') {
+		// (hex data) may contain blanks and line feeds
+		while ((ch = SVF_PEEK(ps, 0)) >= 0 && ch != ')') {
+			if (ch == '\n') ps->line++;
+			ps->pos++;
+		}
+		if (ch == ')') ps->pos++;
+	} else {
+		while ((ch = SVF_PEEK(ps, 0)) >= 0 && !(is_blank(ch) || is_lf(ch) || is_semi(ch) || ch == '(')) ps->pos++;
+	}
+	len = (int)(ps->pos - ps->mark);
+	// skip blank again, up to the ';' of the command : nothing after it is
+	// read yet, so a command from a pipe runs as soon as it comes
+	while ((ch = SVF_PEEK(ps, 0)) >= 0 && (is_blank(ch) || is_semi(ch) || is_lf(ch))) {
+		if (ch == '\n') ps->line++;
+		ps->pos++;
+		if (is_semi(ch)) {
+			semi = 1;
+			break;
+		}
 	}
+	// the window may have moved while skipping
+	t->str = ps->buf + ps->mark;
+	t->len = len;
+	ps->tokens++;
 	*end_semi = semi;
 	return 1;
 }
 
-// skip brace ()
-int skip_brace(char *src, char *dst)
-{
-	if (*(src++) != '(') return 0;
-	while (*src != ')') { *(dst++) = *(src++); }
-	*dst = 0;
-	return 1;
-}
-
-// examine whether ch is a hex character or not
-int is_hex_char(int ch)
+// examine whether the token is the string s
+int tok_is(TOKEN *t, const char *s)
 {
-	return ('0' <= ch && ch <= '9') || ('a' <= ch && ch <= 'f');
+	return (!strncmp(t->str, s, t->len) && s[t->len] == 0);
 }
 
-// get the value of the hex character
+// get the value of the hex character (-1 if it's not a hex character)
 int value_of_hex_char(int ch)
 {
 	if ('0' <= ch && ch <= '9') return ch - '0';
-	return (ch - 'a' + 10);
+	if ('a' <= ch && ch <= 'f') return (ch - 'a' + 10);
+	if ('A' <= ch && ch <= 'F') return (ch - 'A' + 10);
+	return -1;
 }
 
 // get the hex character of the value
@@ -202,540 +1323,5529 @@ int hex_char_of_value(int v)
 }
 
 // examine whether keyw is ignore keyword or not
-int is_ignore(char *keyw)
+int is_ignore(TOKEN *keyw)
 {
 	int i;
-	const char ignores[6][10] = {"HIR", "TIR", "HDR", "TDR", "TRST", "FREQUENCY"};
+	const char ignores[1][10] = {"TRST"};
 
-	for (i = 0; i < 6; i++) {
-		if (!strcmp(ignores[i], keyw)) return 1;
+	for (i = 0; i < 1; i++) {
+		if (tok_is(keyw, ignores[i])) return 1;
 	}
 	return 0;
 }
 
 // examine whether keyw is SIR or SDR
-int sir_sdr(char *keyw)
+int sir_sdr(TOKEN *keyw)
 {
 	int i;
 	const char coms[2][4] = {"SIR", "SDR"};
 
 	for (i = 0; i < 2; i++)
-		if (!strcmp(coms[i], keyw)) return 1;
+		if (tok_is(keyw, coms[i])) return 1;
 	return 0;
 }
 
 // examine whether kew is integer
-int is_integer(char *keyw)
+int is_integer(TOKEN *keyw)
 {
-	const char *src = keyw;
-	int c;
-	while (c = *src++) { if (!isdigit(c)) return 0; }
+	int i;
+
+	if (keyw->len == 0) return 0;
+	for (i = 0; i < keyw->len; i++) { if (!isdigit((unsigned char)keyw->str[i])) return 0; }
 	return 1;
 }
 
-// make default mask of w bits
-void make_mask(int w, char *dst)
+// examine whether keyw is a real number (digits, '.', exponent)
+int is_number(TOKEN *keyw)
 {
-	int i, d = 0, n = w / 4, m = w % 4, len = (w+3)/4;
+	int i, digits = 0, dot = 0;
 
-	while (m-- > 0) d = d*2+1;
-	if (d) *(dst++) = hex_char_of_value(d);
-	for (i = 0; i < n; i++) *(dst++) = 'f';
-	*dst = 0;
+	for (i = 0; i < keyw->len; i++) {
+		if (isdigit((unsigned char)keyw->str[i])) digits++;
+		else if (keyw->str[i] == '.' && !dot) dot = 1;
+		else break;
+	}
+	if (!digits) return 0;
+	if (i < keyw->len && (keyw->str[i] == 'E' || keyw->str[i] == 'e')) {
+		i++;
+		if (i < keyw->len && (keyw->str[i] == '+' || keyw->str[i] == '-')) i++;
+		if (i == keyw->len) return 0;
+		for (; i < keyw->len; i++) { if (!isdigit((unsigned char)keyw->str[i])) return 0; }
+	}
+	return (i == keyw->len);
 }
 
-// make zero of w bits
-void make_zero(int w, char *dst)
+// get the value of the real number keyw
+double double_of_token(TOKEN *keyw)
 {
-	int i, len = (w+3)/4;
+	char buff[64];
+	int len = (keyw->len < 63) ? keyw->len : 63;
 
-	for (i=0; i<len; i++) *(dst++) = '0';
-	*dst = 0;
+	memcpy(buff, keyw->str, len);
+	buff[len] = '\0';
+	return strtod(buff, NULL);
 }
 
-// address TDI / TDO / SMASK / MASK
-int do_param(FILE *fp, char *keyw, char* kind, char* param, int *semi)
+// get the integer value of keyw (-1 : it doesn't fit an int)
+int int_of_token(TOKEN *keyw)
+{
+	int i, d, n = 0;
+
+	for (i = 0; i < keyw->len; i++) {
+		d = keyw->str[i] - '0';
+		if (n > (INT_MAX - d) / 10) return -1;
+		n = n * 10 + d;
+	}
+	return n;
+}
+
+// resize bit vector (the buffer is only reallocated when it grows)
+int bv_resize(BITVEC *bv, int bits)
 {
-	char buff[MAX_STR];
-	if (!strcmp(keyw, kind)) {
-		if (!get_word(fp, buff, semi)) return 0;
-		skip_brace(buff, param);
+	int words = BV_WORDS(bits);
+
+	if (words > bv->cap) {
+		uint64_t *w = (uint64_t *)realloc(bv->w, words * sizeof(uint64_t));
+		if (!w) return 0;
+		bv->w = w;
+		bv->cap = words;
 	}
+	bv->bits = bits;
 	return 1;
 }
 
-// output bit data
-int outBit(FT_HANDLE ftHandle, int tms, int tdi, int tdo, int mask, int flush)
+// set all bits of the bit vector to v
+void bv_fill(BITVEC *bv, int v)
 {
-	static int length = 0, explength[2]={0,0}, first = 1, index = 0;
-	static unsigned char buff[USB_BUFSIZE], expect[USB_BUFSIZE/2][2], result[USB_BUFSIZE];
-	DWORD written, read;
-	int i, j;
+	int words = BV_WORDS(bv->bits);
 
-	buff[length++] = ((tms << 1) | tdi);
-	buff[length++] = (4 | (tms << 1) | tdi);
-	if (g_mode == 1) expect[explength[index]++][index] = (mask ? (tdo | 2) : 0);
+	if (!words) return;
+	memset(bv->w, v ? 0xff : 0, words * sizeof(uint64_t));
+	if (v && (bv->bits & 63)) bv->w[words - 1] = (~(uint64_t)0) >> (64 - (bv->bits & 63));
+}
 
-	// write read to/from USB
-	if ((length == USB_BUFSIZE) || flush) {
-		FT_Write(ftHandle, buff, length, &written);
-		if (written != length) return 0;
-		length = 0;
-		if (g_mode == 1) {
-			if (!first) {
-				for (j=0; j<(flush+1); j++) {
-					int prev_idx = (index?0:1);
-					FT_Read(ftHandle, result, explength[prev_idx]*2, &read);
-					if (read != (explength[prev_idx]*2)) return 0;
-					for (i=0; i<explength[prev_idx]; i++) {
-						int exp = (expect[i][prev_idx]&1);
-						int msk = (expect[i][prev_idx]&2);
-						int res = ((result[i*2+1]&8)?1:0);
-						if (msk) {
-							if (exp != res) { g_no_match++; }
-						}
-					}
-					explength[prev_idx] = 0;
-					index = (index?0:1);
-				}
-				if (flush) first = 1;
-			} else {
-				index = (index?0:1);
-				first = 0;
-			}
-		}
+int bv_any(BITVEC *bv)
+{
+	int i;
+
+	for (i = 0; i < BV_WORDS(bv->bits); i++) {
+		if (bv->w[i]) return 1;
 	}
-	return 1;
+	return 0;
 }
 
-// output data
-int outData(FT_HANDLE ftHandle, int bitw, char *tdi, char *smask, char *tdo, char *mask)
-{
-	int i, tdi_, smask_, tdo_, mask_;
-
-	while (*(tdi++)) ; tdi -= 2;
-	while (*(smask++)) ; smask -= 2;
-	while (*(tdo++)) ; tdo -= 2;
-	while (*(mask++)) ; mask -= 2;
-	for (i = 0; i < bitw; i++) {
-		if ((i % 4) == 0) {
-			tdi_ = value_of_hex_char(*(tdi--));
-			smask_ = value_of_hex_char(*(smask--));
-			tdo_ = value_of_hex_char(*(tdo--));
-			mask_ = value_of_hex_char(*(mask--));
-		}
-		if (!outBit(ftHandle, (i == (bitw-1)) ? 1 : 0, (tdi_&1), (tdo_&1), (mask_&1), 0)) {
-			return 0;
-		}
-		tdi_ >>= 1;
-		smask_ >>= 1;
-		tdo_ >>= 1;
-		mask_ >>= 1;
+// decode (hex) into the bit vector, the last character holds bits 3..0
+int bv_of_hex(BITVEC *bv, TOKEN *t, int bits)
+{
+	const char *b = t->str, *p = t->str + t->len - 1;
+	int n = 0, v;
+
+	if (t->len < 2 || *b != '(' || *p != ')') return 0;
+	if (!bv_resize(bv, bits)) return 0;
+	bv_fill(bv, 0);
+	for (p--; p > b; p--) {
+		if (is_blank(*p) || is_lf(*p)) continue;
+		if ((v = value_of_hex_char(*p)) < 0) return 0;
+		// a nibble never straddles two words
+		if (n < bits) bv->w[n >> 6] |= (uint64_t)v << (n & 63);
+		n += 4;
 	}
+	// drop the bits beyond the scan length
+	if (bits & 63) bv->w[BV_WORDS(bits) - 1] &= (~(uint64_t)0) >> (64 - (bits & 63));
 	return 1;
 }
 
-// reset TAP machine
-int reset_tap(FT_HANDLE ftHandle, int *current_state)
+// print the bit vector in hex
+void bv_print(FILE *fp, BITVEC *bv)
 {
 	int i;
-	for (i = 0; i < 5; i++) if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-	*current_state = TEST_LOGIC_RESET;
-	return 1;
+
+	for (i = ((bv->bits + 3) & ~3) - 4; i >= 0; i -= 4) {
+		fputc(hex_char_of_value((int)((bv->w[i >> 6] >> (i & 63)) & 15)), fp);
+	}
 }
 
-int wait(FT_HANDLE ftHandle, int wait_clks) {
-	int i;
-	for (i = 0; i < wait_clks; i++) if (!outBit(ftHandle, 0, 0, 0, 0, 0)) return 0;
-	return 1;
+// address TDI / TDO / SMASK / MASK
+int do_param(SVF_PARSER *ps, BITVEC *param, int bits, int *semi)
+{
+	TOKEN buff;
+
+	if (!get_word(ps, &buff, semi)) return 0;
+	return bv_of_hex(param, &buff, bits);
 }
 
-// transit state
-int transit(FT_HANDLE ftHandle, int *current, int next, int wait_clks)
+// read the length and TDI / TDO / MASK / SMASK into sp; TDI, MASK and
+// SMASK are kept while the length is the same, MASK and SMASK default
+// to all 1 when it changes (returns the parse_svf error code, 0 : OK)
+int read_scan(SVF_PARSER *ps, SCAN_PARAM *sp)
 {
-	if (*current == next) {
-		if (!wait(ftHandle, wait_clks)) return 0;
-		return 1;
+	TOKEN keyw2;
+	int semi, bitw, has_tdi = 0;
+
+	if (!get_word(ps, &keyw2, &semi)) return 2;
+	if (!is_integer(&keyw2)) return 3;
+	bitw = int_of_token(&keyw2);
+	if (bitw < 0 || bitw > SCAN_MAX_BITS) return 3;
+	sp->tdo_valid = 0;
+	while (!semi) {
+		if (!get_word(ps, &keyw2, &semi)) return 4;
+		if (tok_is(&keyw2, "TDI")) { if (!do_param(ps, &sp->tdi, bitw, &semi)) return 5; has_tdi = 1; }
+		else if (tok_is(&keyw2, "TDO")) { if (!do_param(ps, &sp->tdo, bitw, &semi)) return 6; sp->tdo_valid = 1; }
+		else if (tok_is(&keyw2, "SMASK")) { if (!do_param(ps, &sp->smask, bitw, &semi)) return 7; }
+		else if (tok_is(&keyw2, "MASK")) { if (!do_param(ps, &sp->mask, bitw, &semi)) return 8; }
 	}
-	switch (*current) {
-	case TEST_LOGIC_RESET:
-		if (next != RUN_TEST) return 0;
-		if (!outBit(ftHandle, 0, 0, 0, 0, 0)) return 0;
-		*current = RUN_TEST;
-		break;
-	case RUN_TEST:
-		if (next == SELECT_DR_SCAN) {
-			if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-			*current = SELECT_DR_SCAN;
-		}
-		else if (next == PAUSE_DR) {
-			if (!transit(ftHandle, current, SELECT_DR_SCAN, 0)) return 0;
-			if (!transit(ftHandle, current, CAPTURE_DR, 0)) return 0;
-			if (!transit(ftHandle, current, EXIT1_DR, 0)) return 0;
-			if (!transit(ftHandle, current, PAUSE_DR, 0)) return 0;
-		} else if (next == PAUSE_IR) {
-			if (!transit(ftHandle, current, SELECT_DR_SCAN, 0)) return 0;
-			if (!transit(ftHandle, current, SELECT_IR_SCAN, 0)) return 0;
-			if (!transit(ftHandle, current, CAPTURE_IR, 0)) return 0;
-			if (!transit(ftHandle, current, EXIT1_IR, 0)) return 0;
-			if (!transit(ftHandle, current, PAUSE_IR, 0)) return 0;
-		} else if (next == SHIFT_DR) {
-			if (!transit(ftHandle, current, SELECT_DR_SCAN, 0)) return 0;
-			if (!transit(ftHandle, current, CAPTURE_DR, 0)) return 0;
-			if (!transit(ftHandle, current, SHIFT_DR, 0)) return 0;
-		} else if (next == SHIFT_IR) {
-			if (!transit(ftHandle, current, SELECT_DR_SCAN, 0)) return 0;
-			if (!transit(ftHandle, current, SELECT_IR_SCAN, 0)) return 0;
-			if (!transit(ftHandle, current, CAPTURE_IR, 0)) return 0;
-			if (!transit(ftHandle, current, SHIFT_IR, 0)) return 0;
-		} else { return 0; }
-		break;
-	case SELECT_DR_SCAN:
-		if (next == CAPTURE_DR) {
-			if (!outBit(ftHandle, 0, 0, 0, 0, 0)) return 0;
-			*current = CAPTURE_DR;
-		} else if (next == SELECT_IR_SCAN) {
-			if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-			*current = SELECT_IR_SCAN;
-		} else { return 0; }
-		break;
-	case CAPTURE_DR:
-		if (next == SHIFT_DR) {
-			if (!outBit(ftHandle, 0, 0, 0, 0, 0)) return 0;
-			*current = SHIFT_DR;
-		} else if (next == EXIT1_DR) {
-			if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-			*current = EXIT1_DR;
-		} else { return 0; }
-		break;
-	case SHIFT_DR:
-		if (next != EXIT1_DR) return 0;
-		if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-		*current = EXIT1_DR;
-		break;
-	case EXIT1_DR:
-		if (next == PAUSE_DR) {
-			if (!outBit(ftHandle, 0, 0, 0, 0, 0)) return 0;
-			*current = PAUSE_DR;
-		} else if (next == UPDATE_DR) {
-			if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-			*current = UPDATE_DR;
-		} else if (next == RUN_TEST) {
-			if (!transit(ftHandle, current, UPDATE_DR, 0)) return 0;
-			if (!transit(ftHandle, current, RUN_TEST, 0)) return 0;
-		} else { return 0; }
-		break;
-	case PAUSE_DR:
-		if (next == EXIT2_DR) {
-			if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-			*current = EXIT2_DR;
-		}
-		else if (next == RUN_TEST) {
-			if (!transit(ftHandle, current, EXIT2_DR, 0)) return 0;
-			if (!transit(ftHandle, current, UPDATE_DR, 0)) return 0;
-			if (!transit(ftHandle, current, RUN_TEST, 0)) return 0;
-		} else if (next == SHIFT_IR) {
-			if (!transit(ftHandle, current, EXIT2_DR, 0)) return 0;
-			if (!transit(ftHandle, current, UPDATE_DR, 0)) return 0;
-			if (!transit(ftHandle, current, SELECT_DR_SCAN, 0)) return 0;
-			if (!transit(ftHandle, current, SELECT_IR_SCAN, 0)) return 0;
-			if (!transit(ftHandle, current, CAPTURE_IR, 0)) return 0;
-			if (!transit(ftHandle, current, SHIFT_IR, 0)) return 0;
-		} else { return 0; }
-		break;
-	case EXIT2_DR:
-		if (next == SHIFT_DR) {
-			if (!outBit(ftHandle, 0, 0, 0, 0, 0)) return 0;
-			*current = SHIFT_DR;
-		} else if (next == UPDATE_DR) {
-			if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-			*current = UPDATE_DR;
-		} else { return 0; }
-		break;
-	case UPDATE_DR:
-		if (next == RUN_TEST) {
-			if (!outBit(ftHandle, 0, 0, 0, 0, 0)) return 0;
-			*current = RUN_TEST;
-		} else if (next == SELECT_DR_SCAN) {
-			if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-			*current = SELECT_DR_SCAN;
-		} else { return 0; }
-		break;
-	case SELECT_IR_SCAN:
-		if (next == CAPTURE_IR ) {
-			if (!outBit(ftHandle, 0, 0, 0, 0, 0)) return 0;
-			*current = CAPTURE_IR;
-		} else if (next == TEST_LOGIC_RESET) {
-			if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-			*current = TEST_LOGIC_RESET;
-		} else { return 0; }
-		break;
-	case CAPTURE_IR:
-		if (next == SHIFT_IR) {
-			if (!outBit(ftHandle, 0, 0, 0, 0, 0)) return 0;
-			*current = SHIFT_IR;
-		} else if (next == EXIT1_IR) {
-			if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-			*current = EXIT1_IR;
-		} else { return 0; }
-		break;
-	case SHIFT_IR:
-		if (next != EXIT1_IR) return 0;
-		if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-		*current = EXIT1_IR;
-		break;
-	case EXIT1_IR:
-		if (next == PAUSE_IR) {
-			if (!outBit(ftHandle, 0, 0, 0, 0, 0)) return 0;
-			*current = PAUSE_IR;
-		} else if (next == UPDATE_IR) {
-			if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-			*current = UPDATE_IR;
-		} else if (next == RUN_TEST) {
-			if (!transit(ftHandle, current, UPDATE_IR, 0)) return 0;
-			if (!transit(ftHandle, current, RUN_TEST, 0)) return 0;
-		} else { return 0; }
-		break;
-	case PAUSE_IR:
-		if (next == EXIT2_IR) {
-			if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-			*current = EXIT2_IR;
-		} else if (next == RUN_TEST) {
-			if (!transit(ftHandle, current, EXIT2_IR, 0)) return 0;
-			if (!transit(ftHandle, current, UPDATE_IR, 0)) return 0;
-			if (!transit(ftHandle, current, RUN_TEST, 0)) return 0;
-		} else if (next == SHIFT_DR) {
-			if (!transit(ftHandle, current, EXIT2_IR, 0)) return 0;
-			if (!transit(ftHandle, current, UPDATE_IR, 0)) return 0;
-			if (!transit(ftHandle, current, SELECT_DR_SCAN, 0)) return 0;
-			if (!transit(ftHandle, current, CAPTURE_DR, 0)) return 0;
-			if (!transit(ftHandle, current, SHIFT_DR, 0)) return 0;
-		} else { return 0; }
-		break;
-	case EXIT2_IR:
-		if (next == SHIFT_IR) {
-			if (!outBit(ftHandle, 0, 0, 0, 0, 0)) return 0;
-			*current = SHIFT_IR;
-		} else if (next == UPDATE_IR) {
-			if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-			*current = UPDATE_IR;
-		} else { return 0; }
-		break;
-	case UPDATE_IR:
-		if (next == RUN_TEST) {
-			if (!outBit(ftHandle, 0, 0, 0, 0, 0)) return 0;
-			*current = RUN_TEST;
-		} else if (next == SELECT_DR_SCAN) {
-			if (!outBit(ftHandle, 1, 0, 0, 0, 0)) return 0;
-			*current = SELECT_DR_SCAN;
-		} else { return 0; }
-		break;
+	if (bitw != sp->bits) {
+		if (!has_tdi && bitw > 0) return 27;
+		if (sp->mask.bits != bitw) {
+			if (!bv_resize(&sp->mask, bitw)) return 28;
+			bv_fill(&sp->mask, 1);
+		}
+		if (sp->smask.bits != bitw) {
+			if (!bv_resize(&sp->smask, bitw)) return 28;
+			bv_fill(&sp->smask, 1);
+		}
+		sp->bits = bitw;
 	}
-	if (!wait(ftHandle, wait_clks)) return 0;
-	return 1;
+	return 0;
 }
 
-// get state from state name
-int state_of_string(char *n, int *s)
-{
-	if (!strcmp(n, "IDLE")) *s = RUN_TEST;
-	else if (!strcmp(n, "RESET")) *s = TEST_LOGIC_RESET;
-	else if (!strcmp(n, "IRPAUSE")) *s = PAUSE_IR;
-	else if (!strcmp(n, "DRPAUSE")) *s = PAUSE_DR;
-	else if (!strcmp(n, "IREXIT1")) *s = EXIT1_IR;
-	else if (!strcmp(n, "IREXIT2")) *s = EXIT2_IR;
-	else if (!strcmp(n, "DREXIT1")) *s = EXIT1_DR;
-	else if (!strcmp(n, "DREXIT2")) *s = EXIT2_DR;
-	else if (!strcmp(n, "IRUPDATE")) *s = UPDATE_IR;
-	else if (!strcmp(n, "DRUPDATE")) *s = UPDATE_DR;
-	else if (!strcmp(n, "IRSELECT")) *s = SELECT_IR_SCAN;
-	else if (!strcmp(n, "DRSELECT")) *s = SELECT_DR_SCAN;
-	else if (!strcmp(n, "IRCAPTURE")) *s = CAPTURE_IR;
-	else if (!strcmp(n, "DRCAPTURE")) *s = CAPTURE_DR;
-	else {
-		fprintf(stderr, "unknown state(%s)\n", n);
-		return 0;
+// read RUNTEST up to the ';' into rt (returns the parse_svf error code)
+int read_runtest(SVF_PARSER *ps, RUNTEST_PARAM *rt)
+{
+	TOKEN keyw;
+	int n, semi, maximum = 0;
+	double x = -1;
+
+	rt->clks = 0;
+	rt->min_time = rt->max_time = 0;
+	if (!get_word(ps, &keyw, &semi)) return 12;
+	if (!is_number(&keyw)) {
+		if (!state_of_string(&keyw, &n)) return 13;
+		rt->run_state = rt->run_end = n;
+		if (semi) return 14;
+		if (!get_word(ps, &keyw, &semi)) return 14;
 	}
-	return 1;
+	for (;;) {
+		if (is_number(&keyw)) {
+			if (x >= 0) return 15;
+			x = double_of_token(&keyw);
+		} else if (tok_is(&keyw, "TCK") || tok_is(&keyw, "SCK")) {
+			// there is no system clock, SCK counts are clocked on TCK
+			if (x < 0 || x > INT_MAX || maximum) return 15;
+			rt->clks = (int)x;
+			x = -1;
+		} else if (tok_is(&keyw, "SEC")) {
+			if (x < 0) return 15;
+			if (maximum) rt->max_time = x;
+			else rt->min_time = x;
+			x = -1;
+		} else if (tok_is(&keyw, "MAXIMUM")) {
+			if (x >= 0) return 15;
+			maximum = 1;
+		} else if (tok_is(&keyw, "ENDSTATE")) {
+			if (x >= 0 || semi) return 16;
+			if (!get_word(ps, &keyw, &semi)) return 16;
+			if (!state_of_string(&keyw, &n)) return 16;
+			rt->run_end = n;
+		} else return 17;
+		if (semi) break;
+		if (!get_word(ps, &keyw, &semi)) return 17;
+	}
+	if (x >= 0) return 17;
+	return 0;
 }
 
-// parse SVF file
-int parse_svf(FILE *fp, FT_HANDLE ftHandle, int v, int *current_state)
-{
-	char keyw[MAX_STR], keyw2[MAX_STR], tdi[MAX_STR], tdo[MAX_STR];
-	static char smask_sir[MAX_STR], mask_sir[MAX_STR];
-	static char smask_sdr[MAX_STR], mask_sdr[MAX_STR];
-	static char mask_tmp[MAX_STR];
-	char *smask, *mask;
-	int semi, ret, bitw, clks;
-	int end_ir = RUN_TEST, end_dr = RUN_TEST, run_state = RUN_TEST;
-
-	while (get_word(fp, keyw, &semi)) {
-		if (is_ignore(keyw)) {
-			do {
-				ret = get_word(fp, keyw, &semi);
-			} while (ret && !semi);
-		} else if (sir_sdr(keyw)) {
-			int next_state;
-
-			if (!strcmp(keyw, "SIR")) {
-				next_state = SHIFT_IR;
-				mask = mask_sir;
-				smask = smask_sir;
-			} else {
-				next_state = SHIFT_DR;
-				mask = mask_sdr;
-				smask = smask_sdr;
-			}
-			if (!transit(ftHandle, current_state, next_state, 0)) {
-				return 1;
-			}
-			if (!get_word(fp, keyw2, &semi)) return 2;
-			if (!is_integer(keyw2)) return 3;
-			bitw = atoi(keyw2);
-			*tdi = *tdo = 0;
-			do {
-				if (!get_word(fp, keyw2, &semi)) return 4;
-				if (!do_param(fp, keyw2, "TDI", tdi, &semi)) return 5;
-				if (!do_param(fp, keyw2, "TDO", tdo, &semi)) return 6;
-				if (!do_param(fp, keyw2, "SMASK", smask, &semi)) return 7;
-				if (!do_param(fp, keyw2, "MASK", mask, &semi)) return 8;
-			} while (!semi);
-			if (*tdo == 0) {
-				make_zero(bitw, tdo);
-				mask = mask_tmp;
-				make_zero(bitw, mask);
-			}
-			if (v) printf("%s %d TDI %s SMASK %s TDO %s MASK %s\n", keyw, bitw, tdi, smask, tdo, mask);
-			if (!outData(ftHandle, bitw, tdi, smask, tdo, mask)) {
-				return 9;
-			}
-			if (!strcmp(keyw, "SIR")) {
-				*current_state = EXIT1_IR;
-				if (!transit(ftHandle, current_state, end_ir, 0)) return 10;
-			} else {
-				*current_state = EXIT1_DR;
-				if (!transit(ftHandle, current_state, end_dr, 0)) return 11;
-			}
-		} else if (!strcmp(keyw, "RUNTEST")) {
-			if (!get_word(fp, keyw, &semi)) return 12;
-			if (is_integer(keyw)) { clks = atoi(keyw); }
-			else {
-				int n;
-				if (!state_of_string(keyw, &n)) return 13;
-				run_state = n; 
-				if (!get_word(fp, keyw, &semi)) return 14;
-				if (!is_integer(keyw)) return 15;
-				clks = atoi(keyw);
-			}
-			if (!get_word(fp, keyw, &semi)) return 16;
-			if (strcmp(keyw, "TCK") || !semi) { // not supported format
-				return 17;
-			}
-			if (v) printf("RUNTEST %d TCK\n", clks); fflush(stdout);
-			if (!transit(ftHandle, current_state, run_state, clks)) return 18; // end_state = run_state
-		} else if (!strcmp(keyw, "STATE")) {
+// copy n bits of src to dst from bit pos (dst is zero there)
+void bv_put(BITVEC *dst, int pos, BITVEC *src, int n)
+{
+	int i, k, p, s;
+	uint64_t x;
+
+	for (i = 0; i < n; i += 64) {
+		x = src->w[i >> 6];
+		k = n - i;
+		if (k < 64) x &= ((uint64_t)1 << k) - 1;
+		p = pos + i;
+		s = p & 63;
+		dst->w[p >> 6] |= x << s;
+		if (s && s + (k < 64 ? k : 64) > 64) dst->w[(p >> 6) + 1] |= x >> (64 - s);
+	}
+}
+
+// put the TDI (and TDO / MASK if it was given) of sp to dst from bit pos
+void compose_part(SCAN_PARAM *dst, int pos, SCAN_PARAM *sp)
+{
+	bv_put(&dst->tdi, pos, &sp->tdi, sp->bits);
+	if (sp->tdo_valid) {
+		bv_put(&dst->tdo, pos, &sp->tdo, sp->bits);
+		bv_put(&dst->mask, pos, &sp->mask, sp->bits);
+	}
+}
+
+// header, n copies of the payload and trailer in one scan; the header is
+// shifted first, so it reaches the devices nearest to TDO
+int compose_scan(SCAN_PARAM *dst, SCAN_PARAM *hd, SCAN_PARAM *sp, int n, SCAN_PARAM *tl)
+{
+	int i, bits;
+
+	// bit bang read back offsets are 2 x bits
+	if ((int64_t)hd->bits + (int64_t)sp->bits * n + tl->bits > INT_MAX / 2) return 0;
+	bits = hd->bits + sp->bits * n + tl->bits;
+	if (!bv_resize(&dst->tdi, bits) || !bv_resize(&dst->tdo, bits) || !bv_resize(&dst->mask, bits)) return 0;
+	bv_fill(&dst->tdi, 0);
+	bv_fill(&dst->tdo, 0);
+	bv_fill(&dst->mask, 0);
+	dst->bits = bits;
+	dst->tdo_valid = hd->tdo_valid || sp->tdo_valid || tl->tdo_valid;
+	compose_part(dst, 0, hd);
+	for (i = 0; i < n; i++) compose_part(dst, hd->bits + sp->bits * i, sp);
+	compose_part(dst, bits - tl->bits, tl);
+	return 1;
+}
+
+// queue the TDO compare of a scan whose read back starts at rd_start
+int verify_add(BITVEC *tdo, BITVEC *mask, int bits, int64_t rd_start)
+{
+	USB_QUEUE *q = &g_usb;
+	VREC *r;
+
+	if (q->dry) return 1;
+	if (!(r = (VREC *)calloc(1, sizeof(VREC)))) return 0;
+	if (!bv_resize(&r->tdo, bits) || !bv_resize(&r->mask, bits)) return 0;
+	memcpy(r->tdo.w, tdo->w, BV_WORDS(bits) * sizeof(uint64_t));
+	memcpy(r->mask.w, mask->w, BV_WORDS(bits) * sizeof(uint64_t));
+	r->bits = bits;
+	r->rd_start = rd_start;
+	r->engine = g_engine;
+	r->line = q->scan_line;
+	r->ir = q->scan_ir;
+	r->hbits = q->scan_hbits;
+	r->unit = q->scan_unit;
+	r->units = q->scan_units;
+	if (q->ver.tail) q->ver.tail->next = r;
+	else q->ver.head = r;
+	q->ver.tail = r;
+	return 1;
+}
+
+// read back byte offset (from rd_start) and bit position of TDO bit i
+void vrec_pos(VREC *r, int i, int *ofs, int *bit)
+{
+	int n = r->bits - 1, full = n >> 3, rem = n & 7;
+
+	if (r->engine == ENGINE_BITBANG) {
+		// sampled before the TCK high byte, on D3
+		*ofs = i * 2 + 1;
+		*bit = 3;
+	} else if (i < full * 8) {
+		// byte shift
+		*ofs = i >> 3;
+		*bit = i & 7;
+	} else if (i < n) {
+		// bit shift : bits come in from the MSB
+		*ofs = full;
+		*bit = 8 - rem + (i - full * 8);
+	} else {
+		// TMS shift of the last bit
+		*ofs = full + (rem ? 1 : 0);
+		*bit = 7;
+	}
+}
+
+// name of bit pos of the scan : payload bit, or header / trailer bit,
+// or device and payload bit in the broadcast mode
+int bit_label(char *s, VREC *r, int pos)
+{
+	int k = pos - r->hbits;
+
+	if (k < 0) return sprintf(s, " hdr:%d", pos);
+	if (k >= r->unit * r->units) return sprintf(s, " tdr:%d", k - r->unit * r->units);
+	if (r->units > 1) return sprintf(s, " dev%d:%d", k / r->unit, k % r->unit);
+	return sprintf(s, " %d", k);
+}
+
+// compare a completed scan : (got ^ tdo) & mask, 64 bits at a time
+void verify_vec(VERIFIER *vf, VREC *r)
+{
+	int i, b, k, n, words = BV_WORDS(r->bits), listed = 0, bad = 0;
+	uint64_t d, *got = vf->got.w;
+	char line[256];
+
+	if (vf->capture) memcpy(vf->capture->w, got, words * sizeof(uint64_t));
+	for (i = 0; i < words; i++) {
+		bad += POPCOUNT64((got[i] ^ r->tdo.w[i]) & r->mask.w[i]);
+		vf->compared += POPCOUNT64(r->mask.w[i]);
+	}
+	if (!bad) return;
+	vf->no_match += bad;
+	if (r->units > 1) {
+		for (i = 0; i < words; i++) {
+			d = (got[i] ^ r->tdo.w[i]) & r->mask.w[i];
+			for (b = 0; d; b++, d >>= 1) {
+				k = i * 64 + b - r->hbits;
+				if ((d & 1) && k >= 0 && k < r->unit * r->units) vf->unit_no_match[k / r->unit]++;
+			}
+		}
+	}
+	if (vf->quiet || vf->reported++ >= g_max_report) return;
+	// one printf per scan, adapters report from their own threads
+	n = sprintf(line, "   %s%s%s%s at line %d : %d of %d bits didn't match (bit", vf->name ? "[" : "", vf->name ? vf->name : "", vf->name ? "] " : "", r->ir ? "SIR" : "SDR", r->line, bad, r->bits);
+	for (i = 0; i < words && listed < 8; i++) {
+		d = (got[i] ^ r->tdo.w[i]) & r->mask.w[i];
+		for (b = 0; d && listed < 8; b++, d >>= 1) {
+			if (d & 1) {
+				n += bit_label(line + n, r, i * 64 + b);
+				listed++;
+			}
+		}
+	}
+	if (bad > listed) n += sprintf(line + n, " and %d more", bad - listed);
+	printf("%s)\n", line);
+}
+
+// free a list of scans
+void vrec_free(VREC *r)
+{
+	VREC *next;
+
+	for (; r; r = next) {
+		next = r->next;
+		free(r->tdo.w);
+		free(r->mask.w);
+		free(r);
+	}
+}
+
+// pack the TDO bits of the pending scans out of the read back bytes
+// data[0..len) and compare the scans that are complete
+int verify_feed(VERIFIER *vf, unsigned char *data, int len)
+{
+	int64_t end = vf->rd_pos + len;
+	unsigned char *p;
+	VREC *r;
+	int i, n, ofs, bit;
+
+	while ((r = vf->head)) {
+		if (vf->done == 0) {
+			if (!bv_resize(&vf->got, r->bits)) return 0;
+			memset(vf->got.w, 0, BV_WORDS(r->bits) * sizeof(uint64_t));
+		}
+		p = data + (r->rd_start - vf->rd_pos);
+		if (r->engine == ENGINE_MPSSE) {
+			// whole bytes of the byte shift
+			n = (r->bits - 1) & ~7;
+			for (i = vf->done; i < n && r->rd_start + (i >> 3) < end; i += 8) {
+				vf->got.w[i >> 6] |= (uint64_t)p[i >> 3] << (i & 63);
+			}
+			if (i > vf->done) vf->done = i;
+		}
+		for (; vf->done < r->bits; vf->done++) {
+			i = vf->done;
+			vrec_pos(r, i, &ofs, &bit);
+			if (r->rd_start + ofs >= end) break;
+			vf->got.w[i >> 6] |= (uint64_t)((p[ofs] >> bit) & 1) << (i & 63);
+		}
+		if (vf->done < r->bits) break;
+		verify_vec(vf, r);
+		vf->done = 0;
+		vf->head = r->next;
+		if (!vf->head) vf->tail = NULL;
+		if (vf->own) {
+			r->next = NULL;
+			vrec_free(r);
+		}
+	}
+	vf->rd_pos = end;
+	return 1;
+}
+
+// ========== USB I/O pipeline ==========
+int spsc_init(SPSC_QUEUE *s, int n)
+{
+	s->size = n + 1;
+	s->head = s->tail = 0;
+	if (!(s->ring = (IOBUF **)calloc(s->size, sizeof(IOBUF *)))) return 0;
+#ifdef _WIN32
+	InitializeCriticalSection(&s->lock);
+	InitializeConditionVariable(&s->cond);
+#else
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+#endif
+	return 1;
+}
+
+void spsc_free(SPSC_QUEUE *s)
+{
+	if (!s->ring) return;
+#ifdef _WIN32
+	DeleteCriticalSection(&s->lock);
+#else
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+#endif
+	free(s->ring);
+	s->ring = NULL;
+}
+
+// wake the consumer (after a push or a stop request)
+void spsc_wake(SPSC_QUEUE *s)
+{
+#ifdef _WIN32
+	EnterCriticalSection(&s->lock);
+	WakeConditionVariable(&s->cond);
+	LeaveCriticalSection(&s->lock);
+#else
+	pthread_mutex_lock(&s->lock);
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+#endif
+}
+
+// producer side, 0 if full
+int spsc_push(SPSC_QUEUE *s, IOBUF *b)
+{
+	int t = s->tail, n = (t + 1) % s->size;
+
+	if (n == ATOMIC_LOAD(&s->head)) return 0;
+	s->ring[t] = b;
+	ATOMIC_STORE(&s->tail, n);
+	spsc_wake(s);
+	return 1;
+}
+
+// consumer side, NULL if empty
+IOBUF *spsc_pop(SPSC_QUEUE *s)
+{
+	int h = s->head;
+	IOBUF *b;
+
+	if (h == ATOMIC_LOAD(&s->tail)) return NULL;
+	b = s->ring[h];
+	ATOMIC_STORE(&s->head, (h + 1) % s->size);
+	return b;
+}
+
+// consumer side, sleep until there is a buffer; NULL once *stop is set
+// (stop may be NULL : wait for good)
+IOBUF *spsc_wait(SPSC_QUEUE *s, int *stop)
+{
+	IOBUF *b;
+
+	if ((b = spsc_pop(s))) return b;
+	// checked under the lock the producer wakes with, no wakeup is lost
+#ifdef _WIN32
+	EnterCriticalSection(&s->lock);
+	while (!(b = spsc_pop(s)) && !(stop && ATOMIC_LOAD(stop))) SleepConditionVariableCS(&s->cond, &s->lock, INFINITE);
+	LeaveCriticalSection(&s->lock);
+#else
+	pthread_mutex_lock(&s->lock);
+	while (!(b = spsc_pop(s)) && !(stop && ATOMIC_LOAD(stop))) pthread_cond_wait(&s->cond, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+#endif
+	return b;
+}
+
+int thread_start(THREAD *th, THREAD_PROC proc, void *arg)
+{
+#ifdef _WIN32
+	*th = CreateThread(NULL, 0, proc, arg, 0, NULL);
+	return (*th != NULL);
+#else
+	return (pthread_create(th, NULL, proc, arg) == 0);
+#endif
+}
+
+void thread_join(THREAD th)
+{
+#ifdef _WIN32
+	WaitForSingleObject(th, INFINITE);
+	CloseHandle(th);
+#else
+	pthread_join(th, NULL);
+#endif
+}
+
+// the thread frees what it holds itself when it ends
+void thread_detach(THREAD th)
+{
+#ifdef _WIN32
+	CloseHandle(th);
+#else
+	pthread_detach(th);
+#endif
+}
+
+// I/O side : write b (NULL if there's nothing to write), then read back
+// the previous buffer and return it to the parser
+void io_step(USB_QUEUE *q, IOBUF *b)
+{
+	IOBUF *prev = q->io_prev;
+
+	// after an error the buffers only go round so that the parser sees it
+	if (b && b->length > 0 && !ATOMIC_LOAD(&q->io_error)) {
+		if (!tp_write(q->tp, b->data, b->length)) ATOMIC_STORE(&q->io_error, 1);
+	}
+	if (prev) {
+		if (prev->rlength > 0 && !ATOMIC_LOAD(&q->io_error)) {
+			if (!tp_read(q->tp, prev->result, prev->rlength)) ATOMIC_STORE(&q->io_error, 1);
+		}
+		spsc_push(&q->done, prev);
+	}
+	q->io_prev = b;
+}
+
+THREAD_FUNC io_thread(void *arg)
+{
+	USB_QUEUE *q = (USB_QUEUE *)arg;
+	IOBUF *b;
+	double t;
+
+	for (;;) {
+		if ((b = spsc_pop(&q->full))) io_step(q, b);
+		else if (q->io_prev) io_step(q, NULL);	// nothing to overlap with
+		else {
+			t = now_sec();
+			b = spsc_wait(&q->full, &q->stop);
+			q->stall_io += now_sec() - t;
+			if (!b) break;
+			io_step(q, b);
+		}
+	}
+	return 0;
+}
+
+// wait for a buffer back from the I/O side and compare its read back results
+IOBUF *usb_reclaim(USB_QUEUE *q)
+{
+	IOBUF *b;
+	double t;
+
+	if (!(b = spsc_pop(&q->done))) {
+		t = now_sec();
+		b = spsc_wait(&q->done, NULL);
+		q->stall_parser += now_sec() - t;
+	}
+	if (ATOMIC_LOAD(&q->io_error)) {
+		q->spare[q->nspare++] = b;
+		return NULL;
+	}
+	if (b->rlength > 0 && !verify_feed(&q->ver, b->result, b->rlength)) {
+		ATOMIC_STORE(&q->io_error, 1);
+		q->spare[q->nspare++] = b;
+		return NULL;
+	}
+	b->length = b->rlength = 0;
+	return b;
+}
+
+// take a free buffer
+IOBUF *usb_get(USB_QUEUE *q)
+{
+	if (q->nspare > 0) return q->spare[--q->nspare];
+	return usb_reclaim(q);
+}
+
+// make b the staging buffer
+void usb_use(USB_QUEUE *q, IOBUF *b)
+{
+	q->cur = b;
+	q->buff = b->data;
+	q->length = 0;
+}
+
+// start the USB I/O pipeline of depth buffers of size bytes
+int usb_open(TRANSPORT *tp, int depth, int size, int threaded)
+{
+	USB_QUEUE *q = &g_usb;
+	int i;
+
+	memset(q, 0, sizeof(USB_QUEUE));
+	q->tp = tp;
+	q->depth = depth;
+	q->size = size;
+	q->ver.own = 1;
+	q->pool = (IOBUF *)calloc(depth, sizeof(IOBUF));
+	q->spare = (IOBUF **)calloc(depth, sizeof(IOBUF *));
+	if (!q->pool || !q->spare || !spsc_init(&q->full, depth) || !spsc_init(&q->done, depth)) return 0;
+	for (i = 0; i < depth; i++) {
+		q->pool[i].data = (unsigned char *)malloc(size + 1);
+		q->pool[i].result = (unsigned char *)malloc(size);
+		if (!q->pool[i].data || !q->pool[i].result) return 0;
+		q->spare[q->nspare++] = &q->pool[i];
+	}
+	usb_use(q, usb_get(q));
+	if (!threaded) return 1;
+	q->threaded = thread_start(&q->thread, io_thread, q);
+	return q->threaded;
+}
+
+// stop the I/O thread and free the buffers (after usb_flush(tp, 1))
+void usb_close(void)
+{
+	USB_QUEUE *q = &g_usb;
+	int i;
+
+	if (q->threaded) {
+		ATOMIC_STORE(&q->stop, 1);
+		spsc_wake(&q->full);
+		thread_join(q->thread);
+		q->threaded = 0;
+	}
+	for (i = 0; q->pool && i < q->depth; i++) {
+		free(q->pool[i].data);
+		free(q->pool[i].result);
+	}
+	if (q->ver.own) vrec_free(q->ver.head);
+	free(q->ver.got.w);
+	memset(&q->ver, 0, sizeof(VERIFIER));
+	free(q->pool);
+	free(q->spare);
+	spsc_free(&q->full);
+	spsc_free(&q->done);
+	q->pool = NULL;
+	q->spare = NULL;
+}
+
+// pass the staging buffer to the I/O side and continue in a free one;
+// flush waits until every buffer is back with its read back results
+int usb_flush(TRANSPORT *tp, int flush)
+{
+	USB_QUEUE *q = &g_usb;
+	IOBUF *b = q->cur;
+
+	(void)tp;	// the queue writes to its own q->tp
+	if (q->length > 0 || flush) {
+		// let the MPSSE return the read data without waiting for the latency timer
+		if (g_engine == ENGINE_MPSSE && b->rlength > 0) q->buff[q->length++] = MPSSE_SEND_IMMEDIATE;
+		b->length = q->length;
+		if (q->record || q->dry) {
+			if (q->record && !stream_add(q->record, q->buff, q->length, b->rlength, 0, -1, -1)) return 0;
+			b->rlength = 0;
+			q->length = 0;
+			return 1;
+		}
+		if (q->threaded) spsc_push(&q->full, b);
+		else io_step(q, b);
+		if (flush) {
+			if (!q->threaded) io_step(q, NULL);
+			while (q->nspare < q->depth) {
+				if (!(b = usb_reclaim(q))) break;
+				q->spare[q->nspare++] = b;
+			}
+		}
+		if (!(b = usb_get(q))) return 0;
+		usb_use(q, b);
+	}
+	return !ATOMIC_LOAD(&q->io_error);
+}
+
+// sleep on the host after everything is clocked out (RUNTEST)
+int usb_sleep(TRANSPORT *tp, double sec)
+{
+	if (!usb_flush(tp, 1)) return 0;
+	g_usb.sleep_sec += sec;
+	if (g_usb.dry) return 1;
+	if (g_usb.record) return stream_add(g_usb.record, NULL, 0, 0, sec, -1, -1);
+	sleep_sec(sec);
+	return 1;
+}
+
+// put the adapter into the mode of the engine (only tp is touched, the
+// threads of several adapters call it at the same time)
+int engine_mode(TRANSPORT *tp, int engine)
+{
+	if (!tp->set_usb(tp, g_usb_xfer, g_latency)) return 0;
+	if (engine == ENGINE_MPSSE) {
+		if (!tp->set_bit_mode(tp, 0, 0)) return 0;
+		if (!tp->set_bit_mode(tp, 0, MPSSE_MODE)) return 0;
+		tp->purge(tp);
+		return 1;
+	}
+	// synchronous or asynchronous bit bang mode
+	// (d3,d2,d1,d0) = (TDO,TCK,DMS,TDI), other pins with -slice
+	if (!tp->set_bit_mode(tp, g_bb_mask, (g_mode == 1)?BITBANG_SYNC:BITBANG_ASYNC)) return 0;
+	tp->set_divisor(tp, 1);
+	return 1;
+}
+
+// initialize the adapter for the JTAG engine (tp is NULL when the
+// commands are recorded into a stream)
+int engine_init(TRANSPORT *tp)
+{
+	if (tp && !engine_mode(tp, g_engine)) return 0;
+	g_usb.sync = (g_engine == ENGINE_BITBANG && g_mode == 1);
+	g_svf_freq = 0;
+	g_tck_div = -1;
+	if (g_engine == ENGINE_MPSSE) {
+		g_tck_div = tck_div(ENGINE_MPSSE, g_tck_max);
+		g_tck_hz = tck_rate(ENGINE_MPSSE, g_tck_div);
+		return mpsse_init(tp, g_tck_div);
+	}
+	return apply_tck(tp);
+}
+
+// ========== SVF reader thread ==========
+int svf_packed(const unsigned char *p, size_t n)
+{
+	if (n >= 2 && p[0] == 0x1f && p[1] == 0x8b) return READ_GZIP;
+	if (n >= 6 && !memcmp(p, "\xfd" "7zXZ\0", 6)) return READ_XZ;
+	return READ_PLAIN;
+}
+
+// the n bytes so far may still be the start of a gzip / xz header
+int svf_packed_prefix(const unsigned char *p, size_t n)
+{
+	return (n < 2 && !memcmp(p, "\x1f\x8b", n)) || (n < 6 && !memcmp(p, "\xfd" "7zXZ\0", n));
+}
+
+// the bytes of fp there are, up to n (of a pipe it doesn't wait for all n
+// as fread does); 0 at the end or on an error
+size_t reader_raw(SVF_READER *r, unsigned char *dst, size_t n)
+{
+#ifdef _WIN32
+	int got = _read(_fileno(r->fp), dst, (unsigned int)n);
+#else
+	ssize_t got;
+
+	do got = read(fileno(r->fp), dst, n); while (got < 0 && errno == EINTR);
+#endif
+	if (got < 0) r->in_error = 1;
+	return (got > 0) ? (size_t)got : 0;
+}
+
+// refill the compressed input, 0 at the end of fp
+int reader_input(SVF_READER *r)
+{
+	if (r->in_pos < r->in_len) return 1;
+	r->in_pos = 0;
+	r->in_len = r->in_eof ? 0 : reader_raw(r, r->in, READ_BUFSIZE);
+	if (r->in_len == 0) r->in_eof = 1;
+	return (r->in_len > 0);
+}
+
+// decompress up to size bytes to dst; returns the bytes (0 at the end,
+// -1 on a read or decompression error)
+int reader_decode(SVF_READER *r, unsigned char *dst, int size)
+{
+	int ret;
+
+	if (r->finished) return 0;
+	// the decoders hand over what they have before waiting for more input,
+	// so the tokenizer sees a line of a pipe as soon as it comes
+	if (r->format == READ_PLAIN) {
+		if (!reader_input(r)) return r->in_error ? -1 : 0;
+		ret = (int)((r->in_len - r->in_pos < (size_t)size) ? r->in_len - r->in_pos : (size_t)size);
+		memcpy(dst, r->in + r->in_pos, ret);
+		r->in_pos += ret;
+		return ret;
+	}
+#ifndef NO_ZLIB
+	if (r->format == READ_GZIP) {
+		z_stream *zs = &r->zs;
+
+		zs->next_out = dst;
+		zs->avail_out = size;
+		while (zs->avail_out > 0) {
+			if (zs->avail_in == 0) {
+				if (zs->avail_out < (uInt)size) return (int)(size - zs->avail_out);
+				r->in_pos = r->in_len;
+				if (!reader_input(r)) break;
+				zs->next_in = r->in;
+				zs->avail_in = (uInt)r->in_len;
+			}
+			ret = inflate(zs, Z_NO_FLUSH);
+			if (ret == Z_STREAM_END) {
+				// concatenated gzip members
+				if (zs->avail_in == 0) {
+					r->in_pos = r->in_len;
+					if (!reader_input(r)) {
+						r->finished = 1;
+						return size - zs->avail_out;
+					}
+					zs->next_in = r->in;
+					zs->avail_in = (uInt)r->in_len;
+				}
+				inflateReset(zs);
+			} else if (ret != Z_OK) {
+				fprintf(stderr, "can't decompress the SVF (gzip error %d)\n", ret);
+				return -1;
+			}
+		}
+		if (zs->avail_out > 0 && !r->in_error) {
+			fprintf(stderr, "the gzip SVF is truncated\n");
+			return -1;
+		}
+		return r->in_error ? -1 : (int)(size - zs->avail_out);
+	}
+#endif
+#ifndef NO_LZMA
+	if (r->format == READ_XZ) {
+		lzma_stream *xs = &r->xs;
+
+		xs->next_out = dst;
+		xs->avail_out = size;
+		while (xs->avail_out > 0) {
+			if (xs->avail_in == 0 && !r->in_eof) {
+				if (xs->avail_out < (size_t)size) break;
+				r->in_pos = r->in_len;
+				if (reader_input(r)) {
+					xs->next_in = r->in;
+					xs->avail_in = r->in_len;
+				}
+			}
+			ret = lzma_code(xs, r->in_eof ? LZMA_FINISH : LZMA_RUN);
+			if (ret == LZMA_STREAM_END) {
+				r->finished = 1;
+				break;
+			}
+			if (ret != LZMA_OK) {
+				fprintf(stderr, "can't decompress the SVF (xz error %d)\n", ret);
+				return -1;
+			}
+		}
+		return r->in_error ? -1 : (int)(size - xs->avail_out);
+	}
+#endif
+	return -1;
+}
+
+void reader_free(SVF_READER *r)
+{
+	int i;
+
+#ifndef NO_ZLIB
+	if (r->format == READ_GZIP) inflateEnd(&r->zs);
+#endif
+#ifndef NO_LZMA
+	if (r->format == READ_XZ) lzma_end(&r->xs);
+#endif
+	for (i = 0; i < READ_DEPTH; i++) free(r->pool[i].data);
+	spsc_free(&r->full);
+	spsc_free(&r->done);
+	if (r->fp && r->fp != stdin) fclose(r->fp);
+	free(r->in);
+	free(r);
+}
+
+// the tokenizer or the thread lets go of the reader
+void reader_release(SVF_READER *r)
+{
+	if (ATOMIC_DEC(&r->refs) == 0) reader_free(r);
+}
+
+THREAD_FUNC reader_thread(void *arg)
+{
+	SVF_READER *r = (SVF_READER *)arg;
+	IOBUF *b;
+	int n;
+
+	while ((b = spsc_wait(&r->done, &r->stop))) {
+		if ((n = reader_decode(r, b->data, READ_BUFSIZE)) < 0) {
+			ATOMIC_STORE(&r->error, 1);
+			n = 0;
+		}
+		// an empty buffer is the end
+		b->length = n;
+		spsc_push(&r->full, b);
+		if (n == 0) break;
+	}
+	reader_release(r);
+	return 0;
+}
+
+// the format is told by the first bytes of fp
+SVF_READER *reader_open(FILE *fp)
+{
+	SVF_READER *r = (SVF_READER *)calloc(1, sizeof(SVF_READER));
+	size_t n;
+	int i;
+
+	if (!r) return NULL;
+	r->fp = fp;
+	if (!(r->in = (unsigned char *)calloc(1, READ_BUFSIZE))) goto FAIL;
+	// enough bytes to tell the format, a pipe may give fewer at a time
+	while (svf_packed_prefix(r->in, r->in_len) && (n = reader_raw(r, r->in + r->in_len, READ_BUFSIZE - r->in_len)) > 0) r->in_len += n;
+	r->in_eof = (r->in_len == 0);
+	r->format = svf_packed(r->in, r->in_len);
+	if (r->format == READ_GZIP) {
+#ifndef NO_ZLIB
+		r->zs.next_in = r->in;
+		r->zs.avail_in = (uInt)r->in_len;
+		if (inflateInit2(&r->zs, 15 + 16) != Z_OK) goto FAIL;
+#else
+		fprintf(stderr, "gzip SVF support is not compiled in\n");
+		goto FAIL;
+#endif
+	} else if (r->format == READ_XZ) {
+#ifndef NO_LZMA
+		lzma_stream init = LZMA_STREAM_INIT;
+
+		r->xs = init;
+		r->xs.next_in = r->in;
+		r->xs.avail_in = r->in_len;
+		if (lzma_stream_decoder(&r->xs, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) goto FAIL;
+#else
+		fprintf(stderr, "xz SVF support is not compiled in\n");
+		goto FAIL;
+#endif
+	}
+	if (!spsc_init(&r->full, READ_DEPTH) || !spsc_init(&r->done, READ_DEPTH)) goto FAIL;
+	for (i = 0; i < READ_DEPTH; i++) {
+		if (!(r->pool[i].data = (unsigned char *)malloc(READ_BUFSIZE))) goto FAIL;
+		spsc_push(&r->done, &r->pool[i]);
+	}
+	r->refs = 2;
+	if (!(r->started = thread_start(&r->thread, reader_thread, r))) goto FAIL;
+	return r;
+FAIL:
+	// fp stays with the caller
+	r->fp = NULL;
+	reader_free(r);
+	return NULL;
+}
+
+// the thread may be blocked reading a pipe (stdin), so it isn't waited for :
+// it stops at its next buffer and the last of the two frees the reader
+void reader_close(SVF_READER *r)
+{
+	ATOMIC_STORE(&r->stop, 1);
+	spsc_wake(&r->done);
+	thread_detach(r->thread);
+	reader_release(r);
+}
+
+size_t reader_read(SVF_READER *r, char *dst, size_t n)
+{
+	size_t got = 0, k;
+
+	while (got < n && !r->end) {
+		if (!r->cur) {
+			// what there is so far is handed on before waiting
+			r->cur = (got > 0) ? spsc_pop(&r->full) : spsc_wait(&r->full, NULL);
+			if (!r->cur) break;
+			r->cur_pos = 0;
+			if (r->cur->length == 0) {
+				r->cur = NULL;
+				r->end = 1;
+				break;
+			}
+		}
+		k = r->cur->length - r->cur_pos;
+		if (k > n - got) k = n - got;
+		memcpy(dst + got, r->cur->data + r->cur_pos, k);
+		r->cur_pos += (int)k;
+		got += k;
+		if (r->cur_pos == r->cur->length) {
+			spsc_push(&r->done, r->cur);
+			r->cur = NULL;
+		}
+	}
+	return got;
+}
+
+// ========== TCK rate ==========
+// TCK rate of the divisor : 2 bit bang bytes per TCK, or the MPSSE clock
+double tck_rate(int engine, int div)
+{
+	if (engine == ENGINE_MPSSE) return 60e6 / ((1 + div) * 2);
+	return BITBANG_TCK_HZ / div;
+}
+
+// divisor of the fastest rate up to hz (hz <= 0 : the default rate)
+int tck_div(int engine, double hz)
+{
+	double x;
+	int div, min = (engine == ENGINE_MPSSE) ? 0 : 1;
+
+	if (hz <= 0) return (engine == ENGINE_MPSSE) ? MPSSE_DEFAULT_DIV : 1;
+	x = (engine == ENGINE_MPSSE) ? 30e6 / hz : BITBANG_TCK_HZ / hz;
+	if (x > 0x10000) return 0xffff;
+	// round up (the rate may not exceed hz)
+	div = (int)x;
+	if (div < x - 1e-9) div++;
+	if (engine == ENGINE_MPSSE) div--;
+	return (div < min) ? min : div;
+}
+
+// change the TCK divisor : an MPSSE command in the stream, or the bit
+// bang baud rate once the queued bytes are out
+int set_tck(TRANSPORT *tp, int div)
+{
+	USB_QUEUE *q = &g_usb;
+
+	if (div == g_tck_div) return 1;
+	if (g_engine == ENGINE_MPSSE) {
+		if (!mpsse_cmd(tp, 3, MPSSE_SET_DIVISOR, div & 0xff, (div >> 8) & 0xff)) return 0;
+	} else {
+		if (!usb_flush(tp, 1)) return 0;
+		if (q->record) {
+			if (!stream_add(q->record, NULL, 0, 0, 0, div, -1)) return 0;
+		} else if (!q->dry && !tp->set_divisor(tp, div)) return 0;
+	}
+	// the TCKs so far are timed at the old rate
+	q->tck_sec += (q->tcks - q->tck_mark) / g_tck_hz;
+	q->tck_mark = q->tcks;
+	g_tck_div = div;
+	g_tck_hz = tck_rate(g_engine, div);
+	return 1;
+}
+
+// TCK rate : the -freq / autotune limit (or the default of the engine),
+// lowered to the FREQUENCY of the SVF
+int apply_tck(TRANSPORT *tp)
+{
+	double hz = (g_tck_max > 0) ? g_tck_max : tck_rate(g_engine, tck_div(g_engine, 0));
+
+	if (g_svf_freq > 0 && g_svf_freq < hz) hz = g_svf_freq;
+	return set_tck(tp, tck_div(g_engine, hz));
+}
+
+// seconds the TCKs so far take at the rates they were clocked at, and
+// the host side sleeps
+double usb_tck_sec(void)
+{
+	USB_QUEUE *q = &g_usb;
+
+	return q->tck_sec + (q->tcks - q->tck_mark) / g_tck_hz + q->sleep_sec;
+}
+
+// one autotune scan : from Test-Logic-Reset through the DRs of the chain
+// (IDCODE or BYPASS), so TDO is the captured bits followed by the TDI
+// pattern delayed by the chain
+int tune_scan(TRANSPORT *tp, BITVEC *tdi, BITVEC *tdo, BITVEC *mask)
+{
+	int state;
+
+	if (!reset_tap(tp, &state) || !transit(tp, &state, SHIFT_DR, 0)) return 0;
+	if (!outData(tp, AUTOTUNE_BITS, tdi, tdo, mask)) return 0;
+	state = EXIT1_DR;
+	if (!transit(tp, &state, RUN_TEST, 0)) return 0;
+	return usb_flush(tp, 1);
+}
+
+// find the fastest TCK rate that reads the chain without errors : the
+// scan is read at a slow rate for reference and compared at increasing
+// divisors; g_tck_max is set one step below the fastest rate from which
+// every slower one passed
+int autotune(TRANSPORT *tp)
+{
+	static const int bb_divs[] = {1, 2, 3, 4, 6, 8, 12, 16};
+	static const int mp_divs[] = {0, 1, 2, 3, 4, 5, 7, 9, 14, 19, 29};
+	USB_QUEUE *q = &g_usb;
+	BITVEC tdi = {0}, ref = {0}, ones = {0};
+	const int *divs = (g_engine == ENGINE_MPSSE) ? mp_divs : bb_divs;
+	int n = (g_engine == ENGINE_MPSSE) ? 11 : 8;
+	int i, r, best, errors[11], mode = g_mode, max_report = g_max_report, ok = 0;
+	int no_match = q->ver.no_match, reported = q->ver.reported;
+	uint64_t x = 88172645463325252ULL, all = 0;
+
+	if (!bv_resize(&tdi, AUTOTUNE_BITS) || !bv_resize(&ref, AUTOTUNE_BITS) || !bv_resize(&ones, AUTOTUNE_BITS)) goto END;
+	for (i = 0; i < BV_WORDS(AUTOTUNE_BITS); i++) {
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		tdi.w[i] = x;
+		ones.w[i] = ~0ULL;
+	}
+	// TDO is read back (synchronous bit bang), mismatches aren't listed
+	g_mode = 1;
+	g_max_report = 0;
+	if (mode != 1 && !engine_mode(tp, g_engine)) goto END;
+	g_usb.sync = (g_engine == ENGINE_BITBANG);
+	g_tck_div = -1;
+	if (!set_tck(tp, tck_div(g_engine, AUTOTUNE_REF_HZ))) goto END;
+	memset(ref.w, 0, BV_WORDS(AUTOTUNE_BITS) * sizeof(uint64_t));
+	q->ver.capture = &ref;
+	r = tune_scan(tp, &tdi, &ref, &ref);
+	q->ver.capture = NULL;
+	if (!r) goto END;
+	for (i = 0; i < BV_WORDS(AUTOTUNE_BITS); i++) all |= ref.w[i] ^ (ref.w[0] & 1 ? ~0ULL : 0);
+	if (!all) {
+		fprintf(stderr, "autotune : no JTAG device responds\n");
+		goto END;
+	}
+	for (i = 0; i < n; i++) {
+		if (!set_tck(tp, divs[i])) goto END;
+		q->ver.no_match = 0;
+		for (r = 0; r < AUTOTUNE_REPS; r++) {
+			if (!tune_scan(tp, &tdi, &ref, &ones)) goto END;
+		}
+		errors[i] = q->ver.no_match;
+		printf("   %10.0f Hz : %s\n", tck_rate(g_engine, divs[i]), errors[i] ? "errors" : "pass");
+	}
+	for (best = n; best > 0 && !errors[best - 1]; best--) ;
+	if (best == n) {
+		fprintf(stderr, "autotune : TDO errors even at %.0f Hz\n", tck_rate(g_engine, divs[n - 1]));
+		goto END;
+	}
+	// margin : one step slower than the fastest passing rate
+	if (best + 1 < n) best++;
+	g_tck_max = tck_rate(g_engine, divs[best]);
+	ok = 1;
+END:
+	q->ver.no_match = no_match;
+	q->ver.reported = reported;
+	g_max_report = max_report;
+	g_mode = mode;
+	g_usb.sync = (g_engine == ENGINE_BITBANG && g_mode == 1);
+	free(tdi.w);
+	free(ref.w);
+	free(ones.w);
+	if (ok && mode != 1 && !engine_mode(tp, g_engine)) ok = 0;
+	return ok;
+}
+
+// sweep the USB buffer size, the driver transfer size and the latency
+// timer with a long scan through the chain (IDCODE / BYPASS after reset,
+// the CPLD isn't touched), read back in -c mode; the fastest combination
+// is kept
+int calibrate(TRANSPORT *tp, int qdepth, int threaded, int *bufsize)
+{
+	static const int bufs[] = {4096, 16384, 65536};
+	static const int xfers[] = {4096, 16384, 65536};
+	static const int lats[] = {1, 2, 16};
+	BITVEC tdi = {0}, zero = {0};
+	int b, x, l, r, state, bits, ok = 0;
+	int best_buf = *bufsize, best_xfer = g_usb_xfer, best_lat = g_latency;
+	double start, elapsed, bytes, rate, best = 0;
+
+	bits = (g_engine == ENGINE_MPSSE) ? CALIB_BYTES * 8 : CALIB_BYTES / 2;
+	if (!bv_resize(&tdi, bits) || !bv_resize(&zero, bits)) goto END;
+	memset(tdi.w, 0x5a, BV_WORDS(bits) * sizeof(uint64_t));
+	bv_fill(&zero, 0);
+	printf("   %8s %8s %8s %14s\n", "bufsize", "xfer", "latency", "bytes/sec");
+	for (b = 0; b < 3; b++) {
+		for (x = 0; x < 3; x++) {
+			for (l = 0; l < 3; l++) {
+				g_usb_xfer = xfers[x];
+				g_latency = lats[l];
+				if (!usb_open(tp, qdepth, bufs[b], threaded) || !engine_init(tp)) goto END;
+				bytes = tp->bytes_written + tp->bytes_read;
+				start = now_sec();
+				r = reset_tap(tp, &state) && transit(tp, &state, SHIFT_DR, 0) &&
+					outData(tp, bits, &tdi, (g_mode == 1) ? &zero : NULL, &zero);
+				state = EXIT1_DR;
+				r = r && transit(tp, &state, RUN_TEST, 0) && usb_flush(tp, 1);
+				elapsed = now_sec() - start;
+				usb_close();
+				if (!r) goto END;
+				rate = (elapsed > 0) ? (tp->bytes_written + tp->bytes_read - bytes) / elapsed : 0;
+				printf("   %8d %8d %5d ms %14.0f\n", bufs[b], xfers[x], lats[l], rate);
+				if (rate > best) {
+					best = rate;
+					best_buf = bufs[b];
+					best_xfer = xfers[x];
+					best_lat = lats[l];
+				}
+			}
+		}
+	}
+	printf("   best : -bufsize %d -xfer %d -latency %d\n\n", best_buf, best_xfer, best_lat);
+	ok = 1;
+END:
+	*bufsize = best_buf;
+	g_usb_xfer = best_xfer;
+	g_latency = best_lat;
+	free(tdi.w);
+	free(zero.w);
+	return ok;
+}
+
+// time to run the SVF at the current TCK limits : the SVF is encoded for
+// the engine without being sent and its TCKs and sleeps are added up
+double estimate_svf(const char *fname)
+{
+	SVF_PARSER ps;
+	int current_state, error_code = -1;
+	double sec = -1;
+
+	if (!svf_open(&ps, fname)) return -1;
+	if (usb_open(NULL, 2, USB_BUFSIZE, 0)) {
+		g_usb.dry = 1;
+		if (engine_init(NULL) && reset_tap(NULL, &current_state)) {
+			error_code = parse_svf(&ps, NULL, 0, &current_state);
+		}
+		if (!error_code && usb_flush(NULL, 1)) sec = usb_tck_sec();
+	}
+	usb_close();
+	svf_close(&ps);
+	return sec;
+}
+
+// account n bit bang bytes appended to the staging buffer
+// (every byte is read back in synchronous mode)
+void bb_advance(USB_QUEUE *q, int n)
+{
+	q->length += n;
+	q->tcks += n / 2;
+	if (q->sync) {
+		q->cur->rlength += n;
+		q->rd_queued += n;
+	} else if (g_mode == 1) q->rd_skipped += n;
+}
+
+// switch the bit bang mode of -c between synchronous (sync = 1, read back)
+// and asynchronous; everything before is clocked out first
+int bb_mode(TRANSPORT *tp, int sync)
+{
+	USB_QUEUE *q = &g_usb;
+	int mode = sync ? BITBANG_SYNC : BITBANG_ASYNC;
+
+	if (q->sync == sync) return 1;
+	if (!usb_flush(tp, 1)) return 0;
+	// the asynchronous bytes still in the adapter would be read back too
+	if (sync && !usb_sleep(tp, BITBANG_FIFO_BYTES / (2 * g_tck_hz))) return 0;
+	if (q->record) {
+		if (!stream_add(q->record, NULL, 0, 0, 0, -1, mode)) return 0;
+	} else if (!q->dry && !tp->set_bit_mode(tp, g_bb_mask, mode)) return 0;
+	q->sync = sync;
+	q->mode_switches++;
+	return 1;
+}
+
+// an unchecked run of n bit bang bytes of -c is worth a switch to async
+int bb_async(int n)
+{
+	return g_mode == 1 && !g_fullsync && n >= HYBRID_MIN_BYTES;
+}
+
+// output bit data (bit bang)
+int outBit(TRANSPORT *tp, int tms, int tdi)
+{
+	USB_QUEUE *q = &g_usb;
+
+	q->buff[q->length] = ((tms << 1) | tdi);
+	q->buff[q->length + 1] = (4 | (tms << 1) | tdi);
+	bb_advance(q, 2);
+
+	// write read to/from USB
+	if (q->length >= q->size) {
+		if (!usb_flush(tp, 0)) return 0;
+	}
+	return 1;
+}
+
+// output TMS sequence (bit 0 first, TDI = 0) as one block
+int outTMS(TRANSPORT *tp, int tms, int len)
+{
+	USB_QUEUE *q = &g_usb;
+	unsigned char *p;
+	int i;
+
+	if (g_engine == ENGINE_MPSSE) return mpsse_tms(tp, tms, len);
+	if (q->length + len * 2 > q->size) {
+		if (!usb_flush(tp, 0)) return 0;
+	}
+	p = q->buff + q->length;
+	for (i = 0; i < len; i++, tms >>= 1) {
+		*(p++) = (unsigned char)((tms & 1) << 1);
+		*(p++) = (unsigned char)(4 | ((tms & 1) << 1));
+	}
+	bb_advance(q, len * 2);
+	if (q->length >= q->size) {
+		if (!usb_flush(tp, 0)) return 0;
+	}
+	return 1;
+}
+
+// expand n TDI bits from bit start into TCK low / high byte pairs (TMS = 0)
+void encode_bits(unsigned char *dst, BITVEC *tdi, int start, int n)
+{
+	int i = start, end = start + n, k, m, b;
+	uint64_t w;
+
+	// up to the nibble boundary bit by bit
+	for (; i < end && (i & 3); i++) {
+		b = BV_GET(tdi, i);
+		*(dst++) = (unsigned char)b;
+		*(dst++) = (unsigned char)(4 | b);
+	}
+	// then 8 bytes per nibble
+	while (i + 4 <= end) {
+		w = tdi->w[i >> 6] >> (i & 63);
+		k = (64 - (i & 63)) >> 2;
+		m = (end - i) >> 2;
+		if (m < k) k = m;
+		for (; k > 0; k--, i += 4, dst += 8, w >>= 4) memcpy(dst, bb_nibble[w & 15], 8);
+	}
+	for (; i < end; i++) {
+		b = BV_GET(tdi, i);
+		*(dst++) = (unsigned char)b;
+		*(dst++) = (unsigned char)(4 | b);
+	}
+}
+
+// output data, TDO is compared where MASK is 1 (no compare if tdo is NULL);
+// all bits but the last (TMS = 1) are encoded straight into the staging buffer
+int outData(TRANSPORT *tp, int bitw, BITVEC *tdi, BITVEC *tdo, BITVEC *mask)
+{
+	USB_QUEUE *q = &g_usb;
+	int i = 0, n, last = bitw - 1;
+
+	if (bitw <= 0) return 1;
+	g_stat.tck[q->scan_ir ? TCK_SIR : TCK_SDR] += bitw;
+	if (g_engine == ENGINE_MPSSE) return mpsse_shift(tp, bitw, tdi, tdo, mask);
+	if (g_mode == 1 && tdo) {
+		if (!bb_mode(tp, 1)) return 0;
+		if (!verify_add(tdo, mask, bitw, q->rd_queued)) return 0;
+	} else if (bb_async(bitw * 2) && !bb_mode(tp, 0)) return 0;
+	while (i < last) {
+		n = (q->size - q->length) / 2;
+		if (n > last - i) n = last - i;
+		encode_bits(q->buff + q->length, tdi, i, n);
+		bb_advance(q, n * 2);
+		i += n;
+		if (q->length >= q->size) {
+			if (!usb_flush(tp, 0)) return 0;
+		}
+	}
+	return outBit(tp, 1, BV_GET(tdi, last));
+}
+
+// compare the bits/sec of outBit per bit and the bulk encoder of outData
+int bench_encoder(int bits)
+{
+	TRANSPORT *tp = null_transport();
+	BITVEC tdi = {0};
+	uint64_t x = 88172645463325252ULL;
+	double start, t_bit, t_bulk;
+	int i, r, reps = 16;
+
+	if (!tp || !tp->open(tp) || !bv_resize(&tdi, bits)) return 0;
+	g_engine = ENGINE_BITBANG;
+	if (!usb_open(tp, USB_QDEPTH, USB_BUFSIZE, 0) || !engine_init(tp)) return 0;
+	for (i = 0; i < BV_WORDS(bits); i++) {
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		tdi.w[i] = x;
+	}
+	start = now_sec();
+	for (r = 0; r < reps; r++) {
+		for (i = 0; i < bits; i++) {
+			if (!outBit(tp, (i == (bits-1)) ? 1 : 0, BV_GET(&tdi, i))) return 0;
+		}
+	}
+	t_bit = now_sec() - start;
+	start = now_sec();
+	for (r = 0; r < reps; r++) {
+		if (!outData(tp, bits, &tdi, NULL, NULL)) return 0;
+	}
+	t_bulk = now_sec() - start;
+	usb_flush(tp, 1);
+	usb_close();
+	printf("bits      : %d x %d\n", bits, reps);
+	printf("outBit    : %.3f sec, %.0f bits/sec\n", t_bit, (double)bits * reps / t_bit);
+	printf("outData   : %.3f sec, %.0f bits/sec\n", t_bulk, (double)bits * reps / t_bulk);
+	printf("speed up  : %.1f\n", t_bit / t_bulk);
+	free(tdi.w);
+	tp->close(tp);
+	free(tp);
+	return 1;
+}
+
+// reset TAP machine
+int reset_tap(TRANSPORT *tp, int *current_state)
+{
+	g_stat.tck[TCK_STATE] += 5;
+	if (!outTMS(tp, 0x1f, 5)) return 0;
+	*current_state = TEST_LOGIC_RESET;
+	return 1;
+}
+
+int wait(TRANSPORT *tp, int tms, int wait_clks) {
+	// the MPSSE keeps TMS at the last bit of the path
+	if (g_engine == ENGINE_MPSSE) return mpsse_clocks(tp, wait_clks);
+	return bb_clocks(tp, tms, wait_clks);
+}
+
+// idle TCK (TDI = 0) as a repeated byte pair in the staging buffer
+int bb_clocks(TRANSPORT *tp, int tms, int clks)
+{
+	USB_QUEUE *q = &g_usb;
+	unsigned char *p;
+	int n, k;
+
+	if (bb_async(clks * 2) && !bb_mode(tp, 0)) return 0;
+	while (clks > 0) {
+		n = (q->size - q->length) / 2;
+		if (n > clks) n = clks;
+		p = q->buff + q->length;
+		p[0] = (unsigned char)(tms << 1);
+		p[1] = (unsigned char)(4 | (tms << 1));
+		for (k = 2; k < n * 2; k *= 2) memcpy(p + k, p, (k < n * 2 - k) ? k : n * 2 - k);
+		bb_advance(q, n * 2);
+		clks -= n;
+		if (q->length >= q->size) {
+			if (!usb_flush(tp, 0)) return 0;
+		}
+	}
+	return 1;
+}
+
+// transit state along the shortest path
+int transit(TRANSPORT *tp, int *current, int next, int wait_clks)
+{
+	const TMS_PATH *path = &tms_path[*current][next];
+
+	g_stat.tck[TCK_STATE] += path->len;
+	g_stat.tck[TCK_RUNTEST] += wait_clks;
+	if (!outTMS(tp, path->tms, path->len)) return 0;
+	*current = next;
+	if (!wait(tp, next == TEST_LOGIC_RESET, wait_clks)) return 0;
+	return 1;
+}
+
+// ========== MPSSE engine ==========
+// make room for n command bytes in the staging buffer
+int mpsse_reserve(TRANSPORT *tp, int n)
+{
+	if (g_usb.length + n > g_usb.size) return usb_flush(tp, 0);
+	return 1;
+}
+
+// append a 1 to 3 byte command
+int mpsse_cmd(TRANSPORT *tp, int n, int c0, int c1, int c2)
+{
+	USB_QUEUE *q = &g_usb;
+
+	if (!mpsse_reserve(tp, n)) return 0;
+	q->buff[q->length++] = (unsigned char)c0;
+	if (n > 1) q->buff[q->length++] = (unsigned char)c1;
+	if (n > 2) q->buff[q->length++] = (unsigned char)c2;
+	return 1;
+}
+
+// account n read back bytes of the command just appended
+void mpsse_expect(int n)
+{
+	g_usb.cur->rlength += n;
+	g_usb.rd_queued += n;
+}
+
+// set up the MPSSE : TCK/TDI/TMS out, TMS high, TCK = 60 MHz / ((1 + div) * 2)
+int mpsse_init(TRANSPORT *tp, int div)
+{
+	if (!mpsse_cmd(tp, 1, MPSSE_LOOPBACK_OFF, 0, 0)) return 0;
+	if (!mpsse_cmd(tp, 1, MPSSE_DIV5_OFF, 0, 0)) return 0;
+	if (!mpsse_cmd(tp, 1, MPSSE_ADAPTIVE_OFF, 0, 0)) return 0;
+	if (!mpsse_cmd(tp, 1, MPSSE_3PHASE_OFF, 0, 0)) return 0;
+	if (!mpsse_cmd(tp, 3, MPSSE_SET_LOW, 0x08, 0x0b)) return 0;
+	if (!mpsse_cmd(tp, 3, MPSSE_SET_DIVISOR, div & 0xff, (div >> 8) & 0xff)) return 0;
+	return usb_flush(tp, 1);
+}
+
+// TMS sequence, 7 bits per command (bit 7 is TDI)
+int mpsse_tms(TRANSPORT *tp, int tms, int len)
+{
+	int n;
+
+	g_usb.tcks += len;
+	while (len > 0) {
+		n = (len > 7) ? 7 : len;
+		if (!mpsse_cmd(tp, 3, MPSSE_WRITE_TMS, n - 1, tms & ((1 << n) - 1))) return 0;
+		tms >>= n;
+		len -= n;
+	}
+	return 1;
+}
+
+// SIR/SDR : byte shifts, a bit shift for the remainder and a TMS shift
+// that clocks the last bit; TDO is read back only when it's compared
+int mpsse_shift(TRANSPORT *tp, int bitw, BITVEC *tdi, BITVEC *tdo, BITVEC *mask)
+{
+	USB_QUEUE *q = &g_usb;
+	int rd = (g_mode == 1 && tdo != NULL);
+	int n = bitw - 1, i = 0, k, chunk;
+	unsigned char *p;
+
+	q->tcks += bitw;
+	if (rd) {
+		if (!verify_add(tdo, mask, bitw, q->rd_queued)) return 0;
+	}
+	while (n - i >= 8) {
+		chunk = (n - i) >> 3;
+		if (chunk > 65536) chunk = 65536;
+		if (chunk > q->size - q->length - 3) chunk = q->size - q->length - 3;
+		if (chunk <= 0) {
+			if (!usb_flush(tp, 0)) return 0;
+			continue;
+		}
+		p = q->buff + q->length;
+		*(p++) = rd ? MPSSE_RW_BYTES : MPSSE_WRITE_BYTES;
+		*(p++) = (unsigned char)((chunk - 1) & 0xff);
+		*(p++) = (unsigned char)((chunk - 1) >> 8);
+		for (k = 0; k < chunk; k++, i += 8) *(p++) = (unsigned char)(tdi->w[i >> 6] >> (i & 63));
+		q->length += 3 + chunk;
+		if (rd) mpsse_expect(chunk);
+	}
+	if (n > i) {
+		if (!mpsse_cmd(tp, 3, rd ? MPSSE_RW_BITS : MPSSE_WRITE_BITS, n - i - 1, (int)(tdi->w[i >> 6] >> (i & 63)) & 0xff)) return 0;
+		if (rd) mpsse_expect(1);
+	}
+	if (!mpsse_cmd(tp, 3, rd ? MPSSE_RW_TMS : MPSSE_WRITE_TMS, 0, (BV_GET(tdi, n) << 7) | 1)) return 0;
+	if (rd) mpsse_expect(1);
+	return 1;
+}
+
+// clocks with TMS / TDI unchanged
+int mpsse_clocks(TRANSPORT *tp, int clks)
+{
+	int n;
+
+	g_usb.tcks += clks;
+	while (clks >= 8) {
+		n = clks >> 3;
+		if (n > 65536) n = 65536;
+		if (!mpsse_cmd(tp, 3, MPSSE_CLOCK_BYTES, (n - 1) & 0xff, (n - 1) >> 8)) return 0;
+		clks -= n * 8;
+	}
+	if (clks > 0) {
+		if (!mpsse_cmd(tp, 2, MPSSE_CLOCK_BITS, clks - 1, 0)) return 0;
+	}
+	return 1;
+}
+
+// get state from state name
+int state_of_string(TOKEN *n, int *s)
+{
+	if (tok_is(n, "IDLE")) *s = RUN_TEST;
+	else if (tok_is(n, "RESET")) *s = TEST_LOGIC_RESET;
+	else if (tok_is(n, "IRPAUSE")) *s = PAUSE_IR;
+	else if (tok_is(n, "DRPAUSE")) *s = PAUSE_DR;
+	else if (tok_is(n, "IREXIT1")) *s = EXIT1_IR;
+	else if (tok_is(n, "IREXIT2")) *s = EXIT2_IR;
+	else if (tok_is(n, "DREXIT1")) *s = EXIT1_DR;
+	else if (tok_is(n, "DREXIT2")) *s = EXIT2_DR;
+	else if (tok_is(n, "IRUPDATE")) *s = UPDATE_IR;
+	else if (tok_is(n, "DRUPDATE")) *s = UPDATE_DR;
+	else if (tok_is(n, "IRSELECT")) *s = SELECT_IR_SCAN;
+	else if (tok_is(n, "DRSELECT")) *s = SELECT_DR_SCAN;
+	else if (tok_is(n, "IRCAPTURE")) *s = CAPTURE_IR;
+	else if (tok_is(n, "DRCAPTURE")) *s = CAPTURE_DR;
+	else {
+		fprintf(stderr, "unknown state(%.*s) at line %d\n", n->len, n->str, n->line);
+		return 0;
+	}
+	return 1;
+}
+
+// TCKs of a run of clks TCK and at least min_time seconds at the actual
+// TCK; long bit bang runs sleep on the host (*sleep > 0) instead of
+// sending megabytes of idle clocks
+int run_clocks(int clks, double min_time, double *sleep)
+{
+	double tclks = min_time * g_tck_hz + 0.999;
+
+	*sleep = 0;
+	if (tclks > clks) {
+		if (tclks > 0x7fffffff || (g_engine == ENGINE_BITBANG && tclks > IDLE_SLEEP_CLKS)) *sleep = min_time;
+		else clks = (int)tclks;
+	}
+	return clks;
+}
+
+// shift sp through the IR or the DR with the header / trailer of the
+// chain; the TAP is left in EXIT1 (returns the parse_svf error code)
+int shift_scan(SVF_PARSER *ps, TRANSPORT *tp, SCAN_PARAM *sp, int ir, int line, int *current_state)
+{
+	SCAN_PARAM *hd = ir ? &ps->hir : &ps->hdr, *tl = ir ? &ps->tir : &ps->tdr, *out = sp;
+
+	g_usb.scan_line = line;
+	g_usb.scan_ir = ir;
+	g_usb.scan_unit = sp->bits;
+	g_usb.scan_units = 1;
+	g_usb.scan_hbits = 0;
+	if (hd->bits || tl->bits || g_broadcast > 1) {
+		// the same payload to every device of the broadcast mode
+		if (!compose_scan(&ps->scan, hd, sp, g_broadcast, tl)) return 28;
+		g_usb.scan_units = g_broadcast;
+		g_usb.scan_hbits = hd->bits;
+		out = &ps->scan;
+	}
+	if (!transit(tp, current_state, ir ? SHIFT_IR : SHIFT_DR, 0)) return 1;
+	// TDO with MASK all 0 isn't read back
+	if (!outData(tp, out->bits, &out->tdi, (out->tdo_valid && bv_any(&out->mask)) ? &out->tdo : NULL, &out->mask)) {
+		return 9;
+	}
+	*current_state = ir ? EXIT1_IR : EXIT1_DR;
+	return 0;
+}
+
+// shift the DR scan sp and wait for its TDO compare (*match); a mismatch
+// isn't listed and is taken back, the scan is to be shifted again. The
+// scans before are compared first, their mismatches are not the try's.
+int scan_try(SVF_PARSER *ps, TRANSPORT *tp, SCAN_PARAM *sp, int line, int *current_state, int *match)
+{
+	VERIFIER *vf = &g_usb.ver;
+	int ret, ok, no_match, reported, unit[MAX_CHAIN];
+
+	if (!usb_flush(tp, 1)) return 9;
+	no_match = vf->no_match;
+	reported = vf->reported;
+	memcpy(unit, vf->unit_no_match, sizeof(unit));
+	vf->quiet = 1;
+	ret = shift_scan(ps, tp, sp, 0, line, current_state);
+	ok = !ret && usb_flush(tp, 1);
+	vf->quiet = 0;
+	if (ret) return ret;
+	if (!ok) return 9;
+	*match = (vf->no_match == no_match);
+	if (!*match) {
+		vf->no_match = no_match;
+		vf->reported = reported;
+		memcpy(vf->unit_no_match, unit, sizeof(unit));
+		g_stat.retries++;
+	}
+	return 0;
+}
+
+// -retry : a scan shifted again captures after its own UPDATE-DR, not
+// after the one of the SDR before. In a pipelined verify (the TDI of an
+// SDR addresses the row the next one reads) it would read another row,
+// so only an SDR with the TDI of the SDR right before it (a status poll,
+// a row read again) is retried. Remembers the TDI of sp for the next SDR.
+int retry_same(SVF_PARSER *ps, SCAN_PARAM *sp)
+{
+	BITVEC *prev = &ps->retry_tdi;
+	int same = (prev->bits > 0 && prev->bits == sp->bits && !memcmp(prev->w, sp->tdi.w, BV_WORDS(sp->bits) * sizeof(uint64_t)));
+
+	if (!same) {
+		if (!bv_resize(prev, sp->bits)) {
+			prev->bits = 0;
+			return 0;
+		}
+		memcpy(prev->w, sp->tdi.w, BV_WORDS(sp->bits) * sizeof(uint64_t));
+	}
+	return same;
+}
+
+// -retry : an SDR whose TDO doesn't match is shifted again (captured
+// again) up to g_retry times, after idling in the state of the last
+// RUNTEST twice as long as before each time (RETRY_MIN_SEC at least).
+// A scan expecting its own TDI isn't retried : a register that doesn't
+// capture would pass by reading the TDI of the try before.
+int svf_retry(SVF_PARSER *ps, TRANSPORT *tp, SCAN_PARAM *sp, int line, RUNTEST_PARAM *rt, int *current_state)
+{
+	int i, k, ret, match, clks = rt->clks, echo = 1;
+	double sec = rt->min_time, sleep;
+
+	for (i = 0; i < BV_WORDS(sp->bits) && echo; i++) echo = !((sp->tdi.w[i] ^ sp->tdo.w[i]) & sp->mask.w[i]);
+	for (k = 0; k < g_retry && !echo; k++) {
+		if ((ret = scan_try(ps, tp, sp, line, current_state, &match))) return ret;
+		if (match) return 0;
+		if (clks < 0x40000000) clks *= 2;
+		sec = (sec * 2 < RETRY_MIN_SEC) ? RETRY_MIN_SEC : sec * 2;
+		clks = run_clocks(clks, sec, &sleep);
+		if (!transit(tp, current_state, rt->run_state, clks)) return 18;
+		if (sleep > 0 && !usb_sleep(tp, sleep)) return 18;
+	}
+	return shift_scan(ps, tp, sp, 0, line, current_state);
+}
+
+static int parse_cmds(SVF_PARSER *ps, TRANSPORT *tp, int v, int *current_state)
+{
+	TOKEN keyw, keyw2;
+	SCAN_PARAM *sp;
+	RUNTEST_PARAM rt;
+	int semi, ret, bitw, clks, has_tdo, cmd;
+	int end_ir = RUN_TEST, end_dr = RUN_TEST;
+	double t_enc, ofs;
+
+	stat_start();
+	rt.run_state = rt.run_end = RUN_TEST;
+	rt.clks = 0;
+	rt.min_time = 0;
+	if (ps->resume) {
+		// where the checkpoint left off
+		end_ir = ps->resume->end_ir;
+		end_dr = ps->resume->end_dr;
+		rt.run_state = ps->resume->run_state;
+		rt.run_end = ps->resume->run_end;
+		rt.clks = ps->resume->run_clks;
+		rt.min_time = ps->resume->run_sec;
+	}
+	while (get_word(ps, &keyw, &semi)) {
+		// where the command starts (the window may move while it is read)
+		ofs = ps->consumed + (double)(keyw.str - ps->buf);
+		if (ps->limit > 0 && ofs >= ps->limit) break;
+		// t_enc : the command is decoded, encoding starts
+		cmd = CMD_OTHER;
+		t_enc = 0;
+		if (is_ignore(&keyw)) {
+			while (!semi) {
+				ret = get_word(ps, &keyw, &semi);
+				if (!ret) break;
+			}
+		} else if (tok_is(&keyw, "HIR") || tok_is(&keyw, "TIR") || tok_is(&keyw, "HDR") || tok_is(&keyw, "TDR")) {
+			sp = tok_is(&keyw, "HIR") ? &ps->hir : tok_is(&keyw, "TIR") ? &ps->tir : tok_is(&keyw, "HDR") ? &ps->hdr : &ps->tdr;
+			cmd = CMD_HEADER;
+			if ((ret = read_scan(ps, sp))) return ret;
+			if (v) {
+				printf("%.*s %d TDI ", keyw.len, keyw.str, sp->bits);
+				bv_print(stdout, &sp->tdi);
+				printf("\n");
+			}
+		} else if (sir_sdr(&keyw)) {
+			int ir = tok_is(&keyw, "SIR");
+
+			cmd = ir ? CMD_SIR : CMD_SDR;
+			sp = ir ? &ps->sir : &ps->sdr;
+			if ((ret = read_scan(ps, sp))) return ret;
+			if (ir && g_ckpt_file) ckpt_sir(ps, sp, ofs, keyw.line);
+			bitw = sp->bits;
+			has_tdo = sp->tdo_valid;
+			if (v) {
+				printf("%s %d TDI ", ir ? "SIR" : "SDR", bitw);
+				bv_print(stdout, &sp->tdi);
+				printf(" SMASK ");
+				bv_print(stdout, &sp->smask);
+				if (has_tdo) {
+					printf(" TDO ");
+					bv_print(stdout, &sp->tdo);
+					printf(" MASK ");
+					bv_print(stdout, &sp->mask);
+				}
+				printf("\n");
+			}
+			t_enc = now_sec();
+			if (!ir && g_retry > 0 && retry_same(ps, sp) && has_tdo && g_mode == 1 && !g_usb.record && !g_usb.dry) ret = svf_retry(ps, tp, sp, keyw.line, &rt, current_state);
+			else ret = shift_scan(ps, tp, sp, ir, keyw.line, current_state);
+			if (ret) return ret;
+			if (ir) {
+				if (!transit(tp, current_state, end_ir, 0)) return 10;
+			} else {
+				if (!transit(tp, current_state, end_dr, 0)) return 11;
+			}
+		} else if (tok_is(&keyw, "FREQUENCY")) {
+			// FREQUENCY [cycles HZ]; TCK doesn't exceed cycles (no limit without)
+			double hz = 0;
+
+			cmd = CMD_FREQUENCY;
+			if (!semi) {
+				if (!get_word(ps, &keyw, &semi) || !is_number(&keyw) || semi) return 29;
+				hz = double_of_token(&keyw);
+				if (!get_word(ps, &keyw, &semi) || !tok_is(&keyw, "HZ") || !semi) return 29;
+			}
+			g_svf_freq = hz;
+			t_enc = now_sec();
+			if (!apply_tck(tp)) return 30;
+			if (v) {
+				if (hz > 0) printf("FREQUENCY %.0f HZ (TCK %.0f Hz)\n", hz, g_tck_hz);
+				else printf("FREQUENCY (TCK %.0f Hz)\n", g_tck_hz);
+			}
+		} else if (tok_is(&keyw, "RUNTEST")) {
+			// the maximum time is not enforced, the run is never much longer
+			double sleep;
+
+			cmd = CMD_RUNTEST;
+			if ((ret = read_runtest(ps, &rt))) return ret;
+			clks = run_clocks(rt.clks, rt.min_time, &sleep);
+			if (v) { printf("RUNTEST %d TCK", clks); if (sleep > 0) printf(" %g SEC", sleep); printf("\n"); fflush(stdout); }
+			t_enc = now_sec();
+			if (!transit(tp, current_state, rt.run_state, clks)) return 18;
+			if (sleep > 0) {
+				if (!usb_sleep(tp, sleep)) return 18;
+			}
+			if (!transit(tp, current_state, rt.run_end, 0)) return 18;
+			// the first RUNTEST closes an ISC_ENABLE group
+			if (ps->enable_end < 0) ps->enable_end = ps->consumed + ps->pos;
+			// the end of a programming row : a safe point to resume from
+			// (once the device was put in ISC mode, not while replaying)
+			if (g_ckpt_file && ps->enable_line > 0 && !ps->limit && !g_usb.record && !g_usb.dry && now_sec() - g_ckpt_t >= CKPT_SEC) {
+				if (!ckpt_take(ps, tp, *current_state, end_ir, end_dr, &rt)) return 18;
+			}
+		} else if (tok_is(&keyw, "STATE")) {
+			cmd = CMD_STATE;
+			t_enc = now_sec();
 			if (v) printf("STATE ");
 			do {
-				int n;
-				if (!get_word(fp, keyw2, &semi)) return 19;
-				if (!state_of_string(keyw2, &n)) return 20;
-				if (!transit(ftHandle, current_state, n, 0)) return 21;
-				if (v) printf("%s ", keyw2);
+				int n;
+				if (!get_word(ps, &keyw2, &semi)) return 19;
+				if (!state_of_string(&keyw2, &n)) return 20;
+				if (!transit(tp, current_state, n, 0)) return 21;
+				if (v) printf("%.*s ", keyw2.len, keyw2.str);
+			} while (!semi);
+			if (v) printf("\n");
+		} else if (tok_is(&keyw, "ENDIR")) {
+			int n;
+			if (!get_word(ps, &keyw2, &semi)) return 22;
+			if (v) printf("ENDIR %.*s\n", keyw2.len, keyw2.str);
+			if (!state_of_string(&keyw2, &n)) return 23;
+			end_ir = n;
+		} else if (tok_is(&keyw, "ENDDR")) {
+			int n;
+			if (!get_word(ps, &keyw2, &semi)) return 24;
+			if (v) printf("ENDDR %.*s\n", keyw2.len, keyw2.str);
+			if (!state_of_string(&keyw2, &n)) return 25;
+			end_dr = n;
+		} else return 26;
+		stat_cmd(ps, cmd, t_enc);
+		// -retry : the SDR after doesn't read what the one before did
+		if (cmd == CMD_SIR || cmd == CMD_STATE || cmd == CMD_HEADER) ps->retry_tdi.bits = 0;
+	}
+	if (g_progress && !g_usb.dry && !ps->limit) progress(ps, now_sec(), 1);
+	return 0;
+}
+
+// parse SVF file
+int parse_svf(SVF_PARSER *ps, TRANSPORT *tp, int v, int *current_state)
+{
+	int error_code = is_xsvf(ps) ? xsvf_run(ps, tp, v, current_state, 1) : parse_cmds(ps, tp, v, current_state);
+	// a truncated or corrupt compressed SVF (or a token too long to keep)
+	// ends mid-command, report the cause instead
+	if (ps->read_error) return ps->read_error;
+	return error_code;
+}
+
+// tokenize the whole SVF and report the tokenizer throughput (an XSVF is
+// decoded, commands count as tokens)
+int parse_only(SVF_PARSER *ps)
+{
+	TOKEN t;
+	int semi, state = TEST_LOGIC_RESET, xsvf = is_xsvf(ps), ret = 0;
+	double start = now_sec(), elapsed, bytes;
+
+	if (xsvf) ret = xsvf_run(ps, NULL, 0, &state, 0);
+	else while (get_word(ps, &t, &semi)) ;
+	elapsed = now_sec() - start;
+	if (ret) fprintf(stderr, "parse error(errorcode = %d, line = %d)\n", ret, ps->line);
+	bytes = ps->consumed + ps->len;
+	printf("%-10s: %ld\n", xsvf ? "commands" : "tokens", ps->tokens);
+	printf("bytes     : %.0f\n", bytes);
+	if (!xsvf) printf("lines     : %d\n", ps->line);
+	printf("elapsed   : %.3f sec\n", elapsed);
+	if (elapsed > 0) {
+		printf("throughput: %.0f %s/sec, %.2f MB/sec\n", ps->tokens / elapsed, xsvf ? "commands" : "tokens", bytes / elapsed / 1e6);
+	}
+	return 0;
+}
+
+// ========== XSVF player ==========
+// XSVF is the binary SVF of Xilinx (XAPP503) : a command byte and its
+// arguments, the integers big endian and the vectors in (bits + 7) / 8
+// bytes, bit 0 in the LSB of the last byte. It drives the TAP / encoder
+// back end of the SVF; the command number stands for the line number
+// in the reports.
+static const char *xsvf_name[NUM_XCMD] = {
+	"XCOMPLETE", "XTDOMASK", "XSIR", "XSDR", "XRUNTEST", "?", "?", "XREPEAT",
+	"XSDRSIZE", "XSDRTDO", "XSETSDRMASKS", "XSDRINC", "XSDRB", "XSDRC", "XSDRE", "XSDRTDOB",
+	"XSDRTDOC", "XSDRTDOE", "XSTATE", "XENDIR", "XENDDR", "XSIR2", "XCOMMENT", "XWAIT"
+};
+
+// the first byte of an XSVF is a command, 0x09 - 0x0d (XSDRTDO - XSDRC)
+// among them look blank. SVF is text : up to the end of its first line
+// (at most XSVF_SNIFF bytes, a pipe isn't waited on for more) there are
+// only blanks and printable characters, and the first word starts with a
+// letter or a comment ('!', "//")
+int is_xsvf(SVF_PARSER *ps)
+{
+	int i, c, word = 0;
+
+	if ((c = SVF_PEEK(ps, 0)) < 0 || c >= NUM_XCMD) return 0;
+	for (i = 0; i < XSVF_SNIFF && (c = SVF_PEEK(ps, i)) >= 0; i++) {
+		if (c < 0x20 && !isspace(c)) return 1;
+		if (!word && !isspace(c)) {
+			if (!isalpha(c) && c != '!' && c != '/') return 1;
+			word = 1;
+		} else if (word && c == '\n') break;
+	}
+	return 0;
+}
+
+// make n bytes from ps->pos on readable (0 : the XSVF ends before)
+static int xsvf_need(SVF_PARSER *ps, size_t n)
+{
+	while (ps->pos + n > ps->len) {
+		if (!svf_fill(ps)) return 0;
+	}
+	return 1;
+}
+
+// big endian integer of n bytes
+static int xsvf_int(SVF_PARSER *ps, int n, uint32_t *x)
+{
+	const unsigned char *p;
+
+	if (!xsvf_need(ps, n)) return 0;
+	p = (const unsigned char *)ps->buf + ps->pos;
+	ps->pos += n;
+	for (*x = 0; n > 0; n--) *x = (*x << 8) | *p++;
+	return 1;
+}
+
+// vector of bits into bv
+static int xsvf_vec(SVF_PARSER *ps, BITVEC *bv, int bits)
+{
+	int i, n = (bits + 7) >> 3;
+	const unsigned char *p;
+
+	if (!bv_resize(bv, bits) || !xsvf_need(ps, n)) return 0;
+	if (!n) return 1;
+	p = (const unsigned char *)ps->buf + ps->pos + n - 1;
+	memset(bv->w, 0, BV_WORDS(bits) * sizeof(uint64_t));
+	for (i = 0; i < n; i++) bv->w[i >> 3] |= (uint64_t)*p-- << ((i & 7) * 8);
+	if (bits & 63) bv->w[BV_WORDS(bits) - 1] &= (~(uint64_t)0) >> (64 - (bits & 63));
+	ps->pos += n;
+	return 1;
+}
+
+// append the segment sp of a split shift (XSDRB / XSDRC / XSDRE) to dst
+static int xsvf_append(SCAN_PARAM *dst, SCAN_PARAM *sp)
+{
+	int pos = dst->bits, bits = pos + sp->bits, i;
+
+	if (bits > XSVF_MAX_BITS) return 0;
+	if (!bv_resize(&dst->tdi, bits) || !bv_resize(&dst->tdo, bits) || !bv_resize(&dst->mask, bits)) return 0;
+	for (i = BV_WORDS(pos); i < BV_WORDS(bits); i++) dst->tdi.w[i] = dst->tdo.w[i] = dst->mask.w[i] = 0;
+	dst->bits = bits;
+	bv_put(&dst->tdi, pos, &sp->tdi, sp->bits);
+	if (sp->tdo_valid) {
+		bv_put(&dst->tdo, pos, &sp->tdo, sp->bits);
+		bv_put(&dst->mask, pos, &sp->mask, sp->bits);
+		dst->tdo_valid = 1;
+	}
+	return 1;
+}
+
+// wait usec microseconds and at least as many TCKs (the TCK of the
+// reference player is 1 MHz) in the current state
+static int xsvf_wait(TRANSPORT *tp, int *current_state, double usec)
+{
+	double sleep;
+	int clks;
+
+	if (usec <= 0) return 1;
+	clks = run_clocks(0, usec * 1e-6, &sleep);
+	if (sleep == 0 && clks < usec) clks = (int)usec;
+	if (!transit(tp, current_state, *current_state, clks)) return 0;
+	return (sleep > 0) ? usb_sleep(tp, sleep) : 1;
+}
+
+// shift the DR scan sp, go to end and wait usec; with -c, a scan whose
+// TDO doesn't match goes through UPDATE-DR to Run-Test/Idle, waits 25 %
+// longer there (the device programs the row in Run-Test/Idle) and is
+// shifted again, up to repeat times (XREPEAT, as the XAPP503 player).
+// Only the last try is reported; compiled and estimated runs shift once.
+static int xsvf_sdr(SVF_PARSER *ps, TRANSPORT *tp, SCAN_PARAM *sp, int repeat, int end, double usec, int *current_state)
+{
+	int ret, match = 0;
+
+	if (g_mode != 1 || !sp->tdo_valid || g_usb.record || g_usb.dry) repeat = 0;
+	for (; repeat > 0 && !match; repeat--) {
+		if ((ret = scan_try(ps, tp, sp, ps->line, current_state, &match))) return ret;
+		if (match) break;
+		usec += usec / 4;
+		if (!transit(tp, current_state, RUN_TEST, 0) || !xsvf_wait(tp, current_state, usec)) return 11;
+	}
+	if (!match && (ret = shift_scan(ps, tp, sp, 0, ps->line, current_state))) return ret;
+	if (!transit(tp, current_state, end, 0) || !xsvf_wait(tp, current_state, usec)) return 11;
+	return 0;
+}
+
+// print a scan of the verbose mode
+static void xsvf_print(int c, SCAN_PARAM *sp, int tdo)
+{
+	printf("%s %d TDI ", xsvf_name[c], sp->bits);
+	bv_print(stdout, &sp->tdi);
+	if (tdo) {
+		printf(" TDO ");
+		bv_print(stdout, &sp->tdo);
+		printf(" MASK ");
+		bv_print(stdout, &sp->mask);
+	}
+	printf("\n");
+}
+
+// run the XSVF; returns the parse_svf error code (32 : truncated or bad
+// argument, 33 : command not supported)
+int xsvf_run(SVF_PARSER *ps, TRANSPORT *tp, int v, int *current_state, int exec)
+{
+	SCAN_PARAM *sir = &ps->sir, *sdr = &ps->sdr, *seg = &ps->xseg;
+	int c, cmd, ret, repeat = 0, end_ir = RUN_TEST, end_dr = RUN_TEST, n = 0;
+	uint32_t x, y, z, sdr_bits = 0, run_usec = 0;
+	double t_enc;
+
+	stat_start();
+	ps->line = 0;
+	for (;;) {
+		ps->mark = ps->pos;
+		if (!xsvf_need(ps, 1)) break;
+		c = (unsigned char)ps->buf[ps->pos++];
+		ps->line = ++n;
+		ps->tokens++;
+		if (c == XCOMPLETE) break;
+		cmd = CMD_OTHER;
+		t_enc = 0;
+		switch (c) {
+		case XTDOMASK:
+			if (!xsvf_vec(ps, &sdr->mask, sdr_bits)) return 32;
+			if (v) { printf("XTDOMASK "); bv_print(stdout, &sdr->mask); printf("\n"); }
+			break;
+		case XSIR:
+		case XSIR2:
+			cmd = CMD_SIR;
+			if (!xsvf_int(ps, c == XSIR ? 1 : 2, &x) || !xsvf_vec(ps, &sir->tdi, x)) return 32;
+			sir->bits = x;
+			sir->tdo_valid = 0;
+			if (v) xsvf_print(c, sir, 0);
+			if (!exec) break;
+			t_enc = now_sec();
+			if ((ret = shift_scan(ps, tp, sir, 1, n, current_state))) return ret;
+			if (!transit(tp, current_state, end_ir, 0) || !xsvf_wait(tp, current_state, run_usec)) return 10;
+			break;
+		case XSDR:
+		case XSDRTDO:
+			cmd = CMD_SDR;
+			if (!xsvf_vec(ps, &sdr->tdi, sdr_bits)) return 32;
+			if (c == XSDRTDO && !xsvf_vec(ps, &sdr->tdo, sdr_bits)) return 32;
+			// XSDR compares with the TDO of the last XSDRTDO
+			sdr->tdo_valid = bv_any(&sdr->mask);
+			if (v) xsvf_print(c, sdr, sdr->tdo_valid);
+			if (!exec) break;
+			t_enc = now_sec();
+			if ((ret = xsvf_sdr(ps, tp, sdr, repeat, end_dr, run_usec, current_state))) return ret;
+			break;
+		case XSDRB: case XSDRC: case XSDRE:
+		case XSDRTDOB: case XSDRTDOC: case XSDRTDOE:
+			// one shift in segments, shifted at once at XSDRE / XSDRTDOE
+			cmd = CMD_SDR;
+			if (!xsvf_vec(ps, &sdr->tdi, sdr_bits)) return 32;
+			sdr->tdo_valid = (c >= XSDRTDOB);
+			if (sdr->tdo_valid && !xsvf_vec(ps, &sdr->tdo, sdr_bits)) return 32;
+			if (c == XSDRB || c == XSDRTDOB) seg->bits = seg->tdo_valid = 0;
+			if (!xsvf_append(seg, sdr)) return 28;
+			if (v) xsvf_print(c, sdr, sdr->tdo_valid);
+			if (!exec || (c != XSDRE && c != XSDRTDOE)) break;
+			t_enc = now_sec();
+			if ((ret = shift_scan(ps, tp, seg, 0, n, current_state))) return ret;
+			if (!transit(tp, current_state, end_dr, 0) || !xsvf_wait(tp, current_state, run_usec)) return 11;
+			break;
+		case XRUNTEST:
+			if (!xsvf_int(ps, 4, &run_usec)) return 32;
+			if (v) printf("XRUNTEST %u\n", run_usec);
+			break;
+		case XREPEAT:
+			if (!xsvf_int(ps, 1, &x)) return 32;
+			repeat = x;
+			if (v) printf("XREPEAT %d\n", repeat);
+			break;
+		case XSDRSIZE:
+			if (!xsvf_int(ps, 4, &sdr_bits) || sdr_bits > XSVF_MAX_BITS) return 32;
+			if ((int)sdr_bits != sdr->bits) {
+				if (!bv_resize(&sdr->tdo, sdr_bits) || !bv_resize(&sdr->mask, sdr_bits)) return 28;
+				bv_fill(&sdr->tdo, 0);
+				bv_fill(&sdr->mask, 0);
+				sdr->bits = sdr_bits;
+			}
+			if (v) printf("XSDRSIZE %u\n", sdr_bits);
+			break;
+		case XSTATE:
+			cmd = CMD_STATE;
+			if (!xsvf_int(ps, 1, &x) || x > UPDATE_IR) return 32;
+			if (v) printf("XSTATE %s\n", state_name[x]);
+			if (!exec) break;
+			t_enc = now_sec();
+			if (!transit(tp, current_state, x, 0)) return 21;
+			break;
+		case XENDIR:
+		case XENDDR:
+			if (!xsvf_int(ps, 1, &x) || x > 1) return 32;
+			if (c == XENDIR) end_ir = x ? PAUSE_IR : RUN_TEST;
+			else end_dr = x ? PAUSE_DR : RUN_TEST;
+			if (v) printf("%s %s\n", xsvf_name[c], state_name[c == XENDIR ? end_ir : end_dr]);
+			break;
+		case XCOMMENT:
+			for (x = 0; xsvf_need(ps, x + 1) && ps->buf[ps->pos + x]; x++) ;
+			if (!xsvf_need(ps, x + 1)) return 32;
+			if (v) printf("XCOMMENT %.*s\n", (int)x, ps->buf + ps->pos);
+			ps->pos += x + 1;
+			break;
+		case XWAIT:
+			cmd = CMD_RUNTEST;
+			if (!xsvf_int(ps, 1, &x) || !xsvf_int(ps, 1, &y) || x > UPDATE_IR || y > UPDATE_IR) return 32;
+			// the wait of XWAIT alone, XRUNTEST is kept
+			if (!xsvf_int(ps, 4, &z)) return 32;
+			if (v) printf("XWAIT %s %s %u\n", state_name[x], state_name[y], z);
+			if (!exec) break;
+			t_enc = now_sec();
+			if (!transit(tp, current_state, x, 0) || !xsvf_wait(tp, current_state, z)) return 18;
+			if (!transit(tp, current_state, y, 0)) return 18;
+			break;
+		default:
+			// XSETSDRMASKS / XSDRINC are obsolete
+			return 33;
+		}
+		stat_cmd(ps, cmd, t_enc);
+	}
+	if (g_progress && !g_usb.dry && exec) progress(ps, now_sec(), 1);
+	return 0;
+}
+
+// sleep sec seconds
+void sleep_sec(double sec)
+{
+#ifdef _WIN32
+	Sleep((DWORD)(sec * 1000 + 0.999));
+#else
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)sec;
+	ts.tv_nsec = (long)((sec - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) && errno == EINTR);
+#endif
+}
+
+// current time in seconds
+double now_sec(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+// add a driver call of sec seconds to the latency histogram
+void lat_add(long *hist, double *total, double sec)
+{
+	double usec = sec * 1e6;
+	int k = 0;
+
+	*total += sec;
+	while (k < LAT_BINS - 1 && (double)(1 << k) < usec) k++;
+	hist[k]++;
+}
+
+void tp_clear_stat(TRANSPORT *tp)
+{
+	tp->bytes_written = tp->bytes_read = 0;
+	tp->write_calls = tp->read_calls = 0;
+	tp->write_sec = tp->read_sec = 0;
+	memset(tp->lat_hist, 0, sizeof(tp->lat_hist));
+}
+
+// write to the transport, return 1 if all bytes are written
+int tp_write(TRANSPORT *tp, unsigned char *buf, int len)
+{
+	double t = now_sec();
+
+	tp->write_calls++;
+	if (!tp->write(tp, buf, len)) return 0;
+	tp->bytes_written += len;
+	lat_add(tp->lat_hist[0], &tp->write_sec, now_sec() - t);
+	return 1;
+}
+
+// read from the transport, return 1 if all bytes are read
+int tp_read(TRANSPORT *tp, unsigned char *buf, int len)
+{
+	double t = now_sec();
+
+	tp->read_calls++;
+	if (!tp->read(tp, buf, len)) return 0;
+	tp->bytes_read += len;
+	lat_add(tp->lat_hist[1], &tp->read_sec, now_sec() - t);
+	return 1;
+}
+
+// print transfer statistics
+void print_stat(TRANSPORT *tp, double elapsed)
+{
+	printf("transport : %s\n", tp->name);
+	printf("written   : %.0f bytes in %ld calls\n", tp->bytes_written, tp->write_calls);
+	printf("read      : %.0f bytes in %ld calls\n", tp->bytes_read, tp->read_calls);
+	printf("elapsed   : %.3f sec\n", elapsed);
+	if (elapsed > 0) {
+		printf("throughput: %.0f bytes/sec\n", (tp->bytes_written + tp->bytes_read) / elapsed);
+	}
+	if (tp->read_calls > 0) {
+		printf("round trip: %.1f usec\n", elapsed * 1e6 / tp->read_calls);
+	}
+	printf("buffers   : %d x %d bytes%s\n", g_usb.depth, g_usb.size, g_usb.threaded ? "" : " (no I/O thread)");
+	printf("stall     : parser %.3f sec, I/O %.3f sec\n", g_usb.stall_parser, g_usb.stall_io);
+	printf("TCK       : %.0f clocks, last at %.0f Hz (%.3f sec with sleeps)\n", (double)g_usb.tcks, g_tck_hz, usb_tck_sec());
+	if (g_mode == 1 && g_engine == ENGINE_BITBANG) {
+		printf("read back : %.0f bytes, %.0f bytes skipped in asynchronous runs (%ld mode switches)\n",
+			(double)g_usb.rd_queued, (double)g_usb.rd_skipped, g_usb.mode_switches);
+	}
+	printf("parser    : parse %.3f sec, encode %.3f sec (%.3f sec of it waiting for USB)\n", g_stat.parse_sec, g_stat.encode_sec, g_stat.wait_sec);
+	printf("driver    : write %.3f sec, read %.3f sec\n", tp->write_sec, tp->read_sec);
+}
+
+static const char *cmd_name[NUM_CMD] = {"SIR", "SDR", "RUNTEST", "STATE", "HIR/TIR/HDR/TDR", "FREQUENCY", "other"};
+static const char *tck_name[NUM_TCK] = {"sir", "sdr", "runtest", "state"};
+
+void stat_start(void)
+{
+	memset(&g_stat, 0, sizeof(RUN_STAT));
+	g_stat.last_t = g_stat.prog_t = now_sec();
+	g_stat.last_tcks = g_stat.prog_tcks = g_usb.tcks;
+	g_stat.last_stall = g_usb.stall_parser;
+}
+
+// account the command just parsed : decoded until t_enc (0 if it isn't
+// encoded), encoded until now
+void stat_cmd(SVF_PARSER *ps, int cmd, double t_enc)
+{
+	RUN_STAT *s = &g_stat;
+	double t = now_sec();
+
+	if (t_enc == 0) t_enc = t;
+	s->parse_sec += t_enc - s->last_t;
+	s->encode_sec += t - t_enc;
+	s->wait_sec += g_usb.stall_parser - s->last_stall;
+	s->last_stall = g_usb.stall_parser;
+	s->cmd[cmd].count++;
+	s->cmd[cmd].sec += t - s->last_t;
+	s->cmd[cmd].tcks += g_usb.tcks - s->last_tcks;
+	s->last_t = t;
+	s->last_tcks = g_usb.tcks;
+	if (g_progress && !g_usb.dry && t - s->prog_t >= PROGRESS_SEC) progress(ps, t, 0);
+}
+
+// progress line on stderr : part of the file processed and the TCK rate
+// since the previous line (bits/sec)
+void progress(SVF_PARSER *ps, double t, int last)
+{
+	RUN_STAT *s = &g_stat;
+	double pos = ps->consumed + ps->pos;
+	double rate = (t > s->prog_t) ? (g_usb.tcks - s->prog_tcks) / (t - s->prog_t) : 0;
+
+	if (ps->size > 0) fprintf(stderr, "\r   %5.1f %%  %12.0f bits/sec ", pos * 100 / ps->size, rate);
+	else fprintf(stderr, "\r   %12.0f bytes  %12.0f bits/sec ", pos, rate);
+	if (last) fprintf(stderr, "\n");
+	fflush(stderr);
+	s->prog_t = t;
+	s->prog_tcks = g_usb.tcks;
+}
+
+// JSON string with the escapes
+void json_str(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20) fprintf(fp, "\\u%04x", *s);
+		else fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+// the run report : timers, USB traffic and latency histograms, TCKs by
+// kind and totals by SVF command type
+int write_report(const char *path, const char *fname, TRANSPORT *tp, double elapsed)
+{
+	RUN_STAT *s = &g_stat;
+	FILE *fp = stdout;
+	int i, k, last;
+	int64_t total = 0;
+
+	if (strcmp(path, "-") && fopen_s(&fp, path, "w")) return 0;
+	fprintf(fp, "{\n  \"file\": ");
+	json_str(fp, fname);
+	fprintf(fp, ",\n  \"transport\": ");
+	json_str(fp, tp->name);
+	fprintf(fp, ",\n  \"engine\": \"%s\",\n", (g_engine == ENGINE_MPSSE) ? "mpsse" : "bitbang");
+	fprintf(fp, "  \"verify\": %s,\n", (g_mode == 1) ? "true" : "false");
+	if (g_mode == 1) fprintf(fp, "  \"tdo_mismatches\": %d,\n", g_usb.ver.no_match);
+	if (g_mode == 1 && g_engine == ENGINE_BITBANG) {
+		fprintf(fp, "  \"readback_skipped_bytes\": %.0f, \"mode_switches\": %ld,\n", (double)g_usb.rd_skipped, g_usb.mode_switches);
+	}
+	fprintf(fp, "  \"elapsed_sec\": %.6f,\n", elapsed);
+	fprintf(fp, "  \"parse_sec\": %.6f,\n", s->parse_sec);
+	fprintf(fp, "  \"encode_sec\": %.6f,\n", s->encode_sec - s->wait_sec);
+	fprintf(fp, "  \"usb_wait_sec\": %.6f,\n", g_usb.stall_parser);
+	fprintf(fp, "  \"io_idle_sec\": %.6f,\n", g_usb.stall_io);
+	fprintf(fp, "  \"usb\": {\n");
+	fprintf(fp, "    \"buffers\": %d, \"buffer_size\": %d, \"transfer_size\": %d, \"latency_ms\": %d,\n", g_usb.depth, g_usb.size, g_usb_xfer, g_latency);
+	fprintf(fp, "    \"bytes_written\": %.0f, \"bytes_read\": %.0f,\n", tp->bytes_written, tp->bytes_read);
+	fprintf(fp, "    \"write_calls\": %ld, \"read_calls\": %ld,\n", tp->write_calls, tp->read_calls);
+	fprintf(fp, "    \"write_sec\": %.6f, \"read_sec\": %.6f,\n", tp->write_sec, tp->read_sec);
+	for (k = 0; k < 2; k++) {
+		// bins up to the last used one, as [upper bound in usec, calls]
+		for (last = LAT_BINS - 1; last > 0 && !tp->lat_hist[k][last]; last--) ;
+		fprintf(fp, "    \"%s_latency_usec\": [", k ? "read" : "write");
+		for (i = 0; i <= last; i++) fprintf(fp, "%s[%d, %ld]", i ? ", " : "", (i == LAT_BINS - 1) ? -1 : 1 << i, tp->lat_hist[k][i]);
+		fprintf(fp, "]%s\n", k ? "" : ",");
+	}
+	fprintf(fp, "  },\n  \"tck\": {\n");
+	for (i = 0; i < NUM_TCK; i++) {
+		fprintf(fp, "    \"%s\": %.0f,\n", tck_name[i], (double)s->tck[i]);
+		total += s->tck[i];
+	}
+	fprintf(fp, "    \"total\": %.0f, \"last_hz\": %.0f\n  },\n", (double)total, g_tck_hz);
+	fprintf(fp, "  \"commands\": {\n");
+	for (i = 0; i < NUM_CMD; i++) {
+		fprintf(fp, "    \"%s\": {\"count\": %ld, \"tck\": %.0f, \"sec\": %.6f}%s\n", cmd_name[i], s->cmd[i].count, (double)s->cmd[i].tcks, s->cmd[i].sec, (i < NUM_CMD - 1) ? "," : "");
+	}
+	fprintf(fp, "  }\n}\n");
+	if (fp != stdout) fclose(fp);
+	return 1;
+}
+
+// ========== SVF optimizer ==========
+// the optimizer reads the SVF and writes it back without what doesn't change
+// the chain : STATE round trips through RESET / IDLE of a chain that is
+// already reset, RUNTESTs that can be added up, and SIRs that load the
+// instruction the IR already holds; ENDIR / ENDDR are written only when
+// they change. The output is plain SVF, so it can be kept and diffed.
+// write the scan (SMASK is left out : every TDI bit is given)
+void opt_scan(SVF_OPT *o, const char *cmd, SCAN_PARAM *sp)
+{
+	fprintf(o->fp, "%s %d", cmd, sp->bits);
+	if (sp->bits > 0) {
+		fprintf(o->fp, " TDI (");
+		bv_print(o->fp, &sp->tdi);
+		fprintf(o->fp, ")");
+		if (sp->tdo_valid) {
+			fprintf(o->fp, " TDO (");
+			bv_print(o->fp, &sp->tdo);
+			fprintf(o->fp, ") MASK (");
+			bv_print(o->fp, &sp->mask);
+			fprintf(o->fp, ")");
+		}
+	}
+	fprintf(o->fp, ";\n");
+}
+
+void opt_flush_runtest(SVF_OPT *o)
+{
+	RUNTEST_PARAM *rt = &o->rt;
+
+	if (!o->has_rt) return;
+	fprintf(o->fp, "RUNTEST %s", state_name[rt->run_state]);
+	if (rt->clks > 0 || rt->min_time <= 0) fprintf(o->fp, " %d TCK", rt->clks);
+	if (rt->min_time > 0) fprintf(o->fp, " %.9G SEC", rt->min_time);
+	if (rt->max_time > 0) fprintf(o->fp, " MAXIMUM %.9G SEC", rt->max_time);
+	fprintf(o->fp, " ENDSTATE %s;\n", state_name[rt->run_end]);
+	o->has_rt = 0;
+}
+
+// write the STATE path held back without the states the TAP is already in
+// and the round trips through RESET / IDLE of a chain that is already reset
+void opt_flush_state(SVF_OPT *o)
+{
+	int out[OPT_MAX_PATH], len[OPT_MAX_PATH];
+	int i, k, e, n = 0, s = o->state, clean = o->clean, anchor = -1, astate = -1;
+
+	if (!o->npath) return;
+	// anchor : out[] up to here left the chain reset in astate
+	if (clean && (s == TEST_LOGIC_RESET || s == RUN_TEST)) {
+		anchor = 0;
+		astate = s;
+	}
+	for (i = 0; i < o->npath; i++) {
+		e = o->path[i];
+		if (e == s) continue;
+		out[n] = e;
+		len[n++] = (s >= 0) ? tms_path[s][e].len : 0;
+		s = e;
+		if (e != TEST_LOGIC_RESET && e != RUN_TEST) {
+			clean = 0;
+			anchor = -1;
+		} else if (anchor >= 0 && e == astate) {
+			// back where the chain was already reset
+			for (k = anchor; k < n; k++) o->tcks_saved += len[k];
+			n = anchor;
+		} else if (e == TEST_LOGIC_RESET && anchor < 0) {
+			clean = 1;
+			anchor = n;
+			astate = e;
+		}
+	}
+	o->state_drop += o->npath - n;
+	o->npath = 0;
+	if (!n) return;
+	opt_flush_runtest(o);
+	fprintf(o->fp, "STATE");
+	for (i = 0; i < n; i++) {
+		fprintf(o->fp, " %s", state_name[out[i]]);
+		if (out[i] == TEST_LOGIC_RESET) o->ir_valid = 0;
+	}
+	fprintf(o->fp, ";\n");
+	o->state = s;
+	o->clean = clean;
+}
+
+// write what is held back
+void opt_flush(SVF_OPT *o)
+{
+	opt_flush_state(o);
+	opt_flush_runtest(o);
+}
+
+// RUNTEST : dropped if it does nothing, added to the one held back if both
+// wait in the same state for TCKs only (or time only)
+void opt_runtest(SVF_OPT *o, RUNTEST_PARAM *rt)
+{
+	RUNTEST_PARAM *p = &o->rt;
+
+	opt_flush_state(o);
+	if (rt->clks == 0 && rt->min_time <= 0 && rt->run_state == o->state && rt->run_end == o->state) {
+		o->rt_merge++;
+		return;
+	}
+	if (o->has_rt && p->run_end == p->run_state && rt->run_state == p->run_state &&
+		p->max_time <= 0 && rt->max_time <= 0 &&
+		((p->min_time <= 0 && rt->min_time <= 0) || (p->clks == 0 && rt->clks == 0)) &&
+		(double)p->clks + rt->clks <= 0x7fffffff) {
+		p->clks += rt->clks;
+		p->min_time += rt->min_time;
+		p->run_end = rt->run_end;
+		o->rt_merge++;
+	} else {
+		opt_flush_runtest(o);
+		o->rt = *rt;
+		o->has_rt = 1;
+	}
+	if (rt->run_state == TEST_LOGIC_RESET || rt->run_end == TEST_LOGIC_RESET) {
+		o->clean = 1;
+		o->ir_valid = 0;
+	} else if (rt->run_state != RUN_TEST || rt->run_end != RUN_TEST) o->clean = 0;
+	o->state = rt->run_end;
+}
+
+// SIR / SDR : an SIR without TDO that loads the IR with what it holds
+// (from IDLE back to IDLE) is dropped
+int opt_sir_sdr(SVF_OPT *o, SVF_PARSER *ps, int ir)
+{
+	SCAN_PARAM *sp = ir ? &ps->sir : &ps->sdr;
+	SCAN_PARAM *cur = &ps->scan;
+	int words;
+
+	opt_flush_state(o);
+	if (ir) {
+		if (!compose_scan(cur, &ps->hir, sp, 1, &ps->tir)) return 28;
+		words = BV_WORDS(cur->bits);
+		if (o->ir_valid && !cur->tdo_valid && o->state == RUN_TEST && o->end_ir == RUN_TEST &&
+			cur->bits == o->ir.bits && !memcmp(cur->tdi.w, o->ir.tdi.w, words * sizeof(uint64_t))) {
+			o->sir_drop++;
+			o->tcks_saved += tms_path[RUN_TEST][SHIFT_IR].len + cur->bits + tms_path[EXIT1_IR][RUN_TEST].len;
+			return 0;
+		}
+		if (!bv_resize(&o->ir.tdi, cur->bits)) return 28;
+		if (words) memcpy(o->ir.tdi.w, cur->tdi.w, words * sizeof(uint64_t));
+		o->ir.bits = cur->bits;
+		o->ir_valid = 1;
+	}
+	opt_flush_runtest(o);
+	if (ir && o->end_ir != o->w_end_ir) {
+		fprintf(o->fp, "ENDIR %s;\n", state_name[o->w_end_ir = o->end_ir]);
+		o->end_drop--;
+	}
+	if (!ir && o->end_dr != o->w_end_dr) {
+		fprintf(o->fp, "ENDDR %s;\n", state_name[o->w_end_dr = o->end_dr]);
+		o->end_drop--;
+	}
+	opt_scan(o, ir ? "SIR" : "SDR", sp);
+	o->state = ir ? o->end_ir : o->end_dr;
+	o->clean = 0;
+	if (o->state == TEST_LOGIC_RESET) o->ir_valid = 0;
+	return 0;
+}
+
+int optimize_svf(const char *fname, FILE *fp)
+{
+	SVF_PARSER ps;
+	SVF_OPT o;
+	RUNTEST_PARAM rt;
+	TOKEN keyw;
+	SCAN_PARAM *sp;
+	int n, semi, error_code = 0;
+
+	if (!svf_open(&ps, fname)) {
+		fprintf(stderr, "can't open %s\n", fname);
+		return 0;
+	}
+	if (is_xsvf(&ps)) {
+		fprintf(stderr, "%s is XSVF, the optimizer takes SVF\n", fname);
+		svf_close(&ps);
+		return 0;
+	}
+	memset(&o, 0, sizeof(o));
+	o.fp = fp;
+	// nothing is known of the chain the SVF starts with
+	o.state = -1;
+	o.end_ir = o.end_dr = o.w_end_ir = o.w_end_dr = RUN_TEST;
+	rt.run_state = rt.run_end = RUN_TEST;
+	while (!error_code && get_word(&ps, &keyw, &semi)) {
+		o.cmds++;
+		if (tok_is(&keyw, "STATE")) {
+			do {
+				if (!get_word(&ps, &keyw, &semi)) { error_code = 19; break; }
+				if (!state_of_string(&keyw, &n)) { error_code = 20; break; }
+				if (o.npath == OPT_MAX_PATH) opt_flush_state(&o);
+				o.path[o.npath++] = n;
 			} while (!semi);
-			if (v) printf("\n");
-		} else if (!strcmp(keyw, "ENDIR")) {
-			int n;
-			if (!get_word(fp, keyw2, &semi)) return 22;
-			if (v) printf("ENDIR %s\n", keyw2);
-			if (!state_of_string(keyw2, &n)) return 23;
-			end_ir = n;
-		} else if (!strcmp(keyw, "ENDDR")) {
-			int n;
-			if (!get_word(fp, keyw2, &semi)) return 24;
-			if (v) printf("ENDDR %s\n", keyw2);
-			if (!state_of_string(keyw2, &n)) return 25;
-			end_dr = n;
-		} else return 26;
+		} else if (tok_is(&keyw, "ENDIR") || tok_is(&keyw, "ENDDR")) {
+			int ir = tok_is(&keyw, "ENDIR");
+
+			if (!get_word(&ps, &keyw, &semi)) error_code = ir ? 22 : 24;
+			else if (!state_of_string(&keyw, &n)) error_code = ir ? 23 : 25;
+			else {
+				if (ir) o.end_ir = n;
+				else o.end_dr = n;
+				o.end_drop++;
+			}
+		} else if (tok_is(&keyw, "RUNTEST")) {
+			if (!(error_code = read_runtest(&ps, &rt))) opt_runtest(&o, &rt);
+		} else if (sir_sdr(&keyw)) {
+			int ir = tok_is(&keyw, "SIR");
+
+			if (!(error_code = read_scan(&ps, ir ? &ps.sir : &ps.sdr))) error_code = opt_sir_sdr(&o, &ps, ir);
+		} else if (tok_is(&keyw, "HIR") || tok_is(&keyw, "TIR") || tok_is(&keyw, "HDR") || tok_is(&keyw, "TDR")) {
+			char cmd[4];
+
+			sp = tok_is(&keyw, "HIR") ? &ps.hir : tok_is(&keyw, "TIR") ? &ps.tir : tok_is(&keyw, "HDR") ? &ps.hdr : &ps.tdr;
+			memcpy(cmd, keyw.str, 3);
+			cmd[3] = 0;
+			if (!(error_code = read_scan(&ps, sp))) {
+				opt_flush(&o);
+				opt_scan(&o, cmd, sp);
+			}
+		} else {
+			// FREQUENCY, TRST and the rest are written as they are; the
+			// chain may be reset by TRST
+			int freq = tok_is(&keyw, "FREQUENCY");
+
+			opt_flush(&o);
+			if (!freq) {
+				o.state = -1;
+				o.clean = o.ir_valid = 0;
+			}
+			fprintf(fp, "%.*s", keyw.len, keyw.str);
+			while (!semi && get_word(&ps, &keyw, &semi)) fprintf(fp, " %.*s", keyw.len, keyw.str);
+			fprintf(fp, ";\n");
+		}
+	}
+	opt_flush(&o);
+	if (ps.read_error) error_code = ps.read_error;
+	if (error_code) fprintf(stderr, "parse error(errorcode = %d, line = %d)\n", error_code, ps.line);
+	else {
+		long drop = o.sir_drop + o.state_drop + o.end_drop + o.rt_merge;
+
+		printf("   optimizer : %ld of %ld commands dropped (SIR %ld, STATE %ld, ENDIR/ENDDR %ld, RUNTEST merged %ld), %.0f TCK saved\n",
+			drop, o.cmds, o.sir_drop, o.state_drop, o.end_drop, o.rt_merge, o.tcks_saved);
+	}
+	free(o.ir.tdi.w);
+	svf_close(&ps);
+	return !error_code;
+}
+
+// ========== XSVF writer ==========
+// the SVF as XSVF for the XSVF player (and the embedded players of
+// XAPP503) : the header / trailer of the chain is composed into each
+// SIR / SDR, RUNTEST becomes XWAIT (its TCKs count as microseconds, or
+// the time if longer), XTDOMASK is written when the mask changes. TDO of
+// SIR and FREQUENCY have no XSVF command and are dropped.
+static void xw_int(FILE *fp, uint32_t x, int n)
+{
+	while (n-- > 0) fputc((x >> (n * 8)) & 0xff, fp);
+}
+
+static void xw_vec(FILE *fp, BITVEC *bv, int bits)
+{
+	int i;
+
+	for (i = ((bits + 7) >> 3) - 1; i >= 0; i--) fputc((bv->w[i >> 3] >> ((i & 7) * 8)) & 0xff, fp);
+}
+
+int write_xsvf(const char *fname, FILE *fp, int repeat)
+{
+	SVF_PARSER ps;
+	RUNTEST_PARAM rt;
+	TOKEN keyw;
+	SCAN_PARAM *sp, *out;
+	BITVEC wmask = {0}, zero = {0}, *mask;	// XTDOMASK written, all 0
+	int n, semi, error_code = 0, sdr_bits = -1;
+	long cmds = 0, ir_tdo = 0, freq = 0;
+	double usec;
+
+	if (!svf_open(&ps, fname)) {
+		fprintf(stderr, "can't open %s\n", fname);
+		return 0;
+	}
+	if (is_xsvf(&ps)) {
+		fprintf(stderr, "%s is XSVF already\n", fname);
+		svf_close(&ps);
+		return 0;
+	}
+	fputc(XREPEAT, fp);
+	xw_int(fp, repeat, 1);
+	fputc(XRUNTEST, fp);
+	xw_int(fp, 0, 4);
+	rt.run_state = rt.run_end = RUN_TEST;
+	while (!error_code && get_word(&ps, &keyw, &semi)) {
+		cmds++;
+		if (is_ignore(&keyw) || tok_is(&keyw, "FREQUENCY")) {
+			if (tok_is(&keyw, "FREQUENCY")) freq++;
+			while (!semi && get_word(&ps, &keyw, &semi)) ;
+		} else if (tok_is(&keyw, "STATE")) {
+			do {
+				if (!get_word(&ps, &keyw, &semi)) { error_code = 19; break; }
+				if (!state_of_string(&keyw, &n)) { error_code = 20; break; }
+				fputc(XSTATE, fp);
+				fputc(n, fp);
+			} while (!semi);
+		} else if (tok_is(&keyw, "ENDIR") || tok_is(&keyw, "ENDDR")) {
+			int ir = tok_is(&keyw, "ENDIR");
+
+			if (!get_word(&ps, &keyw, &semi)) error_code = ir ? 22 : 24;
+			else if (!state_of_string(&keyw, &n)) error_code = ir ? 23 : 25;
+			else if (n != RUN_TEST && n != (ir ? PAUSE_IR : PAUSE_DR)) error_code = 33;
+			else {
+				fputc(ir ? XENDIR : XENDDR, fp);
+				fputc(n != RUN_TEST, fp);
+			}
+		} else if (tok_is(&keyw, "RUNTEST")) {
+			if ((error_code = read_runtest(&ps, &rt))) break;
+			usec = rt.min_time * 1e6 + 0.999;
+			if (usec < rt.clks) usec = rt.clks;
+			fputc(XWAIT, fp);
+			fputc(rt.run_state, fp);
+			fputc(rt.run_end, fp);
+			xw_int(fp, usec > 0xffffffffu ? 0xffffffffu : (uint32_t)usec, 4);
+		} else if (sir_sdr(&keyw)) {
+			int ir = tok_is(&keyw, "SIR");
+			SCAN_PARAM *hd = ir ? &ps.hir : &ps.hdr, *tl = ir ? &ps.tir : &ps.tdr;
+
+			sp = ir ? &ps.sir : &ps.sdr;
+			if ((error_code = read_scan(&ps, sp))) break;
+			out = sp;
+			if (hd->bits || tl->bits) {
+				if (!compose_scan(&ps.scan, hd, sp, 1, tl)) { error_code = 28; break; }
+				out = &ps.scan;
+			}
+			if (ir) {
+				if (out->bits > 0xffff) { error_code = 33; break; }
+				if (out->tdo_valid && bv_any(&out->mask)) ir_tdo++;
+				fputc(out->bits > 0xff ? XSIR2 : XSIR, fp);
+				xw_int(fp, out->bits, out->bits > 0xff ? 2 : 1);
+				xw_vec(fp, &out->tdi, out->bits);
+				continue;
+			}
+			if (out->bits != sdr_bits) {
+				fputc(XSDRSIZE, fp);
+				xw_int(fp, out->bits, 4);
+				sdr_bits = out->bits;
+				wmask.bits = -1;
+			}
+			// no TDO : XSDR with the mask all 0 (MASK of the SVF is kept)
+			mask = &out->mask;
+			if (!out->tdo_valid) {
+				if (!bv_resize(&zero, out->bits)) { error_code = 28; break; }
+				bv_fill(&zero, 0);
+				mask = &zero;
+			}
+			if (wmask.bits != out->bits || memcmp(wmask.w, mask->w, BV_WORDS(out->bits) * sizeof(uint64_t))) {
+				if (!bv_resize(&wmask, out->bits)) { error_code = 28; break; }
+				if (out->bits) memcpy(wmask.w, mask->w, BV_WORDS(out->bits) * sizeof(uint64_t));
+				fputc(XTDOMASK, fp);
+				xw_vec(fp, mask, out->bits);
+			}
+			if (out->tdo_valid && bv_any(&out->mask)) {
+				fputc(XSDRTDO, fp);
+				xw_vec(fp, &out->tdi, out->bits);
+				xw_vec(fp, &out->tdo, out->bits);
+			} else {
+				fputc(XSDR, fp);
+				xw_vec(fp, &out->tdi, out->bits);
+			}
+		} else if (tok_is(&keyw, "HIR") || tok_is(&keyw, "TIR") || tok_is(&keyw, "HDR") || tok_is(&keyw, "TDR")) {
+			sp = tok_is(&keyw, "HIR") ? &ps.hir : tok_is(&keyw, "TIR") ? &ps.tir : tok_is(&keyw, "HDR") ? &ps.hdr : &ps.tdr;
+			error_code = read_scan(&ps, sp);
+		} else error_code = 26;
+	}
+	fputc(XCOMPLETE, fp);
+	if (ps.read_error) error_code = ps.read_error;
+	if (error_code) fprintf(stderr, "parse error(errorcode = %d, line = %d)\n", error_code, ps.line);
+	else {
+		printf("   XSVF : %ld commands, %.0f bytes of SVF into %ld bytes\n", cmds, ps.consumed + ps.len, ftell(fp));
+		if (ir_tdo) printf("   (TDO of %ld SIR dropped, XSVF doesn't compare the IR)\n", ir_tdo);
+		if (freq) printf("   (%ld FREQUENCY dropped, limit TCK with -freq)\n", freq);
+	}
+	free(wmask.w);
+	free(zero.w);
+	svf_close(&ps);
+	return !error_code;
+}
+
+// ========== benchmark ==========
+static const char *gen_kinds[] = {"rows", "sir", "runtest", "verify"};
+
+// n random hex digits, a line break every wrap digits (0 : none)
+void gen_hex(FILE *fp, uint64_t *x, int n, int wrap)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if ((i & 15) == 0) {
+			*x ^= *x << 13; *x ^= *x >> 7; *x ^= *x << 17;
+		}
+		fputc(hex[(*x >> ((i & 15) * 4)) & 15], fp);
+		if (wrap && i + 1 < n && (i + 1) % wrap == 0) fputc('\n', fp);
+	}
+}
+
+// write a synthetic SVF of about size bytes (the same bytes every time) :
+//   rows    : long SDR programming rows, each followed by a RUNTEST
+//   sir     : many short SIRs with an occasional SDR
+//   runtest : long RUNTEST waits (clocked, not slept)
+//   verify  : SDR writes read back with TDO and MASK, hex wrapped in lines
+int gen_svf(const char *fname, const char *kind, double size)
+{
+	FILE *fp;
+	uint64_t x = 88172645463325252ULL, y;
+	int k, i = 0;
+
+	for (k = 0; k < 4 && strcmp(kind, gen_kinds[k]); k++) ;
+	if (k == 4 || fopen_s(&fp, fname, "w")) return 0;
+	fprintf(fp, "// prog_cpld benchmark : %s\nTRST OFF;\nENDIR IDLE;\nENDDR IDLE;\nSTATE RESET;\nSTATE IDLE;\nSIR 8 TDI (e8);\n", kind);
+	while (ftell(fp) < size) {
+		switch (k) {
+		case 0:
+			fprintf(fp, "SDR 2048 TDI (");
+			gen_hex(fp, &x, 512, 0);
+			fprintf(fp, ") SMASK (");
+			for (i = 0; i < 512; i++) fputc('f', fp);
+			fprintf(fp, ");\nRUNTEST 100 TCK;\n");
+			break;
+		case 1:
+			fprintf(fp, "SIR 8 TDI (");
+			gen_hex(fp, &x, 2, 0);
+			fprintf(fp, ");\n");
+			if ((++i & 15) == 0) {
+				fprintf(fp, "SDR 32 TDI (");
+				gen_hex(fp, &x, 8, 0);
+				fprintf(fp, ");\n");
+			}
+			break;
+		case 2:
+			fprintf(fp, "SDR 32 TDI (");
+			gen_hex(fp, &x, 8, 0);
+			fprintf(fp, ");\nRUNTEST IDLE 50000 TCK ENDSTATE IDLE;\n");
+			break;
+		case 3:
+			// the simulated CPLD reads back what was written
+			fprintf(fp, "SDR 1024 TDI (");
+			y = x;
+			gen_hex(fp, &x, 256, 64);
+			fprintf(fp, ");\nSDR 1024 TDI (");
+			for (i = 0; i < 256; i++) fputc('0', fp);
+			fprintf(fp, ")\n\tTDO (");
+			gen_hex(fp, &y, 256, 64);
+			fprintf(fp, ")\n\tMASK (");
+			for (i = 0; i < 256; i++) fputc('f', fp);
+			fprintf(fp, ");\n");
+			break;
+		}
+	}
+	fclose(fp);
+	return 1;
+}
+
+// peak resident set size of the process in KB
+long peak_rss_kb(void)
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0;
+	return (long)(pmc.PeakWorkingSetSize / 1024);
+#else
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru)) return 0;
+#ifdef __APPLE__
+	return (long)(ru.ru_maxrss / 1024);
+#else
+	return (long)ru.ru_maxrss;
+#endif
+#endif
+}
+
+// one pass over the SVF : 0 tokenize only, 1 parse and encode without
+// a transport, 2 the whole pipeline to the null transport (I/O thread,
+// no read back), 3 the whole pipeline to the simulator with the TDO
+// compare; returns the seconds (-1 on error or mismatch) and the TCKs
+double bench_pass(const char *fname, int pass, int64_t *tcks)
+{
+	SVF_PARSER ps;
+	TRANSPORT *tp = NULL;
+	TOKEN t;
+	int semi, state, ok = 0;
+	double start;
+
+	*tcks = 0;
+	if (!svf_open(&ps, fname)) return -1;
+	start = now_sec();
+	if (pass == 0) {
+		while (get_word(&ps, &t, &semi)) ;
+		ok = 1;
+	} else {
+		if (pass == 2) tp = null_transport();
+		if (pass == 3) tp = sim_transport((g_engine == ENGINE_MPSSE) ? DEV_FT232H : DEV_FT232R);
+		if (pass >= 2 && (!tp || !tp->open(tp))) goto END;
+		g_mode = (pass == 3);
+		if (usb_open(tp, USB_QDEPTH, USB_BUFSIZE, pass >= 2)) {
+			g_usb.dry = (pass == 1);
+			ok = engine_init(tp) && reset_tap(tp, &state) && !parse_svf(&ps, tp, 0, &state) && usb_flush(tp, 1);
+			ok = ok && !g_usb.ver.no_match;
+			*tcks = g_usb.tcks;
+		}
+		usb_close();
+	}
+END:
+	start = now_sec() - start;
+	if (tp) {
+		tp->close(tp);
+		free(tp);
+	}
+	svf_close(&ps);
+	return ok ? start : -1;
+}
+
+// generate each kind of SVF and time the passes over it; one line per
+// kind and pass in a fixed format to be compared across builds
+int bench_svf(double size)
+{
+	static const char *pass_name[] = {"parse", "encode", "full", "verify"};
+	const char *fname = "prog_cpld_bench.svf";
+	int k, pass, mode = g_mode;
+	int64_t tcks;
+	double sec, mb;
+
+	if (g_engine == ENGINE_AUTO) g_engine = ENGINE_BITBANG;
+	printf("# prog_cpld bench 1 : engine %s, %.0f bytes per SVF\n", (g_engine == ENGINE_MPSSE) ? "mpsse" : "bitbang", size);
+	printf("%-8s %-7s %9s %9s %9s %14s %12s\n", "kind", "pass", "MB", "sec", "MB/s", "TCK/s", "peak_rss_kb");
+	for (k = 0; k < 4; k++) {
+		if (!gen_svf(fname, gen_kinds[k], size)) {
+			fprintf(stderr, "can't write %s\n", fname);
+			return 0;
+		}
+		// the simulator only keeps up with the verify SVF
+		for (pass = 0; pass < ((k == 3) ? 4 : 3); pass++) {
+			SVF_PARSER ps;
+
+			if (!svf_open(&ps, fname)) return 0;
+			mb = ps.size / 1e6;
+			svf_close(&ps);
+			sec = bench_pass(fname, pass, &tcks);
+			if (sec < 0) {
+				printf("%-8s %-7s failed\n", gen_kinds[k], pass_name[pass]);
+				continue;
+			}
+			if (sec <= 0) sec = 1e-9;
+			printf("%-8s %-7s %9.2f %9.3f %9.2f %14.0f %12ld\n", gen_kinds[k], pass_name[pass], mb, sec, mb / sec, tcks / sec, peak_rss_kb());
+		}
+	}
+	remove(fname);
+	g_mode = mode;
+	return 1;
+}
+
+// bytes of "16M" / "512K" / "1000"
+double size_of_arg(const char *s)
+{
+	char *e;
+	double x = strtod(s, &e);
+
+	if (*e == 'k' || *e == 'K') x *= 1024;
+	if (*e == 'm' || *e == 'M') x *= 1024 * 1024;
+	if (*e == 'g' || *e == 'G') x *= 1024.0 * 1024 * 1024;
+	return x;
+}
+
+// ========== multiple adapters ==========
+// append a USB write (or a sleep, or a TCK divisor) to the command stream
+// append an empty chunk (no sleep, divisor or mode change)
+CHUNK *stream_chunk(CMD_STREAM *cs)
+{
+	CHUNK *c;
+
+	if (cs->nchunk == cs->ccap) {
+		int ccap = (cs->ccap ? cs->ccap * 2 : 1024);
+
+		if (!(c = (CHUNK *)realloc(cs->chunk, ccap * sizeof(CHUNK)))) return NULL;
+		cs->chunk = c;
+		cs->ccap = ccap;
+	}
+	c = &cs->chunk[cs->nchunk++];
+	memset(c, 0, sizeof(CHUNK));
+	c->div = c->mode = -1;
+	return c;
+}
+
+int stream_add(CMD_STREAM *cs, unsigned char *data, int len, int rlength, double sleep, int div, int mode)
+{
+	CHUNK *c;
+
+	if (len == 0 && sleep <= 0 && div < 0 && mode < 0) return 1;
+	if (cs->len + len > cs->cap) {
+		int64_t cap = (cs->cap ? cs->cap : 1 << 20);
+		unsigned char *p;
+
+		while (cap < cs->len + len) cap *= 2;
+		if (!(p = (unsigned char *)realloc(cs->data, (size_t)cap))) return 0;
+		cs->data = p;
+		cs->cap = cap;
+	}
+	if (!(c = stream_chunk(cs))) return 0;
+	c->ofs = cs->len;
+	c->length = len;
+	c->rlength = rlength;
+	c->sleep = sleep;
+	c->div = div;
+	c->mode = mode;
+	if (len > 0) memcpy(cs->data + cs->len, data, len);
+	cs->len += len;
+	if (rlength > cs->max_rlength) cs->max_rlength = rlength;
+	return 1;
+}
+
+// encode the whole SVF for the engine; returns the parse_svf error code
+// (-1 if out of memory)
+int stream_record(SVF_PARSER *ps, CMD_STREAM *cs, int engine, int v)
+{
+	int current_state, error_code = -1;
+
+	memset(cs, 0, sizeof(CMD_STREAM));
+	cs->engine = g_engine = engine;
+	if (!usb_open(NULL, 2, USB_BUFSIZE, 0)) goto END;
+	g_usb.record = cs;
+	if (!engine_init(NULL) || !reset_tap(NULL, &current_state)) goto END;
+	error_code = parse_svf(ps, NULL, v, &current_state);
+	if (!error_code && !usb_flush(NULL, 1)) error_code = -1;
+END:
+	cs->vhead = g_usb.ver.head;
+	g_usb.ver.head = g_usb.ver.tail = NULL;
+	usb_close();
+	return error_code;
+}
+
+// write the chunks, reading back the previous one while the next is on
+// its way, and compare TDO
+int stream_replay(TRANSPORT *tp, CMD_STREAM *cs, VERIFIER *vf)
+{
+	unsigned char *result = (unsigned char *)malloc(cs->max_rlength + 1);
+	CHUNK *c, *prev = NULL;
+	int i, ok = (result != NULL);
+
+	for (i = 0; ok && i <= cs->nchunk; i++) {
+		c = (i < cs->nchunk) ? &cs->chunk[i] : NULL;
+		if (c && c->length > 0) ok = tp_write(tp, cs->data + c->ofs, c->length);
+		if (ok && prev && prev->rlength > 0) {
+			ok = tp_read(tp, result, prev->rlength) && verify_feed(vf, result, prev->rlength);
+		}
+		prev = c;
+		if (ok && c && c->sleep > 0) sleep_sec(c->sleep);
+		if (ok && c && c->div >= 0) ok = tp->set_divisor(tp, c->div);
+		if (ok && c && c->mode >= 0) ok = tp->set_bit_mode(tp, g_bb_mask, c->mode);
+	}
+	free(result);
+	return ok;
+}
+
+// a stream loaded from a file is replayed as it is : every chunk has to
+// be inside the data and the read buffer, every TDO compare inside the
+// read back bytes and after the one before
+int stream_check(CMD_STREAM *cs)
+{
+	int64_t rd_len = 0, rd_end = 0;
+	CHUNK *c;
+	VREC *r;
+	int i, ofs, bit;
+
+	if (cs->max_rlength < 0) return 0;
+	for (i = 0; i < cs->nchunk; i++) {
+		c = &cs->chunk[i];
+		if (c->ofs < 0 || c->length < 0 || c->ofs > cs->len - c->length) return 0;
+		if (c->rlength < 0 || c->rlength > cs->max_rlength) return 0;
+		rd_len += c->rlength;
+	}
+	for (r = cs->vhead; r; r = r->next) {
+		if (r->engine != cs->engine || r->bits <= 0 || r->bits > INT_MAX / 2 || r->rd_start < rd_end) return 0;
+		if (r->units < 0 || r->units > MAX_CHAIN || (r->units > 1 && r->unit <= 0)) return 0;
+		vrec_pos(r, r->bits - 1, &ofs, &bit);
+		rd_end = r->rd_start + ofs + 1;
+		if (rd_end > rd_len) return 0;
+	}
+	return 1;
+}
+
+void stream_free(CMD_STREAM *cs)
+{
+	if (cs->map.buf) unmap_file(&cs->map);
+	else free(cs->data);
+	free(cs->chunk);
+	vrec_free(cs->vhead);
+	memset(cs, 0, sizeof(CMD_STREAM));
+}
+
+// ========== compiled SVF cache ==========
+int map_file(MAPPED_FILE *mf, const char *fname)
+{
+	memset(mf, 0, sizeof(MAPPED_FILE));
+#ifdef _WIN32
+	{
+		LARGE_INTEGER size;
+
+		mf->hfile = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (mf->hfile == INVALID_HANDLE_VALUE) return 0;
+		if (GetFileSizeEx(mf->hfile, &size) && size.QuadPart > 0) {
+			mf->hmap = CreateFileMappingA(mf->hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mf->hmap) mf->buf = (const unsigned char *)MapViewOfFile(mf->hmap, FILE_MAP_READ, 0, 0, 0);
+			if (mf->buf) {
+				mf->len = (size_t)size.QuadPart;
+				return 1;
+			}
+			if (mf->hmap) CloseHandle(mf->hmap);
+		}
+		CloseHandle(mf->hfile);
+		memset(mf, 0, sizeof(MAPPED_FILE));
+		return 0;
+	}
+#else
+	{
+		struct stat st;
+		void *p;
+		int fd = open(fname, O_RDONLY);
+
+		if (fd < 0) return 0;
+		if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+			p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				close(fd);
+				mf->buf = (const unsigned char *)p;
+				mf->len = st.st_size;
+				return 1;
+			}
+		}
+		close(fd);
+		return 0;
+	}
+#endif
+}
+
+void unmap_file(MAPPED_FILE *mf)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(mf->buf);
+	CloseHandle(mf->hmap);
+	CloseHandle(mf->hfile);
+#else
+	munmap((void *)mf->buf, mf->len);
+#endif
+	memset(mf, 0, sizeof(MAPPED_FILE));
+}
+
+uint64_t fnv1a(uint64_t h, const unsigned char *p, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) h = (h ^ p[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+// the settings the command stream depends on
+void cache_key(CACHE_HEADER *h, uint64_t svf_hash, double svf_size, int engine)
+{
+	memset(h, 0, sizeof(CACHE_HEADER));
+	memcpy(h->magic, CACHE_MAGIC, 8);
+	h->svf_hash = svf_hash;
+	h->svf_size = svf_size;
+	h->tck_max = g_tck_max;
+	h->engine = engine;
+	h->mode = g_mode;
+	h->broadcast = g_broadcast;
+	h->fullsync = g_fullsync;
+}
+
+// the cache file of the key : the SVF hash and the settings hashed again
+void cache_name(char *name, size_t size, CACHE_HEADER *key)
+{
+	uint64_t h = fnv1a(0xcbf29ce484222325ULL, (const unsigned char *)key, sizeof(CACHE_HEADER));
+
+	snprintf(name, size, "%s/%016llx.svfc", g_cache_dir, (unsigned long long)h);
+}
+
+// load the stream of key from the mapped cache file; the data stays in the
+// mapping, the chunks and the TDO compares are copied
+int cache_load(CMD_STREAM *cs, const char *name, CACHE_HEADER *key)
+{
+	const unsigned char *p, *end;
+	CACHE_HEADER h;
+	CACHE_VREC cv;
+	VREC *r, *tail = NULL;
+	int i, words;
+
+	memset(cs, 0, sizeof(CMD_STREAM));
+	if (!map_file(&cs->map, name)) return 0;
+	p = cs->map.buf;
+	end = p + cs->map.len;
+	if (cs->map.len < sizeof(CACHE_HEADER)) goto ERROR;
+	memcpy(&h, p, sizeof(CACHE_HEADER));
+	p += sizeof(CACHE_HEADER);
+	if (memcmp(h.magic, key->magic, 8) || h.svf_hash != key->svf_hash || h.svf_size != key->svf_size ||
+		h.tck_max != key->tck_max || h.engine != key->engine || h.mode != key->mode || h.broadcast != key->broadcast ||
+		h.fullsync != key->fullsync) goto ERROR;
+	if (h.data_len < 0 || h.data_len > (int64_t)(end - p) || h.nchunk < 0 || h.nvrec < 0) goto ERROR;
+	if ((int64_t)(end - p) < ((h.data_len + 7) & ~7) + (int64_t)h.nchunk * (int64_t)sizeof(CHUNK)) goto ERROR;
+	cs->engine = h.engine;
+	cs->data = (unsigned char *)p;
+	cs->len = h.data_len;
+	cs->max_rlength = h.max_rlength;
+	p += (h.data_len + 7) & ~7;
+	if (h.nchunk > 0) {
+		if (!(cs->chunk = (CHUNK *)malloc(h.nchunk * sizeof(CHUNK)))) goto ERROR;
+		memcpy(cs->chunk, p, h.nchunk * sizeof(CHUNK));
+		cs->nchunk = cs->ccap = h.nchunk;
+		p += h.nchunk * sizeof(CHUNK);
+	}
+	for (i = 0; i < h.nvrec; i++) {
+		if ((size_t)(end - p) < sizeof(CACHE_VREC)) goto ERROR;
+		memcpy(&cv, p, sizeof(CACHE_VREC));
+		p += sizeof(CACHE_VREC);
+		words = BV_WORDS(cv.bits);
+		if (cv.bits <= 0 || (size_t)(end - p) < words * 2 * sizeof(uint64_t)) goto ERROR;
+		if (!(r = (VREC *)calloc(1, sizeof(VREC)))) goto ERROR;
+		if (tail) tail->next = r;
+		else cs->vhead = r;
+		tail = r;
+		if (!bv_resize(&r->tdo, cv.bits) || !bv_resize(&r->mask, cv.bits)) goto ERROR;
+		memcpy(r->tdo.w, p, words * sizeof(uint64_t));
+		p += words * sizeof(uint64_t);
+		memcpy(r->mask.w, p, words * sizeof(uint64_t));
+		p += words * sizeof(uint64_t);
+		r->bits = cv.bits;
+		r->rd_start = cv.rd_start;
+		r->engine = cv.engine;
+		r->line = cv.line;
+		r->ir = cv.ir;
+		r->hbits = cv.hbits;
+		r->unit = cv.unit;
+		r->units = cv.units;
+	}
+	if (!stream_check(cs)) goto ERROR;
+	return 1;
+ERROR:
+	stream_free(cs);
+	return 0;
+}
+
+// write the stream to a temporary file and rename it into the cache, so
+// another run never maps a partly written file
+int cache_store(CMD_STREAM *cs, const char *name, CACHE_HEADER *key)
+{
+	static const unsigned char pad[8] = {0};
+	char tmp[1100];
+	FILE *fp;
+	CACHE_HEADER h = *key;
+	CACHE_VREC cv;
+	VREC *r;
+	int ok, words;
+
+	h.nchunk = cs->nchunk;
+	h.data_len = cs->len;
+	h.max_rlength = cs->max_rlength;
+	for (r = cs->vhead; r; r = r->next) h.nvrec++;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+	if (fopen_s(&fp, tmp, "wb")) return 0;
+	ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+	if (ok && cs->len > 0) ok = fwrite(cs->data, (size_t)cs->len, 1, fp) == 1;
+	if (ok && (cs->len & 7)) ok = fwrite(pad, 8 - (cs->len & 7), 1, fp) == 1;
+	if (ok && cs->nchunk > 0) ok = fwrite(cs->chunk, sizeof(CHUNK), cs->nchunk, fp) == (size_t)cs->nchunk;
+	for (r = cs->vhead; ok && r; r = r->next) {
+		memset(&cv, 0, sizeof(cv));
+		cv.rd_start = r->rd_start;
+		cv.bits = r->bits;
+		cv.engine = r->engine;
+		cv.line = r->line;
+		cv.ir = r->ir;
+		cv.hbits = r->hbits;
+		cv.unit = r->unit;
+		cv.units = r->units;
+		words = BV_WORDS(r->bits);
+		ok = fwrite(&cv, sizeof(cv), 1, fp) == 1 &&
+			fwrite(r->tdo.w, sizeof(uint64_t), words, fp) == (size_t)words &&
+			fwrite(r->mask.w, sizeof(uint64_t), words, fp) == (size_t)words;
+	}
+	if (fclose(fp)) ok = 0;
+#ifdef _WIN32
+	if (ok) remove(name);
+#endif
+	if (!ok || rename(tmp, name)) {
+		remove(tmp);
+		return 0;
+	}
+	return 1;
+}
+
+// the command stream of the SVF for the engine : mapped from the cache if
+// it was compiled before with the same settings, else recorded and stored
+int stream_compile(const char *fname, CMD_STREAM *cs, int engine, int v, int *line)
+{
+	SVF_PARSER ps;
+	MAPPED_FILE mf;
+	CACHE_HEADER key;
+	char name[1024];
+	int error_code, cached = 0;
+
+	*line = 0;
+	if (g_cache_dir && strcmp(fname, "-") && map_file(&mf, fname)) {
+		cache_key(&key, fnv1a(0xcbf29ce484222325ULL, mf.buf, mf.len), (double)mf.len, engine);
+		unmap_file(&mf);
+		cache_name(name, sizeof(name), &key);
+		if (cache_load(cs, name, &key)) {
+			g_engine = engine;
+			return 0;
+		}
+		cached = 1;
+	}
+	if (!svf_open(&ps, fname)) return -2;
+	error_code = stream_record(&ps, cs, engine, v);
+	*line = ps.line;
+	svf_close(&ps);
+	if (!error_code && cached && !cache_store(cs, name, &key)) fprintf(stderr, "can't write the cache %s\n", name);
+	return error_code;
+}
+
+// ========== skip if identical ==========
+// the IDCODE after Test-Logic-Reset, then (of Xilinx parts, with the
+// USERCODE instruction in every device of -broadcast) the USERCODE;
+// 0xffffffff if there is none
+int read_ids(TRANSPORT *tp, uint32_t *idcode, uint32_t *usercode)
+{
+	USB_QUEUE *q = &g_usb;
+	BITVEC ir = {0}, zero = {0}, got = {0};
+	int i, state, ok = 0, max_report = g_max_report;
+
+	*idcode = *usercode = 0xffffffff;
+	if (!bv_resize(&ir, USERCODE_IR_LEN * g_broadcast) || !bv_resize(&zero, 64) || !bv_resize(&got, 64)) goto END;
+	memset(ir.w, 0, BV_WORDS(ir.bits) * sizeof(uint64_t));
+	for (i = 0; i < ir.bits; i++) {
+		ir.w[i >> 6] |= (uint64_t)((USERCODE_INST >> (i % USERCODE_IR_LEN)) & 1) << (i & 63);
+	}
+	zero.w[0] = 0;
+	// the scans compare against a zero MASK and keep a copy of TDO
+	g_max_report = 0;
+	q->ver.capture = &got;
+	if (!reset_tap(tp, &state) || !transit(tp, &state, SHIFT_DR, 0)) goto END;
+	if (!outData(tp, 32, &zero, &zero, &zero)) goto END;
+	state = EXIT1_DR;
+	if (!transit(tp, &state, RUN_TEST, 0) || !usb_flush(tp, 1)) goto END;
+	*idcode = (uint32_t)got.w[0];
+	if ((*idcode & 0xfff) == XILINX_IDCODE_MFG) {
+		if (!transit(tp, &state, SHIFT_IR, 0) || !outData(tp, ir.bits, &ir, NULL, NULL)) goto END;
+		state = EXIT1_IR;
+		if (!transit(tp, &state, SHIFT_DR, 0) || !outData(tp, 32, &zero, &zero, &zero)) goto END;
+		state = EXIT1_DR;
+		if (!transit(tp, &state, RUN_TEST, 0) || !usb_flush(tp, 1)) goto END;
+		*usercode = (uint32_t)got.w[0];
+	}
+	ok = 1;
+END:
+	q->ver.capture = NULL;
+	g_max_report = max_report;
+	free(ir.w);
+	free(zero.w);
+	free(got.w);
+	return ok;
+}
+
+// the digest file of a record
+void done_name(char *name, size_t size, DONE_REC *rec)
+{
+	uint64_t h = fnv1a(0xcbf29ce484222325ULL, (const unsigned char *)&rec->svf_hash, sizeof(rec->svf_hash));
+
+	h = fnv1a(h, (const unsigned char *)&rec->verify_hash, sizeof(rec->verify_hash));
+	h = fnv1a(h, (const unsigned char *)&rec->idcode, sizeof(rec->idcode));
+	h = fnv1a(h, (const unsigned char *)rec->adapter, strlen(rec->adapter));
+	snprintf(name, size, "%s/%016llx.done", g_cache_dir, (unsigned long long)h);
+}
+
+int done_store(DONE_REC *rec)
+{
+	char name[1024];
+	FILE *fp;
+	int ok;
+
+	if (!g_cache_dir) return 1;
+	done_name(name, sizeof(name), rec);
+	if (fopen_s(&fp, name, "wb")) return 0;
+	ok = fwrite(rec, sizeof(DONE_REC), 1, fp) == 1;
+	if (fclose(fp)) ok = 0;
+	return ok;
+}
+
+// the device holds the design if the digest of this adapter, IDCODE,
+// USERCODE, SVF and verify SVF is in the cache directory (only with a USERCODE set
+// by the design : a blank part of the same type reads the same IDCODE),
+// or if every TDO of the verify SVF matches (and it compares any, a
+// program only SVF or one masking every bit can't tell); the mismatches
+// of the verify SVF aren't listed, it runs in synchronous mode and leaves the engine
+// initialized for programming
+int skip_check(TRANSPORT *tp, const char *fname, const char *verify, int v, DONE_REC *rec)
+{
+	USB_QUEUE *q = &g_usb;
+	SVF_PARSER ps;
+	MAPPED_FILE mf;
+	DONE_REC old;
+	char name[1024];
+	FILE *fp;
+	int state, error_code, mode = g_mode, max_report = g_max_report, r = -1;
+	double start = now_sec();
+
+	memset(rec, 0, sizeof(DONE_REC));
+	memcpy(rec->magic, DONE_MAGIC, 8);
+	if (!map_file(&mf, fname)) {
+		fprintf(stderr, "can't open %s\n", fname);
+		return -1;
+	}
+	rec->svf_hash = fnv1a(0xcbf29ce484222325ULL, mf.buf, mf.len);
+	rec->svf_size = (double)mf.len;
+	unmap_file(&mf);
+	// the verify SVF is keyed too : a digest from another verify SVF
+	// says nothing of this one
+	if (!map_file(&mf, verify)) {
+		fprintf(stderr, "can't open %s\n", verify);
+		return -1;
+	}
+	rec->verify_hash = fnv1a(0xcbf29ce484222325ULL, mf.buf, mf.len);
+	rec->verify_size = (double)mf.len;
+	unmap_file(&mf);
+	snprintf(rec->adapter, sizeof(rec->adapter), "%s", tp->id[0] ? tp->id : tp->name);
+	g_mode = 1;
+	if (!engine_mode(tp, g_engine)) goto USB;
+	g_usb.sync = (g_engine == ENGINE_BITBANG);
+	if (!read_ids(tp, &rec->idcode, &rec->usercode)) goto USB;
+	printf("   IDCODE %08x, USERCODE %08x\n", rec->idcode, rec->usercode);
+	if (g_cache_dir && rec->usercode != 0xffffffff && rec->usercode != 0) {
+		done_name(name, sizeof(name), rec);
+		if (!fopen_s(&fp, name, "rb")) {
+			r = (fread(&old, sizeof(old), 1, fp) == 1 && !memcmp(&old, rec, sizeof(DONE_REC)));
+			fclose(fp);
+			if (r == 1) {
+				printf("   the device was verified with %s before (%.3f sec)\n", verify, now_sec() - start);
+				goto END;
+			}
+		}
+	}
+	if (!svf_open(&ps, verify)) {
+		fprintf(stderr, "can't open %s\n", verify);
+		r = -1;
+		goto END;
+	}
+	g_max_report = 0;
+	q->ver.compared = 0;
+	if (!reset_tap(tp, &state)) error_code = -1;
+	else error_code = parse_svf(&ps, tp, v, &state);
+	if (error_code) fprintf(stderr, "%s : parse error(errorcode = %d, line = %d)\n", verify, error_code, ps.line);
+	svf_close(&ps);
+	if (!usb_flush(tp, 1)) goto USB;
+	if (error_code) {
+		r = -1;
+		goto END;
+	}
+	r = (q->ver.no_match == 0 && q->ver.compared > 0);
+	if (q->ver.compared == 0) printf("   %s compares no TDO bits, programming the device\n", verify);
+	else printf("   %s : %d TDO outputs didn't match (%.3f sec)\n", verify, q->ver.no_match, now_sec() - start);
+	if (r && !done_store(rec)) fprintf(stderr, "can't write the digest to %s\n", g_cache_dir);
+	q->ver.no_match = q->ver.reported = 0;
+	q->ver.compared = 0;
+	memset(q->ver.unit_no_match, 0, sizeof(q->ver.unit_no_match));
+	goto END;
+USB:
+	fprintf(stderr, "can't write to USB\n");
+	r = -1;
+END:
+	g_max_report = max_report;
+	g_mode = mode;
+	if (r == 0 && !engine_init(tp)) {
+		fprintf(stderr, "can't initialize USB device\n");
+		r = -1;
+	}
+	return r;
+}
+
+// ========== checkpoints ==========
+// -checkpoint file : after a RUNTEST (the end of a programming row), once
+// every CKPT_SEC, the run waits until every TDO so far is compared and,
+// if they all matched, writes where the SVF is and the state it left to
+// file. A run that fails keeps the file; run again, it resets the chain,
+// which takes the device out of ISC mode. So checkpoints are taken only
+// after an ISC_ENABLE : its group (the SIR up to the first RUNTEST or the
+// next SIR) is shifted again from the SVF, then the instruction of the
+// checkpoint is loaded and the run goes on from there. That is right for
+// row addressed programming SVFs only (each row SDR carries its address).
+// The file is removed after a good run.
+static int ckpt_write_bv(FILE *fp, BITVEC *bv)
+{
+	int32_t bits = bv->bits;
+
+	return fwrite(&bits, sizeof(bits), 1, fp) == 1 &&
+		(!bits || fwrite(bv->w, sizeof(uint64_t), BV_WORDS(bits), fp) == (size_t)BV_WORDS(bits));
+}
+
+static int ckpt_read_bv(FILE *fp, BITVEC *bv)
+{
+	int32_t bits;
+
+	if (fread(&bits, sizeof(bits), 1, fp) != 1 || bits < 0 || !bv_resize(bv, bits)) return 0;
+	return !bits || fread(bv->w, sizeof(uint64_t), BV_WORDS(bits), fp) == (size_t)BV_WORDS(bits);
+}
+
+int ckpt_open(SVF_PARSER *ps, const char *fname)
+{
+	MAPPED_FILE mf;
+	CKPT_HEADER h;
+	SCAN_PARAM *sp;
+	FILE *fp;
+	int32_t n[2];
+	int ok;
+
+	memset(&g_ckpt, 0, sizeof(g_ckpt));
+	memcpy(g_ckpt.magic, CKPT_MAGIC, 8);
+	if (!map_file(&mf, fname)) {
+		fprintf(stderr, "can't open %s\n", fname);
+		return -1;
+	}
+	g_ckpt.svf_hash = fnv1a(0xcbf29ce484222325ULL, mf.buf, mf.len);
+	g_ckpt.svf_size = (double)mf.len;
+	unmap_file(&mf);
+	g_ckpt_t = now_sec();
+	if (fopen_s(&fp, g_ckpt_file, "rb")) return 0;
+	ok = fread(&h, sizeof(h), 1, fp) == 1 && !memcmp(h.magic, CKPT_MAGIC, 8);
+	if (ok && (h.svf_hash != g_ckpt.svf_hash || h.svf_size != g_ckpt.svf_size)) {
+		fclose(fp);
+		printf("   %s is of another SVF, %s runs from the start\n", g_ckpt_file, fname);
+		return 0;
+	}
+	for (sp = &ps->sir; ok && sp <= &ps->tdr; sp++) {
+		ok = fread(n, sizeof(n), 1, fp) == 1 && ckpt_read_bv(fp, &sp->tdi) && ckpt_read_bv(fp, &sp->tdo) &&
+			ckpt_read_bv(fp, &sp->mask) && ckpt_read_bv(fp, &sp->smask);
+		sp->bits = n[0];
+		sp->tdo_valid = n[1];
+	}
+	fclose(fp);
+	if (!ok || !svf_seek(ps, h.offset)) {
+		fprintf(stderr, "can't resume at the checkpoint of %s\n", g_ckpt_file);
+		return -1;
+	}
+	g_ckpt = h;
+	g_ckpt_saved = 1;
+	ps->line = h.line;
+	ps->resume = &g_ckpt;
+	ps->enable_ofs = h.enable_ofs;
+	ps->enable_end = h.enable_end;
+	ps->enable_line = h.enable_line;
+	printf("   resuming %s at line %d\n", fname, h.line);
+	return 1;
+}
+
+// an SIR ends the ISC_ENABLE group before it; an ISC_ENABLE (in every
+// device of the SIR) starts one
+void ckpt_sir(SVF_PARSER *ps, SCAN_PARAM *sp, double ofs, int line)
+{
+	int i;
+
+	if (ps->enable_end < 0) ps->enable_end = ofs;
+	if (sp->bits == 0 || sp->bits % ISC_IR_LEN) return;
+	for (i = 0; i < sp->bits; i++) {
+		if ((int)((sp->tdi.w[i >> 6] >> (i & 63)) & 1) != ((ISC_ENABLE_INST >> (i % ISC_IR_LEN)) & 1)) return;
+	}
+	ps->enable_ofs = ofs;
+	ps->enable_end = -1;
+	ps->enable_line = line;
+}
+
+static int ckpt_copy_bv(BITVEC *dst, BITVEC *src)
+{
+	if (!bv_resize(dst, src->bits)) return 0;
+	if (src->bits) memcpy(dst->w, src->w, BV_WORDS(src->bits) * sizeof(uint64_t));
+	return 1;
+}
+
+// the chain was reset : the TCK limit of the SVF, the ISC_ENABLE group
+// (with the HIR / TIR / HDR / TDR and end states of the checkpoint), the
+// instruction of the last SIR, then the state of the checkpoint
+int ckpt_restore(SVF_PARSER *ps, TRANSPORT *tp, const char *fname, int *current_state)
+{
+	SVF_PARSER rp;
+	SCAN_PARAM *sp, *rs;
+	int ret = 0;
+
+	g_svf_freq = g_ckpt.freq;
+	if (!apply_tck(tp) || !transit(tp, current_state, RUN_TEST, 0)) return 0;
+	if (!svf_open(&rp, fname)) {
+		fprintf(stderr, "can't open %s\n", fname);
+		return 0;
+	}
+	for (sp = &ps->hir, rs = &rp.hir; sp <= &ps->tdr; sp++, rs++) {
+		if (!ckpt_copy_bv(&rs->tdi, &sp->tdi) || !ckpt_copy_bv(&rs->tdo, &sp->tdo) ||
+			!ckpt_copy_bv(&rs->mask, &sp->mask) || !ckpt_copy_bv(&rs->smask, &sp->smask)) ret = 1;
+		rs->bits = sp->bits;
+		rs->tdo_valid = sp->tdo_valid;
+	}
+	rp.resume = &g_ckpt;
+	rp.limit = g_ckpt.enable_end;
+	rp.line = g_ckpt.enable_line;
+	if (ret || !svf_seek(&rp, g_ckpt.enable_ofs)) {
+		fprintf(stderr, "can't read the ISC_ENABLE at line %d of %s\n", g_ckpt.enable_line, fname);
+		ret = 1;
+	} else {
+		printf("   shifting the ISC_ENABLE at line %d again\n", g_ckpt.enable_line);
+		if ((ret = parse_cmds(&rp, tp, 0, current_state))) fprintf(stderr, "%s : parse error(errorcode = %d, line = %d)\n", fname, ret, rp.line);
+	}
+	svf_close(&rp);
+	if (ret || !transit(tp, current_state, RUN_TEST, 0)) return 0;
+	if (ps->sir.bits > 0) {
+		if (shift_scan(ps, tp, &ps->sir, 1, g_ckpt.line, current_state)) return 0;
+		if (!transit(tp, current_state, g_ckpt.end_ir, 0)) return 0;
+	}
+	return transit(tp, current_state, g_ckpt.state, 0);
+}
+
+// returns 0 on USB errors only, a checkpoint that can't be written is left out
+int ckpt_take(SVF_PARSER *ps, TRANSPORT *tp, int state, int end_ir, int end_dr, RUNTEST_PARAM *rt)
+{
+	CKPT_HEADER h = g_ckpt;
+	SCAN_PARAM *sp;
+	char tmp[1100];
+	FILE *fp;
+	int32_t n[2];
+	int ok;
+
+	if (!usb_flush(tp, 1)) return 0;
+	g_ckpt_t = now_sec();
+	if (g_mode == 1 && g_usb.ver.no_match) return 1;
+	h.offset = ps->consumed + ps->pos;
+	h.line = ps->line;
+	h.state = state;
+	h.end_ir = end_ir;
+	h.end_dr = end_dr;
+	h.run_state = rt->run_state;
+	h.run_end = rt->run_end;
+	h.run_clks = rt->clks;
+	h.run_sec = rt->min_time;
+	h.freq = g_svf_freq;
+	h.enable_ofs = ps->enable_ofs;
+	h.enable_end = ps->enable_end;
+	h.enable_line = ps->enable_line;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", g_ckpt_file);
+	if (fopen_s(&fp, tmp, "wb")) ok = 0;
+	else {
+		ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+		for (sp = &ps->sir; ok && sp <= &ps->tdr; sp++) {
+			n[0] = sp->bits;
+			n[1] = sp->tdo_valid;
+			ok = fwrite(n, sizeof(n), 1, fp) == 1 && ckpt_write_bv(fp, &sp->tdi) && ckpt_write_bv(fp, &sp->tdo) &&
+				ckpt_write_bv(fp, &sp->mask) && ckpt_write_bv(fp, &sp->smask);
+		}
+		if (fclose(fp)) ok = 0;
+#ifdef _WIN32
+		if (ok) remove(g_ckpt_file);
+#endif
+		if (!ok || rename(tmp, g_ckpt_file)) {
+			remove(tmp);
+			ok = 0;
+		}
+	}
+	if (!ok) fprintf(stderr, "can't write the checkpoint to %s\n", g_ckpt_file);
+	else {
+		g_ckpt = h;
+		g_ckpt_saved = 1;
+	}
+	return 1;
+}
+
+void ckpt_finish(int ok)
+{
+	if (!g_ckpt_file || !g_ckpt_saved) return;
+	if (ok) remove(g_ckpt_file);
+	else printf("   the checkpoint at line %d is kept in %s, run the same command to resume\n", g_ckpt.line, g_ckpt_file);
+	g_ckpt_saved = 0;
+}
+
+// ========== pre-rendered waveform ==========
+// the checksum of an image
+uint64_t image_sum(IMAGE_HEADER *h, const unsigned char *events, const unsigned char *data)
+{
+	IMAGE_HEADER t = *h;
+	uint64_t s;
+
+	t.sum = 0;
+	s = fnv1a(0xcbf29ce484222325ULL, (const unsigned char *)&t, sizeof(t));
+	s = fnv1a(s, events, h->nevent * sizeof(IMAGE_EVENT));
+	return fnv1a(s, data, (size_t)h->data_len);
+}
+
+// asynchronous bit bang writes nothing back, so the bytes depend only on
+// the SVF : render them once with the sleeps and TCK divisor changes
+int render_image(const char *fname, const char *image, int v)
+{
+	static const unsigned char pad[IMAGE_ALIGN] = {0};
+	CMD_STREAM cs;
+	IMAGE_HEADER h;
+	IMAGE_EVENT *ev;
+	FILE *fp;
+	int i, n = 0, ok = 0, error_code, line;
+
+	if (g_mode == 1 || g_broadcast > 1) {
+		fprintf(stderr, "-render is for the asynchronous bit bang mode (without -c)\n");
+		return 0;
+	}
+	if (g_engine == ENGINE_MPSSE) {
+		fprintf(stderr, "-render is for the bit bang engine\n");
+		return 0;
+	}
+	error_code = stream_compile(fname, &cs, ENGINE_BITBANG, v, &line);
+	if (error_code) {
+		if (error_code == -2) fprintf(stderr, "can't open %s\n", fname);
+		else fprintf(stderr, "parse error(errorcode = %d, line = %d)\n", error_code, line);
+		return 0;
+	}
+	if (!(ev = (IMAGE_EVENT *)calloc(cs.nchunk + 1, sizeof(IMAGE_EVENT)))) goto END;
+	for (i = 0; i < cs.nchunk; i++) {
+		// (no mode changes without -c)
+		if (cs.chunk[i].sleep <= 0 && cs.chunk[i].div < 0) continue;
+		ev[n].ofs = cs.chunk[i].ofs + cs.chunk[i].length;
+		ev[n].sleep = cs.chunk[i].sleep;
+		ev[n].div = cs.chunk[i].div;
+		n++;
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, IMAGE_MAGIC, 8);
+	h.engine = ENGINE_BITBANG;
+	h.pins = IMAGE_PINS;
+	h.mode = BITBANG_ASYNC;
+	h.nevent = n;
+	h.data_ofs = (sizeof(h) + n * sizeof(IMAGE_EVENT) + IMAGE_ALIGN - 1) & ~(IMAGE_ALIGN - 1);
+	h.data_len = cs.len;
+	h.sum = image_sum(&h, (const unsigned char *)ev, cs.data);
+	if (fopen_s(&fp, image, "wb")) {
+		fprintf(stderr, "can't create %s\n", image);
+		goto END;
+	}
+	ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+	if (ok && n > 0) ok = fwrite(ev, sizeof(IMAGE_EVENT), n, fp) == (size_t)n;
+	if (ok) ok = fwrite(pad, (size_t)(h.data_ofs - sizeof(h) - n * sizeof(IMAGE_EVENT)), 1, fp) == 1;
+	if (ok && cs.len > 0) ok = fwrite(cs.data, (size_t)cs.len, 1, fp) == 1;
+	if (fclose(fp)) ok = 0;
+	if (!ok) {
+		fprintf(stderr, "can't write %s\n", image);
+		remove(image);
+	}
+	else printf("   %s : %.0f bytes, %d sleeps / TCK changes\n", image, (double)cs.len, n);
+END:
+	free(ev);
+	stream_free(&cs);
+	return ok;
+}
+
+// map the image as a command stream : the bytes stay in the mapping, in
+// IMAGE_WRITE blocks cut only at the events
+int image_load(CMD_STREAM *cs, const char *image)
+{
+	IMAGE_HEADER h;
+	const IMAGE_EVENT *ev;
+	int64_t pos = 0, end, len;
+	CHUNK *c;
+	int i;
+
+	memset(cs, 0, sizeof(CMD_STREAM));
+	if (!map_file(&cs->map, image)) {
+		fprintf(stderr, "can't open %s\n", image);
+		return 0;
+	}
+	if (cs->map.len < sizeof(h)) goto BAD;
+	memcpy(&h, cs->map.buf, sizeof(h));
+	if (memcmp(h.magic, IMAGE_MAGIC, 8) || h.nevent < 0 || h.data_len < 0 ||
+		h.data_ofs < (int64_t)(sizeof(h) + h.nevent * sizeof(IMAGE_EVENT)) || h.data_ofs > (int64_t)cs->map.len ||
+		h.data_len != (int64_t)cs->map.len - h.data_ofs) goto BAD;
+	ev = (const IMAGE_EVENT *)(cs->map.buf + sizeof(h));
+	cs->data = (unsigned char *)cs->map.buf + h.data_ofs;
+	if (h.sum != image_sum(&h, (const unsigned char *)ev, cs->data)) goto BAD;
+	if (h.pins != IMAGE_PINS || h.mode != BITBANG_ASYNC) {
+		fprintf(stderr, "%s is for another pin mapping\n", image);
+		goto END;
+	}
+	cs->engine = h.engine;
+	cs->len = cs->cap = h.data_len;
+	for (i = 0; i <= h.nevent; i++) {
+		end = (i < h.nevent) ? ev[i].ofs : h.data_len;
+		if (end < pos || end > h.data_len) goto BAD;
+		for (; pos < end; pos += len) {
+			len = IMAGE_WRITE - (pos & (IMAGE_WRITE - 1));
+			if (len > end - pos) len = end - pos;
+			if (!(c = stream_chunk(cs))) goto NOMEM;
+			c->ofs = pos;
+			c->length = (int)len;
+		}
+		if (i < h.nevent && (ev[i].sleep > 0 || ev[i].div >= 0)) {
+			if (!(c = stream_chunk(cs))) goto NOMEM;
+			c->ofs = pos;
+			c->sleep = ev[i].sleep;
+			c->div = ev[i].div;
+		}
+	}
+	if (!stream_check(cs)) goto BAD;
+	return 1;
+NOMEM:
+	fprintf(stderr, "out of memory\n");
+	goto END;
+BAD:
+	fprintf(stderr, "%s is not a valid waveform image\n", image);
+END:
+	stream_free(cs);
+	return 0;
+}
+
+// check the image is for this adapter and stream it
+int image_replay(TRANSPORT *tp, const char *image)
+{
+	CMD_STREAM cs;
+	VERIFIER ver;
+	int ok = 0;
+
+	memset(&ver, 0, sizeof(ver));
+	if (!image_load(&cs, image)) return 0;
+	if (cs.engine != g_engine || g_mode == 1) {
+		fprintf(stderr, "%s is for another adapter or pin mapping\n", image);
+	} else if (!engine_mode(tp, g_engine)) {
+		fprintf(stderr, "can't initialize USB device\n");
+	} else if (!(ok = stream_replay(tp, &cs, &ver))) {
+		fprintf(stderr, "can't write to USB\n");
+	}
+	stream_free(&cs);
+	return ok;
+}
+
+THREAD_FUNC worker_thread(void *arg)
+{
+	WORKER *w = (WORKER *)arg;
+	TRANSPORT *tp = w->tp;
+	double start = now_sec();
+
+	if (!tp->open(tp)) w->error = "can't open";
+	else {
+		if (w->cs->engine == ENGINE_BITBANG) { // dummy open...
+			tp->set_bit_mode(tp, g_bb_mask, (g_mode == 1)?BITBANG_SYNC:BITBANG_ASYNC);
+			tp->close(tp);
+			if (!tp->open(tp)) {
+				w->error = "can't open";
+				goto END;
+			}
+		}
+		if (!engine_mode(tp, w->cs->engine)) w->error = "can't initialize";
+		else if (!stream_replay(tp, w->cs, &w->ver)) w->error = "USB error";
+		tp->close(tp);
+	}
+END:
+	w->elapsed = now_sec() - start;
+	return 0;
+}
+
+static const char *dev_type_name[] = {"unknown", "FT232R", "FT2232H", "FT4232H", "FT232H"};
+
+// the adapters of list ("all" or serial numbers / descriptions separated
+// by ','); the simulated ones are SIM0, SIM1 ...
+int find_devices(DEVINFO *dev, const char *list, int sim)
+{
+	DEVINFO found[MAX_DEVICES];
+	const char *p, *e;
+	int i, j, n, ndev = 0, nfound = 0;
+
+	if (sim) {
+		for (i = 0; i < SIM_DEVICES; i++) {
+			sprintf(found[i].id, "SIM%d", i);
+			found[i].type = sim;
+		}
+		nfound = SIM_DEVICES;
+	} else nfound = ftdi_list(found, MAX_DEVICES);
+	if (!strcmp(list, "all")) {
+		memcpy(dev, found, nfound * sizeof(DEVINFO));
+		ndev = nfound;
+	} else {
+		for (p = list; *p && ndev < MAX_DEVICES; p = (*e ? e + 1 : e)) {
+			if (!(e = strchr(p, ','))) e = p + strlen(p);
+			n = (int)(e - p);
+			if (n == 0) continue;
+			if (n > 63) n = 63;
+			memcpy(dev[ndev].id, p, n);
+			dev[ndev].id[n] = '\0';
+			dev[ndev].type = sim ? sim : DEV_UNKNOWN;
+			for (j = 0; j < nfound; j++) {
+				if (!strcmp(found[j].id, dev[ndev].id)) dev[ndev].type = found[j].type;
+			}
+			ndev++;
+		}
+	}
+	if (ndev == 0) fprintf(stderr, "no USB device\n");
+	return ndev;
+}
+
+// program the adapters of list in parallel; the SVF is parsed and encoded
+// once per engine and the same command stream is replayed on every adapter
+int run_multi(const char *fname, const char *list, int sim, int v)
+{
+	DEVINFO dev[MAX_DEVICES];
+	CMD_STREAM cs[2];
+	WORKER *w;
+	int i, ndev, engine, error_code, line, failed = 0;
+
+	memset(cs, 0, sizeof(cs));
+	if (!(ndev = find_devices(dev, list, sim))) return 0;
+	if (!(w = (WORKER *)calloc(ndev, sizeof(WORKER)))) return 0;
+	// encode the SVF for the engines in use
+	for (i = 0; i < ndev; i++) {
+		engine = g_engine;
+		if (engine == ENGINE_AUTO) {
+			engine = (dev[i].type == DEV_FT2232H || dev[i].type == DEV_FT4232H || dev[i].type == DEV_FT232H) ? ENGINE_MPSSE : ENGINE_BITBANG;
+		}
+		if (!cs[engine].data && !cs[engine].nchunk) {
+			error_code = stream_compile(fname, &cs[engine], engine, v, &line);
+			if (error_code == -2) {
+				fprintf(stderr, "can't open %s\n", fname);
+				goto END;
+			}
+			if (error_code) {
+				fprintf(stderr, "parse error(errorcode = %d, line = %d)\n", error_code, line);
+				goto END;
+			}
+		}
+		w[i].cs = &cs[engine];
+		w[i].tp = sim ? sim_transport(sim) : ftdi_transport(dev[i].id);
+		if (!w[i].tp) {
+			fprintf(stderr, "USB device support is not compiled in (use -sim)\n");
+			goto END;
+		}
+		strcpy(w[i].tp->id, dev[i].id);
+		w[i].ver.head = cs[engine].vhead;
+		w[i].ver.name = w[i].tp->id;
+	}
+	for (i = 0; i < ndev; i++) {
+		if (!thread_start(&w[i].thread, worker_thread, &w[i])) {
+			w[i].error = "can't start";
+		}
+	}
+	for (i = 0; i < ndev; i++) {
+		if (!w[i].error) thread_join(w[i].thread);
+	}
+	printf("\n   %-20s %-8s %-8s %10s %10s\n", "device", "type", "result", "mismatch", "elapsed");
+	for (i = 0; i < ndev; i++) {
+		const char *result = w[i].error ? w[i].error : (g_mode == 1) ? (w[i].ver.no_match ? "FAIL" : "pass") : "done";
+
+		if (w[i].error || w[i].ver.no_match) failed++;
+		printf("   %-20s %-8s %-8s %10d %6.3f sec\n", dev[i].id, dev_type_name[dev[i].type], result, w[i].ver.no_match, w[i].elapsed);
+	}
+	printf("\n   <<< %d of %d devices %s >>>\n\n", ndev - failed, ndev, (g_mode == 1) ? "passed" : "programmed");
+END:
+	for (i = 0; i < ndev; i++) {
+		if (w[i].tp) free(w[i].tp);
+		free(w[i].ver.got.w);
+	}
+	free(w);
+	stream_free(&cs[0]);
+	stream_free(&cs[1]);
+	return (failed == 0);
+}
+
+// ========== daemon ==========
+#ifndef _WIN32
+volatile sig_atomic_t g_daemon_stop = 0;
+
+void daemon_signal(int sig)
+{
+	(void)sig;
+	g_daemon_stop = 1;
+}
+
+// run one job on an adapter and write its JSON result line to fp; the
+// job line takes the options of the command line :
+//   svf_file [-c] [-fullsync] [-freq hz] [-broadcast n] [-dev id]
+//   -image file [-dev id]
+void daemon_job(DAEMON *d, char *line, FILE *fp)
+{
+	static const char *sep = " \t\r\n";
+	ADAPTER *a = NULL;
+	CMD_STREAM cs;
+	VERIFIER ver;
+	char *arg, *save = NULL, *fname = NULL, *image = NULL, *dev = NULL;
+	const char *error = NULL, *status;
+	int i, mode = d->mode, broadcast = d->broadcast, fullsync = d->fullsync;
+	int error_code, svf_line = 0;
+	double tck_max = d->tck_max, t0 = now_sec(), t1 = t0, t2 = t0, t3 = t0;
+	double written = 0, read = 0;
+
+	memset(&cs, 0, sizeof(cs));
+	memset(&ver, 0, sizeof(ver));
+	for (arg = strtok_r(line, sep, &save); arg; arg = strtok_r(NULL, sep, &save)) {
+		if (!strcmp(arg, "-c")) mode = 1;
+		else if (!strcmp(arg, "-fullsync")) fullsync = 1;
+		else if (!strcmp(arg, "-freq") && (arg = strtok_r(NULL, sep, &save))) tck_max = atof(arg);
+		else if (!strcmp(arg, "-broadcast") && (arg = strtok_r(NULL, sep, &save))) broadcast = atoi(arg);
+		else if (!strcmp(arg, "-dev") && (arg = strtok_r(NULL, sep, &save))) dev = arg;
+		else if (!strcmp(arg, "-image") && (arg = strtok_r(NULL, sep, &save))) image = arg;
+		else if (arg[0] == '-') {
+			error = "unknown option";
+			goto REPLY;
+		}
+		else fname = arg;
+	}
+	if (!fname && !image) {
+		error = "no SVF file or image";
+		goto REPLY;
+	}
+	if (broadcast < 1) broadcast = 1;
+	if (broadcast > MAX_CHAIN) broadcast = MAX_CHAIN;
+	// the named adapter, else the first idle one (or the first released)
+	if (dev) {
+		for (i = 0; i < d->nad && strcmp(d->ad[i].dev.id, dev); i++) ;
+		if (i == d->nad) {
+			error = "no such adapter";
+			goto REPLY;
+		}
+		a = &d->ad[i];
+	}
+	pthread_mutex_lock(&d->ad_lock);
+	for (;;) {
+		if (dev && !a->busy) break;
+		for (i = 0; !dev && i < d->nad && !a; i++) {
+			if (!d->ad[i].busy) a = &d->ad[i];
+		}
+		if (a && !a->busy) break;
+		pthread_cond_wait(&d->idle, &d->ad_lock);
+	}
+	a->busy = 1;
+	pthread_mutex_unlock(&d->ad_lock);
+	t1 = now_sec();
+	// compile and set the adapter up with the settings of the job
+	pthread_mutex_lock(&d->lock);
+	g_mode = image ? 0 : mode;
+	g_fullsync = fullsync;
+	g_broadcast = broadcast;
+	g_tck_max = tck_max;
+	if (image) {
+		if (!image_load(&cs, image)) error = "not a valid waveform image";
+		else if (cs.engine != a->engine) error = "image is for another adapter";
+	} else {
+		error_code = stream_compile(fname, &cs, a->engine, d->v, &svf_line);
+		if (error_code == -2) error = "can't open SVF file";
+		else if (error_code) error = "parse error";
+	}
+	if (!error && !engine_mode(a->tp, a->engine)) error = "can't initialize";
+	pthread_mutex_unlock(&d->lock);
+	t2 = now_sec();
+	// the replay has its own verifier : the adapters run concurrently
+	if (!error) {
+		ver.head = cs.vhead;
+		ver.name = a->tp->id;
+		written = a->tp->bytes_written;
+		read = a->tp->bytes_read;
+		if (!stream_replay(a->tp, &cs, &ver)) error = "USB error";
+		written = a->tp->bytes_written - written;
+		read = a->tp->bytes_read - read;
+	}
+	t3 = now_sec();
+	pthread_mutex_lock(&d->ad_lock);
+	a->jobs++;
+	a->busy = 0;
+	// wake every waiter : some of them wait for this one by name
+	pthread_cond_broadcast(&d->idle);
+	pthread_mutex_unlock(&d->ad_lock);
+REPLY:
+	status = error ? "error" : (mode == 1 && !image) ? (ver.no_match ? "fail" : "pass") : "done";
+	fprintf(fp, "{\"status\": \"%s\", \"device\": ", status);
+	json_str(fp, a ? a->dev.id : "");
+	fprintf(fp, ", \"mismatches\": %d, \"wait_sec\": %.6f, \"compile_sec\": %.6f, \"program_sec\": %.6f",
+		ver.no_match, t1 - t0, t2 - t1, t3 - t2);
+	fprintf(fp, ", \"bytes_written\": %.0f, \"bytes_read\": %.0f", written, read);
+	if (error) {
+		fprintf(fp, ", \"error\": ");
+		json_str(fp, error);
+		if (svf_line) fprintf(fp, ", \"line\": %d", svf_line);
+	}
+	fprintf(fp, "}\n");
+	fflush(fp);
+	printf("   %-20s %-8s %10d %6.3f sec  %s\n", a ? a->dev.id : "-", status, ver.no_match, t3 - t0, fname ? fname : image ? image : "");
+	fflush(stdout);
+	free(ver.got.w);
+	stream_free(&cs);
+}
+
+// the jobs of one connection, one line each
+THREAD_FUNC daemon_conn(void *arg)
+{
+	DAEMON_CONN *c = (DAEMON_CONN *)arg;
+	FILE *in = fdopen(c->fd, "r"), *out = NULL;
+	char line[4096];
+	int fd;
+
+	if (in && (fd = dup(c->fd)) >= 0 && !(out = fdopen(fd, "w"))) close(fd);
+	while (in && out && fgets(line, sizeof(line), in)) daemon_job(c->d, line, out);
+	if (out) fclose(out);
+	if (in) fclose(in);
+	else close(c->fd);
+	free(c);
+	return 0;
+}
+
+// open and initialize the adapters once, then take jobs on the Unix socket
+// path until SIGINT / SIGTERM; jobs for different adapters run concurrently
+int run_daemon(const char *path, const char *list, int sim, int v)
+{
+	DEVINFO dev[MAX_DEVICES];
+	DAEMON d;
+	DAEMON_CONN *c;
+	ADAPTER *a;
+	struct sockaddr_un sa;
+	struct sigaction act;
+	THREAD th;
+	int i, ndev, fd, s = -1;
+
+	memset(&d, 0, sizeof(d));
+	d.v = v;
+	d.mode = g_mode;
+	d.broadcast = g_broadcast;
+	d.fullsync = g_fullsync;
+	d.tck_max = g_tck_max;
+	pthread_mutex_init(&d.lock, NULL);
+	pthread_mutex_init(&d.ad_lock, NULL);
+	pthread_cond_init(&d.idle, NULL);
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "socket path too long\n");
+		return 0;
+	}
+	if (!(ndev = find_devices(dev, list, sim))) return 0;
+	if (!(d.ad = (ADAPTER *)calloc(ndev, sizeof(ADAPTER)))) return 0;
+	for (i = 0; i < ndev; i++) {
+		a = &d.ad[d.nad];
+		a->dev = dev[i];
+		a->engine = g_engine;
+		if (a->engine == ENGINE_AUTO) {
+			a->engine = (dev[i].type == DEV_FT2232H || dev[i].type == DEV_FT4232H || dev[i].type == DEV_FT232H) ? ENGINE_MPSSE : ENGINE_BITBANG;
+		}
+		if (!(a->tp = sim ? sim_transport(sim) : ftdi_transport(dev[i].id))) {
+			fprintf(stderr, "USB device support is not compiled in (use -sim)\n");
+			goto END;
+		}
+		strcpy(a->tp->id, dev[i].id);
+		if (!a->tp->open(a->tp)) {
+			fprintf(stderr, "can't open %s\n", dev[i].id);
+			free(a->tp);
+			continue;
+		}
+		if (a->engine == ENGINE_BITBANG) { // dummy open...
+			a->tp->set_bit_mode(a->tp, g_bb_mask, (g_mode == 1)?BITBANG_SYNC:BITBANG_ASYNC);
+			a->tp->close(a->tp);
+			if (!a->tp->open(a->tp)) {
+				fprintf(stderr, "can't open %s\n", dev[i].id);
+				free(a->tp);
+				continue;
+			}
+		}
+		if (!engine_mode(a->tp, a->engine)) {
+			fprintf(stderr, "can't initialize %s\n", dev[i].id);
+			a->tp->close(a->tp);
+			free(a->tp);
+			continue;
+		}
+		d.nad++;
+	}
+	if (d.nad == 0) {
+		fprintf(stderr, "no USB device\n");
+		goto END;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	unlink(path);
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(s, (struct sockaddr *)&sa, sizeof(sa)) || listen(s, 16)) {
+		fprintf(stderr, "can't listen on %s\n", path);
+		goto END;
+	}
+	// no SA_RESTART : the signals interrupt accept
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = daemon_signal;
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	printf("   %d adapters ready, jobs on %s\n\n", d.nad, path);
+	fflush(stdout);
+	while (!g_daemon_stop) {
+		if ((fd = accept(s, NULL, NULL)) < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "can't accept on %s\n", path);
+			break;
+		}
+		if (!(c = (DAEMON_CONN *)malloc(sizeof(DAEMON_CONN)))) {
+			close(fd);
+			continue;
+		}
+		c->d = &d;
+		c->fd = fd;
+		if (thread_start(&th, daemon_conn, c)) pthread_detach(th);
+		else {
+			close(fd);
+			free(c);
+		}
+	}
+	close(s);
+	unlink(path);
+	s = -1;
+	// wait for the running jobs
+	pthread_mutex_lock(&d.ad_lock);
+	for (i = 0; i < d.nad; i++) {
+		while (d.ad[i].busy) pthread_cond_wait(&d.idle, &d.ad_lock);
+		d.ad[i].busy = 1;	// the connections left take no job on it
+		printf("   %-20s %ld jobs\n", d.ad[i].dev.id, d.ad[i].jobs);
+	}
+	pthread_mutex_unlock(&d.ad_lock);
+END:
+	if (s >= 0) close(s);
+	for (i = 0; i < d.nad; i++) {
+		d.ad[i].tp->close(d.ad[i].tp);
+		free(d.ad[i].tp);
+	}
+	free(d.ad);
+	return (d.nad > 0);
+}
+#else
+int run_daemon(const char *path, const char *list, int sim, int v)
+{
+	fprintf(stderr, "-daemon needs Unix domain sockets (not on Windows)\n");
+	return 0;
+}
+#endif
+
+// ========== bit sliced chains ==========
+// pins of -slice as 4 digits of TDO, TCK, TMS, TDI (3210 : the usual D0-D3)
+int slice_pins(const char *arg)
+{
+	int i, pins = 0;
+
+	if (strlen(arg) != 4) return -1;
+	for (i = 0; i < 4; i++) {
+		if (arg[i] < '0' || arg[i] > '7') return -1;
+		pins = (pins << 4) | (arg[i] - '0');
+	}
+	return pins;
+}
+
+// check the pins (a shared TCK, no other pin twice) and set the output
+// mask and the pin maps of the chains
+int slice_setup(SLICE *sl, int n)
+{
+	int i, j, b, used = 0, tck = (sl[0].pins >> 8) & 7;
+
+	g_bb_mask = 1 << tck;
+	for (i = 0; i < n; i++) {
+		if (((sl[i].pins >> 8) & 7) != tck) {
+			fprintf(stderr, "the chains of -slice share TCK\n");
+			return 0;
+		}
+		for (j = 0; j < 16; j += 4) {
+			b = 1 << ((sl[i].pins >> j) & 7);
+			if (j == 8) continue;
+			if ((used & b) || b == g_bb_mask) {
+				fprintf(stderr, "pin D%d of -slice is used twice\n", (sl[i].pins >> j) & 7);
+				return 0;
+			}
+			used |= b;
+		}
+		for (b = 0; b < 8; b++) {
+			sl[i].map[b] = (unsigned char)(((b & 1) << (sl[i].pins & 7)) | (((b >> 1) & 1) << ((sl[i].pins >> 4) & 7)) | (((b >> 2) & 1) << tck));
+		}
+		g_bb_mask |= (1 << (sl[i].pins & 7)) | (1 << ((sl[i].pins >> 4) & 7));
+		g_slice_pins[i] = sl[i].pins;
+	}
+	g_nslice = n;
+	return 1;
+}
+
+// OR the bytes of the chains (encoded for D0-D3) on their pins into one
+// stream; a chain that is done holds its TMS / TDI while the others clock.
+// Sleeps are taken once for all, the TCK divisor is the slowest of the
+// chains. Every byte is read back with -c, so a read back offset is a
+// byte offset in the stream of a chain too.
+int slice_merge(SLICE *sl, int n, CMD_STREAM *cs)
+{
+	CMD_STREAM *s;
+	CHUNK *c;
+	int64_t pos, end, len = 0;
+	int i, k, b, ci[MAX_SLICES], div[MAX_SLICES], last_div = -1, d, size = (g_mode == 1) ? USB_BUFSIZE : IMAGE_WRITE;
+	double sleep;
+
+	memset(cs, 0, sizeof(CMD_STREAM));
+	cs->engine = ENGINE_BITBANG;
+	for (k = 0; k < n; k++) {
+		if (sl[k].cs.len & 1) goto STEP;
+		if (sl[k].cs.len > len) len = sl[k].cs.len;
+		ci[k] = 0;
+		div[k] = -1;
+	}
+	if (len > 0 && !(cs->data = (unsigned char *)malloc((size_t)len))) return 0;
+	cs->len = cs->cap = len;
+	for (pos = 0; pos < len; pos++) {
+		b = 0;
+		for (k = 0; k < n; k++) {
+			s = &sl[k].cs;
+			if (pos < s->len) {
+				i = s->data[pos];
+				// TCK low / high byte pairs, the same in all chains
+				if (((i >> 2) & 1) != (pos & 1)) goto STEP;
+			} else i = (s->len ? (s->data[s->len - 1] & 3) : 2) | (int)((pos & 1) << 2);
+			b |= sl[k].map[i & 7];
+		}
+		cs->data[pos] = (unsigned char)b;
+	}
+	// the writes, cut at the sleeps and divisor changes of any chain
+	for (pos = 0;;) {
+		end = len;
+		for (k = 0; k < n; k++) {
+			s = &sl[k].cs;
+			for (; ci[k] < s->nchunk; ci[k]++) {
+				c = &s->chunk[ci[k]];
+				if (c->sleep > 0 || c->div >= 0) break;
+			}
+			if (ci[k] < s->nchunk && c->ofs + c->length < end) end = c->ofs + c->length;
+		}
+		for (; pos < end; pos += i) {
+			i = (int)((end - pos < size) ? end - pos : size);
+			if (!(c = stream_chunk(cs))) return 0;
+			c->ofs = pos;
+			c->length = i;
+			c->rlength = (g_mode == 1) ? i : 0;
+			if (c->rlength > cs->max_rlength) cs->max_rlength = c->rlength;
+		}
+		if (pos == len) {
+			for (k = 0; k < n && ci[k] == sl[k].cs.nchunk; k++) ;
+			if (k == n) break;
+		}
+		sleep = 0;
+		for (k = 0; k < n; k++) {
+			s = &sl[k].cs;
+			for (; ci[k] < s->nchunk; ci[k]++) {
+				c = &s->chunk[ci[k]];
+				if (c->ofs + c->length != pos) break;
+				if (c->sleep > sleep) sleep = c->sleep;
+				if (c->div >= 0) div[k] = c->div;
+			}
+		}
+		for (d = -1, k = 0; k < n; k++) {
+			if (div[k] > d) d = div[k];
+		}
+		if (!(c = stream_chunk(cs))) return 0;
+		c->ofs = pos;
+		c->sleep = sleep;
+		if (d != last_div) c->div = last_div = d;
+	}
+	return 1;
+STEP:
+	fprintf(stderr, "the chains of -slice are out of step\n");
+	return 0;
+}
+
+// stream_replay of the merged stream : the TDO pin of every chain goes to
+// its verifier (at D3) for the bytes of its own stream
+int slice_replay(TRANSPORT *tp, SLICE *sl, int n, CMD_STREAM *cs)
+{
+	unsigned char *result = (unsigned char *)malloc(cs->max_rlength + 1);
+	unsigned char *got = (unsigned char *)malloc(cs->max_rlength + 1);
+	CHUNK *c, *prev = NULL;
+	int i, j, k, m, tdo, ok = (result != NULL && got != NULL);
+
+	for (i = 0; ok && i <= cs->nchunk; i++) {
+		c = (i < cs->nchunk) ? &cs->chunk[i] : NULL;
+		if (c && c->length > 0) ok = tp_write(tp, cs->data + c->ofs, c->length);
+		if (ok && prev && prev->rlength > 0) {
+			ok = tp_read(tp, result, prev->rlength);
+			for (k = 0; ok && k < n; k++) {
+				m = (int)((sl[k].cs.len - prev->ofs < prev->rlength) ? sl[k].cs.len - prev->ofs : prev->rlength);
+				tdo = (sl[k].pins >> 12) & 7;
+				for (j = 0; j < m; j++) got[j] = (unsigned char)(((result[j] >> tdo) & 1) << 3);
+				if (m > 0) ok = verify_feed(&sl[k].ver, got, m);
+			}
+		}
+		prev = c;
+		if (ok && c && c->sleep > 0) sleep_sec(c->sleep);
+		if (ok && c && c->div >= 0) ok = tp->set_divisor(tp, c->div);
+	}
+	free(result);
+	free(got);
+	return ok;
+}
+
+// program the SVFs of the -slice chains of one bit bang adapter together
+int run_slices(SLICE *sl, int n, const char *id, int sim, int v)
+{
+	TRANSPORT *tp = NULL;
+	CMD_STREAM cs;
+	double start, elapsed, sum = 0;
+	int i, error_code, line, ok = 0, failed = 0, fullsync = g_fullsync;
+
+	memset(&cs, 0, sizeof(cs));
+	if (g_engine == ENGINE_MPSSE) {
+		fprintf(stderr, "-slice is for the bit bang engine\n");
+		return 0;
+	}
+	if (!slice_setup(sl, n)) return 0;
+	// the chains are read back in step
+	if (g_mode == 1 && !g_fullsync) printf("   -slice reads back every byte with -c (-fullsync)\n");
+	g_fullsync = 1;
+	for (i = 0; i < n; i++) {
+		error_code = stream_compile(sl[i].fname, &sl[i].cs, ENGINE_BITBANG, v, &line);
+		if (error_code) {
+			if (error_code == -2) fprintf(stderr, "can't open %s\n", sl[i].fname);
+			else fprintf(stderr, "%s : parse error(errorcode = %d, line = %d)\n", sl[i].fname, error_code, line);
+			goto END;
+		}
+		sl[i].ver.head = sl[i].cs.vhead;
+		sl[i].ver.name = sl[i].fname;
+		sum += (double)sl[i].cs.len;
+	}
+	if (!slice_merge(sl, n, &cs)) goto END;
+	tp = sim ? sim_transport(sim) : ftdi_transport(id);
+	if (!tp) {
+		fprintf(stderr, "USB device support is not compiled in (use -sim)\n");
+		goto END;
+	}
+	if (id) strcpy(tp->id, id);
+	if (!tp->open(tp)) {
+		fprintf(stderr, "can't open USB device\n");
+		goto END;
+	}
+	// dummy open...
+	tp->set_bit_mode(tp, g_bb_mask, (g_mode == 1)?BITBANG_SYNC:BITBANG_ASYNC);
+	tp->close(tp);
+	if (!tp->open(tp)) {
+		fprintf(stderr, "can't open USB device\n");
+		goto END;
+	}
+	start = now_sec();
+	if (!engine_mode(tp, ENGINE_BITBANG)) fprintf(stderr, "can't initialize USB device\n");
+	else if (!(ok = slice_replay(tp, sl, n, &cs))) fprintf(stderr, "USB error\n");
+	elapsed = now_sec() - start;
+	tp->close(tp);
+	if (ok) {
+		printf("\n   %-5s %-24s %-8s %10s %12s\n", "pins", "SVF", "result", "mismatch", "bytes");
+		for (i = 0; i < n; i++) {
+			if (sl[i].ver.no_match) failed++;
+			printf("   %04x  %-24s %-8s %10d %12.0f\n", sl[i].pins, sl[i].fname,
+				(g_mode == 1) ? (sl[i].ver.no_match ? "FAIL" : "pass") : "done", sl[i].ver.no_match, (double)sl[i].cs.len);
+		}
+		printf("\n   %.0f bytes for %d chains (%.0f one after the other) in %.3f sec\n\n", (double)cs.len, n, sum, elapsed);
+		ok = (failed == 0);
+	}
+END:
+	for (i = 0; i < n; i++) {
+		free(sl[i].ver.got.w);
+		stream_free(&sl[i].cs);
+	}
+	stream_free(&cs);
+	free(tp);
+	g_fullsync = fullsync;
+	return ok;
+}
+
+// ========== FTDI D2XX transport ==========
+#ifndef NO_FTD2XX
+int ftdi_open(TRANSPORT *tp)
+{
+	FT_HANDLE ftHandle;
+	FT_DEVICE type;
+	DWORD id;
+	char serial[16], desc[64];
+
+	if (tp->id[0]) {
+		if (FT_OpenEx(tp->id, FT_OPEN_BY_SERIAL_NUMBER, &ftHandle) != FT_OK &&
+			FT_OpenEx(tp->id, FT_OPEN_BY_DESCRIPTION, &ftHandle) != FT_OK) return 0;
+	} else {
+		if (FT_Open(0, &ftHandle) != FT_OK) return 0;
+		// the first device is named by its serial number from now on (it
+		// is opened again by it, and it keys the -skip digest)
+		if (FT_GetDeviceInfo(ftHandle, &type, &id, serial, desc, NULL) == FT_OK) {
+			serial[15] = '\0';
+			snprintf(tp->id, sizeof(tp->id), "%s", serial);
+		}
+	}
+	tp->handle = ftHandle;
+	return 1;
+}
+
+void ftdi_close(TRANSPORT *tp)
+{
+	FT_Close((FT_HANDLE)tp->handle);
+}
+
+int ftdi_set_bit_mode(TRANSPORT *tp, int mask, int mode)
+{
+	return (FT_SetBitMode((FT_HANDLE)tp->handle, (UCHAR)mask, (UCHAR)mode) == FT_OK);
+}
+
+int ftdi_set_divisor(TRANSPORT *tp, int div)
+{
+	return (FT_SetDivisor((FT_HANDLE)tp->handle, (USHORT)div) == FT_OK);
+}
+
+int ftdi_set_usb(TRANSPORT *tp, int xfer, int latency)
+{
+	FT_HANDLE ftHandle = (FT_HANDLE)tp->handle;
+
+	if (xfer > 0 && FT_SetUSBParameters(ftHandle, xfer, xfer) != FT_OK) return 0;
+	if (latency > 0 && FT_SetLatencyTimer(ftHandle, (UCHAR)latency) != FT_OK) return 0;
+	return 1;
+}
+
+int ftdi_write(TRANSPORT *tp, unsigned char *buf, int len)
+{
+	DWORD written;
+
+	if (FT_Write((FT_HANDLE)tp->handle, buf, len, &written) != FT_OK) return 0;
+	return (written == (DWORD)len);
+}
+
+int ftdi_read(TRANSPORT *tp, unsigned char *buf, int len)
+{
+	DWORD read;
+
+	if (FT_Read((FT_HANDLE)tp->handle, buf, len, &read) != FT_OK) return 0;
+	return (read == (DWORD)len);
+}
+
+int ftdi_purge(TRANSPORT *tp)
+{
+	return (FT_Purge((FT_HANDLE)tp->handle, FT_PURGE_RX | FT_PURGE_TX) == FT_OK);
+}
+
+int ftdi_type(FT_DEVICE type)
+{
+	switch (type) {
+	case FT_DEVICE_232R: return DEV_FT232R;
+	case FT_DEVICE_2232H: return DEV_FT2232H;
+	case FT_DEVICE_4232H: return DEV_FT4232H;
+	case FT_DEVICE_232H: return DEV_FT232H;
+	}
+	return DEV_UNKNOWN;
+}
+
+int ftdi_device_type(TRANSPORT *tp)
+{
+	FT_DEVICE type;
+	DWORD id;
+	char serial[16], desc[64];
+
+	if (FT_GetDeviceInfo((FT_HANDLE)tp->handle, &type, &id, serial, desc, NULL) != FT_OK) return DEV_UNKNOWN;
+	return ftdi_type(type);
+}
+
+// list the FTDI devices by serial number (description if it has none)
+int ftdi_list(DEVINFO *list, int max)
+{
+	FT_DEVICE_LIST_INFO_NODE *node;
+	DWORD i, num;
+	int n = 0;
+
+	if (FT_CreateDeviceInfoList(&num) != FT_OK || num == 0) return 0;
+	if (!(node = (FT_DEVICE_LIST_INFO_NODE *)calloc(num, sizeof(FT_DEVICE_LIST_INFO_NODE)))) return 0;
+	if (FT_GetDeviceInfoList(node, &num) == FT_OK) {
+		for (i = 0; i < num && n < max; i++, n++) {
+			strncpy(list[n].id, node[i].SerialNumber[0] ? node[i].SerialNumber : node[i].Description, 63);
+			list[n].id[63] = '\0';
+			list[n].type = ftdi_type(node[i].Type);
+		}
 	}
+	free(node);
+	return n;
+}
+
+// transport of the FTDI D2XX driver
+TRANSPORT *ftdi_transport(const char *id)
+{
+	TRANSPORT *tp = (TRANSPORT *)calloc(1, sizeof(TRANSPORT));
+
+	if (!tp) return NULL;
+	if (id) {
+		strncpy(tp->id, id, 63);
+		tp->id[63] = '\0';
+	}
+	tp->name = "ftd2xx";
+	tp->open = ftdi_open;
+	tp->close = ftdi_close;
+	tp->set_bit_mode = ftdi_set_bit_mode;
+	tp->set_divisor = ftdi_set_divisor;
+	tp->write = ftdi_write;
+	tp->read = ftdi_read;
+	tp->purge = ftdi_purge;
+	tp->device_type = ftdi_device_type;
+	tp->set_usb = ftdi_set_usb;
+	return tp;
+}
+#else
+TRANSPORT *ftdi_transport(const char *id)
+{
+	(void)id;
+	return NULL;
+}
+
+int ftdi_list(DEVINFO *list, int max)
+{
+	(void)list;
+	(void)max;
 	return 0;
 }
+#endif
+
+// ========== simulated FT232R / CPLD transport ==========
+// TAP state after a TCK with TMS = 0 / 1
+static const unsigned char tap_next_state[16][2] = {
+	{RUN_TEST, TEST_LOGIC_RESET},	// TEST_LOGIC_RESET
+	{RUN_TEST, SELECT_DR_SCAN},	// RUN_TEST
+	{CAPTURE_DR, SELECT_IR_SCAN},	// SELECT_DR_SCAN
+	{SHIFT_DR, EXIT1_DR},		// CAPTURE_DR
+	{SHIFT_DR, EXIT1_DR},		// SHIFT_DR
+	{PAUSE_DR, UPDATE_DR},		// EXIT1_DR
+	{PAUSE_DR, EXIT2_DR},		// PAUSE_DR
+	{SHIFT_DR, UPDATE_DR},		// EXIT2_DR
+	{RUN_TEST, SELECT_DR_SCAN},	// UPDATE_DR
+	{CAPTURE_IR, TEST_LOGIC_RESET},	// SELECT_IR_SCAN
+	{SHIFT_IR, EXIT1_IR},		// CAPTURE_IR
+	{SHIFT_IR, EXIT1_IR},		// SHIFT_IR
+	{PAUSE_IR, UPDATE_IR},		// EXIT1_IR
+	{PAUSE_IR, EXIT2_IR},		// PAUSE_IR
+	{SHIFT_IR, UPDATE_IR},		// EXIT2_IR
+	{RUN_TEST, SELECT_DR_SCAN},	// UPDATE_IR
+};
+
+// load the DR shift register with the register selected by IR
+void sim_capture_dr(SIM_TAP *d)
+{
+	int i;
+	unsigned int v;
+
+	d->dr_head = d->dr_tail = 0;
+	d->dr_fixed = 1;
+	if (d->ir == SIM_INST_BYPASS) {
+		d->dr[d->dr_tail++] = 0;
+	} else if (d->ir == SIM_INST_IDCODE || d->ir == SIM_INST_USERCODE) {
+		v = (d->ir == SIM_INST_IDCODE) ? SIM_IDCODE : SIM_USERCODE;
+		for (i = 0; i < 32; i++) d->dr[d->dr_tail++] = (v >> i) & 1;
+	} else {
+		// the register is as long as the last scan through it
+		if (d->reg_len[d->ir] > d->dr_cap) {
+			d->dr_cap = d->reg_len[d->ir];
+			d->dr = (unsigned char *)realloc(d->dr, d->dr_cap);
+		}
+		memcpy(d->dr, d->reg[d->ir], d->reg_len[d->ir]);
+		d->dr_tail = d->reg_len[d->ir];
+		d->dr_fixed = (d->chained && d->reg_len[d->ir] > 0);
+	}
+	d->dr_captured = d->dr_tail;
+}
+
+// shift the DR shift register by one bit
+void sim_shift_dr(SIM_TAP *d, int tdi)
+{
+	if (d->dr_fixed || d->dr_captured > 0) {
+		if (d->dr_head < d->dr_tail) d->dr_head++;
+		d->dr_captured--;
+	}
+	if (d->dr_tail == d->dr_cap) {
+		if (d->dr_head > 0) {
+			memmove(d->dr, d->dr + d->dr_head, d->dr_tail - d->dr_head);
+			d->dr_tail -= d->dr_head;
+			d->dr_head = 0;
+		} else {
+			d->dr_cap *= 2;
+			d->dr = (unsigned char *)realloc(d->dr, d->dr_cap);
+		}
+	}
+	d->dr[d->dr_tail++] = tdi;
+}
+
+// store the DR shift register to the register selected by IR
+void sim_update_dr(SIM_TAP *d)
+{
+	int len = d->dr_tail - d->dr_head;
+
+	if (d->chained && d->dr_keep > 0 && len > d->dr_keep) {
+		d->dr_head += len - d->dr_keep;
+		len = d->dr_keep;
+	}
+	if (d->ir == SIM_INST_BYPASS || d->ir == SIM_INST_IDCODE || d->ir == SIM_INST_USERCODE) return;
+	d->reg[d->ir] = (unsigned char *)realloc(d->reg[d->ir], len ? len : 1);
+	memcpy(d->reg[d->ir], d->dr + d->dr_head, len);
+	d->reg_len[d->ir] = len;
+}
+
+// TDO of a simulated TAP
+int sim_tap_tdo(SIM_TAP *d)
+{
+	if (d->state == SHIFT_DR) {
+		if (!d->dr_fixed && d->dr_captured <= 0) return 0;
+		return (d->dr_head < d->dr_tail) ? d->dr[d->dr_head] : 0;
+	}
+	if (d->state == SHIFT_IR) return (d->ir_shift & 1);
+	return 1;
+}
+
+// rising edge of TCK of a simulated TAP
+void sim_tap_clock(SIM_TAP *d, int tms, int tdi)
+{
+	switch (d->state) {
+	case CAPTURE_DR: sim_capture_dr(d); break;
+	case SHIFT_DR: sim_shift_dr(d, tdi); break;
+	case CAPTURE_IR: d->ir_shift = 1; break;
+	case SHIFT_IR: d->ir_shift = (d->ir_shift >> 1) | (tdi << (SIM_IR_LEN - 1)); break;
+	}
+	d->state = tap_next_state[d->state][tms];
+	switch (d->state) {
+	case TEST_LOGIC_RESET: d->ir = SIM_INST_IDCODE; break;
+	case UPDATE_DR: sim_update_dr(d); break;
+	case UPDATE_IR: d->ir = d->ir_shift; break;
+	}
+}
+
+// TDO of the chain
+int sim_tdo(SIM_DEVICE *d)
+{
+	int tdo = sim_tap_tdo(&d->tap[d->ntap - 1]);
+
+	// above the reliable rate about 1 in 64 bits is wrong
+	if (g_sim_tck > 0 && d->tck_hz > g_sim_tck) {
+		d->noise ^= d->noise << 13;
+		d->noise ^= d->noise >> 7;
+		d->noise ^= d->noise << 17;
+		if ((d->noise & 63) == 0) tdo ^= 1;
+	}
+	return tdo;
+}
+
+// the CPLDs of a simulated chain are identical : the bits of a DR scan
+// not taken by fixed length registers are shared among the others, and
+// a register scanned for the first time takes its share of the TDI bits
+void sim_share(SIM_DEVICE *d, int tms, int tdi)
+{
+	int i, len, pos, fixed = 0, var = 0;
+	SIM_TAP *t;
+
+	if (d->tap[0].state == CAPTURE_DR) d->shifted = 0;
+	if (d->tap[0].state == SHIFT_DR) {
+		if (d->shifted == d->scan_cap) {
+			d->scan_cap = d->scan_cap ? d->scan_cap * 2 : 256;
+			d->scan = (unsigned char *)realloc(d->scan, d->scan_cap);
+		}
+		d->scan[d->shifted++] = tdi;
+	}
+	if (!tms || (d->tap[0].state != EXIT1_DR && d->tap[0].state != EXIT2_DR)) return;
+	for (i = 0; i < d->ntap; i++) {
+		t = &d->tap[i];
+		if (t->ir == SIM_INST_BYPASS) fixed += 1;
+		else if (t->ir == SIM_INST_IDCODE || t->ir == SIM_INST_USERCODE) fixed += 32;
+		else var++;
+	}
+	pos = d->shifted;
+	for (i = 0; i < d->ntap; i++) {
+		t = &d->tap[i];
+		t->dr_keep = (var && d->shifted > fixed) ? (d->shifted - fixed) / var : 0;
+		if (t->ir == SIM_INST_BYPASS) len = 1;
+		else if (t->ir == SIM_INST_IDCODE || t->ir == SIM_INST_USERCODE) len = 32;
+		else len = t->dr_keep;
+		if (len > pos) len = pos;
+		pos -= len;
+		if (t->dr_fixed) continue;
+		if (len > t->dr_cap) {
+			t->dr_cap = len;
+			t->dr = (unsigned char *)realloc(t->dr, t->dr_cap);
+		}
+		memcpy(t->dr, d->scan + pos, len);
+		t->dr_head = 0;
+		t->dr_tail = len;
+	}
+}
+
+// rising edge of TCK : every TAP shifts in the TDO its neighbour had
+// before the edge
+void sim_clock(SIM_DEVICE *d, int tms, int tdi)
+{
+	int i, tdo;
+
+	if (d->ntap > 1) sim_share(d, tms, tdi);
+	for (i = 0; i < d->ntap; i++) {
+		tdo = sim_tap_tdo(&d->tap[i]);
+		sim_tap_clock(&d->tap[i], tms, tdi);
+		tdi = tdo;
+	}
+}
+
+// a simulated chain of g_sim_chain CPLDs on the bit bang pins
+SIM_DEVICE *sim_board(int pins)
+{
+	SIM_DEVICE *d = (SIM_DEVICE *)calloc(1, sizeof(SIM_DEVICE));
+	int i;
+
+	if (!d) return NULL;
+	d->board_pins = pins;
+	d->tck_hz = BITBANG_TCK_HZ;
+	d->noise = 88172645463325252ULL;
+	d->ntap = g_sim_chain;
+	if (!(d->tap = (SIM_TAP *)calloc(d->ntap, sizeof(SIM_TAP)))) {
+		free(d);
+		return NULL;
+	}
+	for (i = 0; i < d->ntap; i++) {
+		d->tap[i].dr_cap = 64;
+		d->tap[i].dr = (unsigned char *)malloc(d->tap[i].dr_cap);
+		d->tap[i].state = TEST_LOGIC_RESET;
+		d->tap[i].ir = SIM_INST_IDCODE;
+		d->tap[i].chained = (d->ntap > 1);
+	}
+	return d;
+}
+
+void sim_board_free(SIM_DEVICE *d)
+{
+	int i, j;
+
+	for (j = 0; j < d->ntap; j++) {
+		for (i = 0; i < (1 << SIM_IR_LEN); i++) free(d->tap[j].reg[i]);
+		free(d->tap[j].dr);
+	}
+	free(d->tap);
+	free(d->scan);
+	free(d);
+}
+
+// the adapter with one chain on D0-D3, or the chains of -slice
+int sim_open(TRANSPORT *tp)
+{
+	SIM_DEVICE *d, **next;
+	int i;
+
+	if (!(d = sim_board(g_nslice ? g_slice_pins[0] : IMAGE_PINS))) return 0;
+	for (i = 1, next = &d->next; i < g_nslice; i++, next = &(*next)->next) {
+		if (!(*next = sim_board(g_slice_pins[i]))) return 0;
+	}
+	d->rcap = 4096;
+	d->rfifo = (unsigned char *)malloc(d->rcap);
+	if (!d->rfifo) return 0;
+	tp->handle = d;
+	return 1;
+}
+
+void sim_close(TRANSPORT *tp)
+{
+	SIM_DEVICE *d = (SIM_DEVICE *)tp->handle, *next;
+
+	free(d->mcmd);
+	free(d->rfifo);
+	for (; d; d = next) {
+		next = d->next;
+		sim_board_free(d);
+	}
+	tp->handle = NULL;
+}
+
+int sim_set_bit_mode(TRANSPORT *tp, int mask, int mode)
+{
+	SIM_DEVICE *d = (SIM_DEVICE *)tp->handle;
+
+	d->mask = mask;
+	d->bit_mode = mode;
+	d->rhead = d->rtail = 0;
+	d->mlen = 0;
+	d->mtms = 1;
+	return 1;
+}
+
+int sim_set_usb(TRANSPORT *tp, int xfer, int latency)
+{
+	(void)tp;
+	(void)xfer;
+	(void)latency;
+	return 1;
+}
+
+int sim_set_divisor(TRANSPORT *tp, int div)
+{
+	SIM_DEVICE *d;
+
+	for (d = (SIM_DEVICE *)tp->handle; d; d = d->next) d->tck_hz = tck_rate(ENGINE_BITBANG, div);
+	return 1;
+}
+
+// push a byte to the read FIFO
+void sim_push(SIM_DEVICE *d, int v)
+{
+	if (d->rtail == d->rcap) {
+		memmove(d->rfifo, d->rfifo + d->rhead, d->rtail - d->rhead);
+		d->rtail -= d->rhead;
+		d->rhead = 0;
+		if (d->rtail == d->rcap) {
+			d->rcap *= 2;
+			d->rfifo = (unsigned char *)realloc(d->rfifo, d->rcap);
+		}
+	}
+	d->rfifo[d->rtail++] = (unsigned char)v;
+}
+
+// length of the MPSSE command at p (0 if not complete yet)
+int sim_mpsse_len(unsigned char *p, int n)
+{
+	int len;
+
+	switch (p[0]) {
+	case MPSSE_WRITE_BYTES:
+	case MPSSE_RW_BYTES:
+		if (n < 3) return 0;
+		len = 4 + (p[1] | (p[2] << 8));
+		break;
+	case MPSSE_WRITE_BITS:
+	case MPSSE_RW_BITS:
+	case MPSSE_WRITE_TMS:
+	case MPSSE_RW_TMS:
+	case MPSSE_SET_LOW:
+	case MPSSE_SET_DIVISOR:
+	case MPSSE_CLOCK_BYTES:
+		len = 3;
+		break;
+	case MPSSE_CLOCK_BITS:
+		len = 2;
+		break;
+	default:
+		len = 1;
+		break;
+	}
+	return (n >= len) ? len : 0;
+}
+
+// clock the TAP with the MPSSE pins, return TDO sampled on the rising edge
+int sim_mpsse_clock(SIM_DEVICE *d)
+{
+	int tdo = sim_tdo(d);
+
+	sim_clock(d, d->mtms, d->mtdi);
+	return tdo;
+}
+
+// execute an MPSSE command
+void sim_mpsse_exec(SIM_DEVICE *d, unsigned char *p)
+{
+	int i, j, n, r = 0;
+
+	switch (p[0]) {
+	case MPSSE_WRITE_BYTES:
+	case MPSSE_RW_BYTES:
+		n = (p[1] | (p[2] << 8)) + 1;
+		for (i = 0; i < n; i++) {
+			for (j = 0, r = 0; j < 8; j++) {
+				d->mtdi = (p[3 + i] >> j) & 1;
+				r |= sim_mpsse_clock(d) << j;
+			}
+			if (p[0] == MPSSE_RW_BYTES) sim_push(d, r);
+		}
+		break;
+	case MPSSE_WRITE_BITS:
+	case MPSSE_RW_BITS:
+		for (i = 0; i <= p[1]; i++) {
+			d->mtdi = (p[2] >> i) & 1;
+			r = (r >> 1) | (sim_mpsse_clock(d) << 7);
+		}
+		if (p[0] == MPSSE_RW_BITS) sim_push(d, r);
+		break;
+	case MPSSE_WRITE_TMS:
+	case MPSSE_RW_TMS:
+		d->mtdi = (p[2] >> 7) & 1;
+		for (i = 0; i <= p[1]; i++) {
+			d->mtms = (p[2] >> i) & 1;
+			r = (r >> 1) | (sim_mpsse_clock(d) << 7);
+		}
+		if (p[0] == MPSSE_RW_TMS) sim_push(d, r);
+		break;
+	case MPSSE_SET_LOW:
+		d->mtdi = (p[1] >> 1) & 1;
+		d->mtms = (p[1] >> 3) & 1;
+		break;
+	case MPSSE_CLOCK_BITS:
+		for (i = 0; i <= p[1]; i++) sim_mpsse_clock(d);
+		break;
+	case MPSSE_CLOCK_BYTES:
+		n = ((p[1] | (p[2] << 8)) + 1) * 8;
+		for (i = 0; i < n; i++) sim_mpsse_clock(d);
+		break;
+	case MPSSE_SET_DIVISOR:
+		d->tck_hz = tck_rate(ENGINE_MPSSE, p[1] | (p[2] << 8));
+		break;
+	case MPSSE_LOOPBACK_OFF:
+	case MPSSE_SEND_IMMEDIATE:
+	case MPSSE_DIV5_OFF:
+	case MPSSE_3PHASE_OFF:
+	case MPSSE_ADAPTIVE_OFF:
+		break;
+	default:
+		sim_push(d, MPSSE_BAD_COMMAND);
+		sim_push(d, p[0]);
+		break;
+	}
+}
+
+// MPSSE commands may be split over several writes
+int sim_mpsse_write(SIM_DEVICE *d, unsigned char *buf, int len)
+{
+	int n, ofs;
+
+	if (d->mlen + len > d->mcap) {
+		d->mcap = (d->mlen + len) * 2;
+		d->mcmd = (unsigned char *)realloc(d->mcmd, d->mcap);
+		if (!d->mcmd) return 0;
+	}
+	memcpy(d->mcmd + d->mlen, buf, len);
+	d->mlen += len;
+	for (ofs = 0; ofs < d->mlen && (n = sim_mpsse_len(d->mcmd + ofs, d->mlen - ofs)); ofs += n) {
+		sim_mpsse_exec(d, d->mcmd + ofs);
+	}
+	memmove(d->mcmd, d->mcmd + ofs, d->mlen - ofs);
+	d->mlen -= ofs;
+	return 1;
+}
+
+// every byte drives D0-D7 (masked by the output mask), inputs read high
+// but the TDO of the chains; in synchronous mode the pins are sampled
+// before they change
+int sim_write(TRANSPORT *tp, unsigned char *buf, int len)
+{
+	SIM_DEVICE *d = (SIM_DEVICE *)tp->handle, *b;
+	int i, pins, in, tdo, tck, tms, tdi;
+
+	if (d->bit_mode == MPSSE_MODE) return sim_mpsse_write(d, buf, len);
+
+	if (d->bit_mode == BITBANG_SYNC && d->rtail + len > d->rcap) {
+		memmove(d->rfifo, d->rfifo + d->rhead, d->rtail - d->rhead);
+		d->rtail -= d->rhead;
+		d->rhead = 0;
+		while (d->rtail + len > d->rcap) d->rcap *= 2;
+		d->rfifo = (unsigned char *)realloc(d->rfifo, d->rcap);
+	}
+	for (i = 0; i < len; i++) {
+		pins = (d->pins & ~d->mask) | (buf[i] & d->mask);
+		if (d->bit_mode == BITBANG_SYNC) {
+			in = (d->pins & d->mask) | (~d->mask & 0xff);
+			for (b = d; b; b = b->next) {
+				tdo = (b->board_pins >> 12) & 7;
+				in = (in & ~(1 << tdo)) | (sim_tdo(b) << tdo);
+			}
+			d->rfifo[d->rtail++] = (unsigned char)in;
+		}
+		// (d3,d2,d1,d0) = (TDO,TCK,DMS,TDI) or the pins of the chain
+		for (b = d; b; b = b->next) {
+			tck = (b->board_pins >> 8) & 7;
+			tms = (b->board_pins >> 4) & 7;
+			tdi = b->board_pins & 7;
+			if (!((d->pins >> tck) & 1) && ((pins >> tck) & 1)) sim_clock(b, (pins >> tms) & 1, (pins >> tdi) & 1);
+		}
+		d->pins = pins;
+	}
+	return 1;
+}
+
+int sim_read(TRANSPORT *tp, unsigned char *buf, int len)
+{
+	SIM_DEVICE *d = (SIM_DEVICE *)tp->handle;
+
+	if (d->rtail - d->rhead < len) return 0;
+	memcpy(buf, d->rfifo + d->rhead, len);
+	d->rhead += len;
+	if (d->rhead == d->rtail) d->rhead = d->rtail = 0;
+	return 1;
+}
+
+int sim_purge(TRANSPORT *tp)
+{
+	SIM_DEVICE *d = (SIM_DEVICE *)tp->handle;
+
+	d->rhead = d->rtail = 0;
+	return 1;
+}
+
+int sim_device_type(TRANSPORT *tp)
+{
+	return tp->dev_type;
+}
+
+// transport of the simulated FT232R (or FT232H) / CPLD
+TRANSPORT *sim_transport(int dev_type)
+{
+	TRANSPORT *tp = (TRANSPORT *)calloc(1, sizeof(TRANSPORT));
+
+	if (!tp) return NULL;
+	tp->name = "simulator";
+	tp->dev_type = dev_type;
+	tp->purge = sim_purge;
+	tp->device_type = sim_device_type;
+	tp->set_usb = sim_set_usb;
+	tp->open = sim_open;
+	tp->close = sim_close;
+	tp->set_bit_mode = sim_set_bit_mode;
+	tp->set_divisor = sim_set_divisor;
+	tp->write = sim_write;
+	tp->read = sim_read;
+	return tp;
+}
+
+// ========== null transport ==========
+int null_open(TRANSPORT *tp)
+{
+	(void)tp;
+	return 1;
+}
+
+void null_close(TRANSPORT *tp)
+{
+	(void)tp;
+}
+
+int null_set_bit_mode(TRANSPORT *tp, int mask, int mode)
+{
+	(void)tp;
+	(void)mask;
+	(void)mode;
+	return 1;
+}
+
+int null_set_divisor(TRANSPORT *tp, int div)
+{
+	(void)tp;
+	(void)div;
+	return 1;
+}
+
+int null_set_usb(TRANSPORT *tp, int xfer, int latency)
+{
+	(void)tp;
+	(void)xfer;
+	(void)latency;
+	return 1;
+}
+
+int null_write(TRANSPORT *tp, unsigned char *buf, int len)
+{
+	(void)tp;
+	(void)buf;
+	(void)len;
+	return 1;
+}
+
+// read back zeros
+int null_read(TRANSPORT *tp, unsigned char *buf, int len)
+{
+	(void)tp;
+	memset(buf, 0, len);
+	return 1;
+}
+
+int null_purge(TRANSPORT *tp)
+{
+	(void)tp;
+	return 1;
+}
+
+int null_device_type(TRANSPORT *tp)
+{
+	(void)tp;
+	return DEV_UNKNOWN;
+}
+
+// transport that throws away the data (for benchmarks)
+TRANSPORT *null_transport(void)
+{
+	TRANSPORT *tp = (TRANSPORT *)calloc(1, sizeof(TRANSPORT));
+
+	if (!tp) return NULL;
+	tp->name = "null";
+	tp->open = null_open;
+	tp->close = null_close;
+	tp->set_bit_mode = null_set_bit_mode;
+	tp->set_divisor = null_set_divisor;
+	tp->write = null_write;
+	tp->read = null_read;
+	tp->purge = null_purge;
+	tp->device_type = null_device_type;
+	tp->set_usb = null_set_usb;
+	return tp;
+}
 
 int main(int argc, char* argv[])
 {
-	FT_HANDLE ftHandle;
-	FT_STATUS ftStatus;
-	FILE *fp;
+	TRANSPORT *tp;
+	SVF_PARSER ps;
+	CMD_STREAM cs;
+	SLICE sl[MAX_SLICES];
+	DONE_REC done;
 	char *arg, *fname = NULL;
-	int i, v = 0;
+	int i, v = 0, sim = 0, stat = 0, parse = 0, encbench = 0, bench = 0, dev_type;
+	int qdepth = USB_QDEPTH, bufsize = USB_BUFSIZE, threaded = 1, tune = 0, calib = 0, opt = 0, nslice = 0, xrepeat = 0;
+	const char *devlist = NULL, *sock = NULL, *skip = NULL, *report = NULL, *gen = NULL, *render = NULL, *image = NULL, *optout = NULL;
+	const char *xsvfout = NULL;
+	double bench_size = 16 * 1024 * 1024, gen_size = 0;
 	int current_state;
 	int error_code = 0;
-	errno_t errno;
+	double start, est;
 
 	// initialize global variables
-	g_no_match = 0;
 	g_mode = 0;
+	memset(&cs, 0, sizeof(cs));
+	memset(sl, 0, sizeof(sl));
 
 	for (i = 1 ; i < argc; i++) {
 		arg = argv[i];
 		if (!strcmp(arg, "-v")) v = 1;
 		else if (!strcmp(arg, "-c")) g_mode = 1;
+		else if (!strcmp(arg, "-sim")) sim = DEV_FT232R;
+		else if (!strcmp(arg, "-sim-h")) sim = DEV_FT232H;
+		else if (!strcmp(arg, "-mpsse")) g_engine = ENGINE_MPSSE;
+		else if (!strcmp(arg, "-bitbang")) g_engine = ENGINE_BITBANG;
+		else if (!strcmp(arg, "-stat")) stat = 1;
+		else if (!strcmp(arg, "-parse")) parse = 1;
+		else if (!strcmp(arg, "-encbench")) encbench = 1;
+		else if (!strcmp(arg, "-bench")) bench = 1;
+		else if (!strcmp(arg, "-bench-size") && i + 1 < argc) bench_size = size_of_arg(argv[++i]);
+		else if (!strcmp(arg, "-gen") && i + 2 < argc) {
+			gen = argv[++i];
+			gen_size = size_of_arg(argv[++i]);
+		}
+		else if (!strcmp(arg, "-qdepth") && i + 1 < argc) qdepth = atoi(argv[++i]);
+		else if (!strcmp(arg, "-bufsize") && i + 1 < argc) bufsize = atoi(argv[++i]);
+		else if (!strcmp(arg, "-nothread")) threaded = 0;
+		else if (!strcmp(arg, "-dev") && i + 1 < argc) devlist = argv[++i];
+		else if (!strcmp(arg, "-daemon") && i + 1 < argc) sock = argv[++i];
+		else if (!strcmp(arg, "-broadcast") && i + 1 < argc) g_broadcast = atoi(argv[++i]);
+		else if (!strcmp(arg, "-sim-chain") && i + 1 < argc) g_sim_chain = atoi(argv[++i]);
+		else if (!strcmp(arg, "-maxerr") && i + 1 < argc) g_max_report = atoi(argv[++i]);
+		else if (!strcmp(arg, "-freq") && i + 1 < argc) g_tck_max = atof(argv[++i]);
+		else if (!strcmp(arg, "-autotune")) tune = 1;
+		else if (!strcmp(arg, "-xfer") && i + 1 < argc) g_usb_xfer = atoi(argv[++i]);
+		else if (!strcmp(arg, "-latency") && i + 1 < argc) g_latency = atoi(argv[++i]);
+		else if (!strcmp(arg, "-calibrate")) calib = 1;
+		else if (!strcmp(arg, "-json") && i + 1 < argc) report = argv[++i];
+		else if (!strcmp(arg, "-progress")) g_progress = 1;
+		else if (!strcmp(arg, "-cache") && i + 1 < argc) g_cache_dir = argv[++i];
+		else if (!strcmp(arg, "-render") && i + 1 < argc) render = argv[++i];
+		else if (!strcmp(arg, "-image") && i + 1 < argc) image = argv[++i];
+		else if (!strcmp(arg, "-opt")) opt = 1;
+		else if (!strcmp(arg, "-fullsync")) g_fullsync = 1;
+		else if (!strcmp(arg, "-optimize") && i + 1 < argc) optout = argv[++i];
+		else if (!strcmp(arg, "-xsvf") && i + 1 < argc) xsvfout = argv[++i];
+		else if (!strcmp(arg, "-xrepeat") && i + 1 < argc) xrepeat = atoi(argv[++i]);
+		else if (!strcmp(arg, "-retry") && i + 1 < argc) g_retry = atoi(argv[++i]);
+		else if (!strcmp(arg, "-checkpoint") && i + 1 < argc) g_ckpt_file = argv[++i];
+		else if (!strcmp(arg, "-sim-tck") && i + 1 < argc) g_sim_tck = atof(argv[++i]);
+		else if (!strcmp(arg, "-skip") && i + 1 < argc) skip = argv[++i];
+		else if (!strcmp(arg, "-slice") && i + 2 < argc) {
+			if (nslice == MAX_SLICES) {
+				fprintf(stderr, "%d chains at most for -slice\n", MAX_SLICES);
+				return 1;
+			}
+			if ((sl[nslice].pins = slice_pins(argv[++i])) < 0) {
+				fprintf(stderr, "bad pins %s for -slice\n", argv[i]);
+				return 1;
+			}
+			sl[nslice++].fname = argv[++i];
+		}
 		else if (!strcmp(arg, "-h")) {
 			printf("prog_cpld svf_file [options]\n");
+			printf(" svf_file may be gzip / xz compressed, - reads it from stdin\n");
 			printf(" options:\n");
 			printf("   -c compare TDO outputs to the expected values\n");
+			printf("   -fullsync with -c, read back every bit bang byte (no asynchronous runs)\n");
 			printf("   -v verbose\n");
+			printf("   -sim use the simulated FT232R/CPLD instead of the USB device\n");
+			printf("   -sim-h use the simulated FT232H/CPLD instead of the USB device\n");
+			printf("   -mpsse use the MPSSE engine (default for FT2232H/FT4232H/FT232H)\n");
+			printf("   -bitbang use the bit bang engine (default for FT232R/FT245R)\n");
+			printf("   -stat print transfer statistics\n");
+			printf("   -parse only tokenize the SVF and report the throughput\n");
+			printf("   -encbench compare the per bit and the bulk bit bang encoder\n");
+			printf("   -bench time parse / encode / full passes over synthetic SVFs\n");
+			printf("   -bench-size n size of the synthetic SVFs (K/M/G suffix, default 16M)\n");
+			printf("   -gen kind n write a synthetic SVF of n bytes to svf_file\n");
+			printf("        (kind : rows, sir, runtest, verify)\n");
+			printf("   -qdepth n number of USB transfer buffers (default %d)\n", USB_QDEPTH);
+			printf("   -bufsize n size of the USB transfer buffers (default %d)\n", USB_BUFSIZE);
+			printf("   -nothread write to USB from the parser thread\n");
+			printf("   -dev list program the adapters of list (serial numbers or descriptions\n");
+			printf("        separated by ',', or all) in parallel\n");
+			printf("   -daemon path keep the adapters of -dev (default all) open and run the jobs\n");
+			printf("        sent to the Unix socket path, one line each (svf_file and options)\n");
+			printf("   -broadcast n program n identical devices of the chain at once\n");
+			printf("   -sim-chain n CPLDs in the chain of the simulator (default 1)\n");
+			printf("   -maxerr n list the first n SIR/SDR with TDO mismatches (default 16)\n");
+			printf("   -freq hz limit TCK to hz (FREQUENCY of the SVF may lower it)\n");
+			printf("   -autotune use the fastest TCK that reads the chain without errors\n");
+			printf("   -sim-tck hz TDO of the simulator is unreliable above hz\n");
+			printf("   -xfer n USB transfer size of the driver (64 - 65536, default: driver's)\n");
+			printf("   -latency ms latency timer of the adapter (1 - 255, default %d)\n", USB_LATENCY);
+			printf("   -calibrate report the bytes/sec of -bufsize / -xfer / -latency settings\n");
+			printf("        and use the fastest (the SVF file is optional)\n");
+			printf("   -json file write the JSON run report to file (- : stdout)\n");
+			printf("   -progress print the progress and bits/sec periodically\n");
+			printf("   -cache dir keep the compiled SVF in dir and replay it while the SVF is unchanged\n");
+			printf("   -render file write the bit bang waveform of the SVF to file (without -c)\n");
+			printf("   -image file stream the waveform of file to the adapter (no SVF file)\n");
+			printf("   -opt drop redundant STATE / RUNTEST / SIR commands before programming\n");
+			printf("        (TDO mismatches are reported at the lines of the optimized SVF)\n");
+			printf("   -optimize file write the SVF with them dropped to file\n");
+			printf("   -xsvf file write the SVF as XSVF to file (svf_file may be XSVF, it is detected)\n");
+			printf("   -xrepeat n XREPEAT of -xsvf : with -c, a mismatching SDR is shifted again\n");
+			printf("        up to n times (0 - 255, default 0)\n");
+			printf("   -skip file don't program if every TDO of the verify SVF file matches (file has to\n");
+			printf("        verify the design of svf_file, nothing checks that; with -cache, a device\n");
+			printf("        verified before with the same pair of files is known by its USERCODE; the\n");
+			printf("        USERCODE is read only of Xilinx parts, with the XC9500 / CoolRunner instruction\n");
+			printf("        0xfd and an 8 bit IR in every device of the chain)\n");
+			printf("   -slice pins file program file on the chain at pins of the bit bang port (digits of\n");
+			printf("        TDO TCK TMS TDI, e.g. 3210 and 7254 : two chains sharing TCK at D2; with -c\n");
+			printf("        every byte is read back, as with -fullsync)\n");
+			printf("   -retry n with -c, shift an SDR whose TDO doesn't match again up to n times,\n");
+			printf("        idling in the RUNTEST state twice as long before each time (only an SDR\n");
+			printf("        with the TDI of the SDR right before it : not the rows of a pipelined verify)\n");
+			printf("   -checkpoint file record checkpoints of the run in file; run again after a failure,\n");
+			printf("        it resumes from the last one (the file is removed after a good run); only\n");
+			printf("        for row addressed programming SVFs : checkpoints are taken after an ISC_ENABLE\n");
+			printf("        (SIR 0xe8 in every 8 bit IR, XC9500 / CoolRunner), which resume shifts again\n");
 			printf("   -h help\n");
 			return 0;
 		} else fname = arg;
 	}
-	if (!fname) {
-		fprintf(stderr, "speciry SVF file\n");
+	if (encbench) {
+		bench_encoder(1 << 20);
+		return 0;
+	}
+	if (bench) return !bench_svf(bench_size);
+	if (gen) {
+		if (!fname || !gen_svf(fname, gen, gen_size)) fprintf(stderr, "can't generate %s SVF\n", gen);
 		return 0;
 	}
-	if (errno = fopen_s(&fp, fname, "r")) {
-		fprintf(stderr, "can't open %s(%d)\n",  fname, errno);
+	if (optout) {
+		FILE *fp;
+
+		if (!fname) fprintf(stderr, "speciry SVF file\n");
+		else if (fopen_s(&fp, optout, "w")) fprintf(stderr, "can't create %s\n", optout);
+		else {
+			i = optimize_svf(fname, fp);
+			if (fclose(fp)) i = 0;
+			return !i;
+		}
+		return 1;
+	}
+	if (xsvfout) {
+		FILE *fp;
+
+		if (!fname) fprintf(stderr, "speciry SVF file\n");
+		else if (fopen_s(&fp, xsvfout, "wb")) fprintf(stderr, "can't create %s\n", xsvfout);
+		else {
+			i = write_xsvf(fname, fp, xrepeat < 0 ? 0 : xrepeat > 255 ? 255 : xrepeat);
+			if (fclose(fp)) i = 0;
+			return !i;
+		}
+		return 1;
+	}
+	if (render) {
+		if (!fname) fprintf(stderr, "speciry SVF file\n");
+		return !(fname && render_image(fname, render, v));
+	}
+	if (image) fname = NULL;
+	if (!fname && !calib && !image && !sock && !nslice) {
+		fprintf(stderr, "speciry SVF file\n");
 		return 0;
 	}
+	if (g_broadcast < 1) g_broadcast = 1;
+	if (g_broadcast > MAX_CHAIN) g_broadcast = MAX_CHAIN;
+	if (g_sim_chain < 1) g_sim_chain = 1;
+	if (g_sim_chain > MAX_CHAIN) g_sim_chain = MAX_CHAIN;
+	// 2 buffers at least to overlap, even sizes for the TCK low / high pairs
+	if (qdepth < 2) qdepth = 2;
+	if (bufsize < 64) bufsize = 64;
+	bufsize &= ~1;
+	// multiples of 64 bytes, the latency timer is 8 bits
+	if (g_usb_xfer > 65536) g_usb_xfer = 65536;
+	if (g_usb_xfer > 0) g_usb_xfer = (g_usb_xfer + 63) & ~63;
+	if (g_latency > 255) g_latency = 255;
+	if (skip && (devlist || nslice || sock || image || !fname || !strcmp(fname, "-"))) {
+		fprintf(stderr, "-skip is for one adapter and an SVF file\n");
+		skip = NULL;
+	}
+	if (g_ckpt_file && (devlist || nslice || sock || image || opt || g_cache_dir || !fname || !strcmp(fname, "-"))) {
+		fprintf(stderr, "-checkpoint is for one adapter and an SVF file (not with -opt / -cache)\n");
+		g_ckpt_file = NULL;
+	}
+	if (opt && (devlist || g_cache_dir)) {
+		fprintf(stderr, "-opt is ignored with -dev and -cache (program the SVF of -optimize)\n");
+		opt = 0;
+	}
+	if (nslice) return !run_slices(sl, nslice, devlist, sim, v);
+	if (sock) return !run_daemon(sock, devlist ? devlist : "all", sim, v);
+	if (devlist) {
+		if (tune) fprintf(stderr, "-autotune is ignored with -dev\n");
+		return !run_multi(fname, devlist, sim, v);
+	}
+	if (fname && opt) {
+		// program the optimized SVF from a temporary file
+		FILE *fp = tmpfile();
 
-	{ // dummy open...
-		ftStatus = FT_Open(0, &ftHandle);
-		ftStatus = FT_SetBitMode(ftHandle, 7, (g_mode == 1)?4:1);
-		FT_Close(ftHandle);
+		if (!fp) {
+			fprintf(stderr, "can't create a temporary file\n");
+			return 0;
+		}
+		if (!optimize_svf(fname, fp)) {
+			fclose(fp);
+			return 0;
+		}
+		rewind(fp);
+		if (!svf_open_file(&ps, fp)) return 0;
+	} else if (fname && !svf_open(&ps, fname)) {
+		fprintf(stderr, "can't open %s\n",  fname);
+		return 0;
+	}
+	if (g_ckpt_file && is_xsvf(&ps)) {
+		fprintf(stderr, "-checkpoint is for SVF, not XSVF\n");
+		g_ckpt_file = NULL;
+	}
+	if (g_ckpt_file && ckpt_open(&ps, fname) < 0) goto ERROR2;
+	if (parse && fname) {
+		parse_only(&ps);
+		goto ERROR2;
+	}
+	if (sim) tp = sim_transport(sim);
+	else tp = ftdi_transport(NULL);
+	if (!tp) {
+		fprintf(stderr, "USB device support is not compiled in (use -sim)\n");
+		goto ERROR2;
 	}
-//	ftStatus = FT_OpenEx("JTAG", FT_OPEN_BY_DESCRIPTION, &ftHandle);
-	ftStatus = FT_Open(0, &ftHandle);
-	if (ftStatus != FT_OK) {
+
+	if (!tp->open(tp)) {
 		fprintf(stderr, "can't open USB device\n");
 		goto ERROR2;
 	}
-	// synchronous or asynchronous bit bang mode
-	// (d3,d2,d1,d0) = (TDO,TCK,DMS,TDI)
-	ftStatus = FT_SetBitMode(ftHandle, 7, (g_mode == 1)?4:1);
-	if (ftStatus != FT_OK) {
+	if (g_engine == ENGINE_AUTO) {
+		dev_type = tp->device_type(tp);
+		g_engine = (dev_type == DEV_FT2232H || dev_type == DEV_FT4232H || dev_type == DEV_FT232H) ? ENGINE_MPSSE : ENGINE_BITBANG;
+	}
+	if (g_engine == ENGINE_BITBANG) { // dummy open...
+		tp->set_bit_mode(tp, g_bb_mask, (g_mode == 1)?BITBANG_SYNC:BITBANG_ASYNC);
+		tp->close(tp);
+		if (!tp->open(tp)) {
+			fprintf(stderr, "can't open USB device\n");
+			goto ERROR2;
+		}
+	}
+	if (calib) {
+		if (!calibrate(tp, qdepth, threaded, &bufsize)) {
+			fprintf(stderr, "can't calibrate USB device\n");
+			goto ERROR1;
+		}
+		if (!fname && !image) goto ERROR1;
+	}
+	if (image) {
+		tp_clear_stat(tp);
+		start = now_sec();
+		if (!image_replay(tp, image)) goto ERROR1;
+		goto RESULT;
+	}
+	if (!usb_open(tp, qdepth, bufsize, threaded)) {
+		fprintf(stderr, "can't start USB I/O\n");
+		goto ERROR1;
+	}
+	if (!engine_init(tp)) {
 		fprintf(stderr, "can't initialize USB device\n");
 		goto ERROR1;
 	}
+	if (tune) {
+		if (!autotune(tp)) goto ERROR1;
+		// estimate at the tuned rate, then start over
+		usb_close();
+		est = estimate_svf(fname);
+		printf("   TCK %.0f Hz", g_tck_max);
+		if (est >= 0) printf(", programming takes about %.2f sec", est);
+		printf("\n\n");
+		if (!usb_open(tp, qdepth, bufsize, threaded) || !engine_init(tp)) {
+			fprintf(stderr, "can't initialize USB device\n");
+			goto ERROR1;
+		}
+	}
+	if (skip) {
+		i = skip_check(tp, fname, skip, v, &done);
+		if (i < 0) goto ERROR1;
+		if (i > 0) {
+			printf("\n   <<< The device holds the design of %s, programming skipped >>>\n\n", fname);
+			goto ERROR1;
+		}
+	}
+
+	if (g_cache_dir && strcmp(fname, "-")) {
+		// replay the compiled SVF instead of parsing it
+		usb_close();
+		error_code = stream_compile(fname, &cs, g_engine, v, &i);
+		if (error_code) {
+			if (error_code == -2) fprintf(stderr, "can't open %s\n", fname);
+			else fprintf(stderr, "parse error(errorcode = %d, line = %d)\n", error_code, i);
+			goto ERROR1;
+		}
+		g_usb.ver.head = cs.vhead;
+		tp_clear_stat(tp);
+		start = now_sec();
+		if (!engine_mode(tp, g_engine) || !stream_replay(tp, &cs, &g_usb.ver)) {
+			fprintf(stderr, "can't write to USB\n");
+			goto ERROR1;
+		}
+		goto RESULT;
+	}
 
-	FT_SetDivisor(ftHandle, 1);
-	if (!reset_tap(ftHandle, &current_state)) {
+	tp_clear_stat(tp);
+	start = now_sec();
+	if (!reset_tap(tp, &current_state) || (ps.resume && !ckpt_restore(&ps, tp, fname, &current_state))) {
 		fprintf(stderr, "can't write to USB\n");
+		ckpt_finish(0);
 		goto ERROR1;
 	}
-	if (error_code = parse_svf(fp, ftHandle, v, &current_state)) {
-		fprintf(stderr, "parse error(errorcode = %d)\n", error_code);
+	if (error_code = parse_svf(&ps, tp, v, &current_state)) {
+		fprintf(stderr, "parse error(errorcode = %d, line = %d)\n", error_code, ps.line);
+		usb_flush(tp, 1);
+		ckpt_finish(0);
 		goto ERROR1;
 	}
 	// flush USB
-	outBit(ftHandle, 0, 0, 0, 0, 1);
+	if (!usb_flush(tp, 1)) {
+		fprintf(stderr, "can't write to USB\n");
+		ckpt_finish(0);
+		goto ERROR1;
+	}
+RESULT:
 	if (g_mode == 1) {
-		if (g_no_match > 0) printf("\n   <<< %d TDO outputs didn't match to the expected values... >>>\n\n", g_no_match);
+		if (g_usb.ver.reported > g_max_report) printf("   ... %d more SIR/SDR didn't match\n", g_usb.ver.reported - g_max_report);
+		if (g_stat.retries) printf("   %ld SDR shifted again after a mismatch\n", g_stat.retries);
+		for (i = 0; g_broadcast > 1 && i < g_broadcast; i++) {
+			if (g_usb.ver.unit_no_match[i]) printf("   device %d : %d TDO outputs didn't match\n", i, g_usb.ver.unit_no_match[i]);
+			else printf("   device %d : all TDO outputs matched\n", i);
+		}
+		if (g_usb.ver.no_match > 0) printf("\n   <<< %d TDO outputs didn't match to the expected values... >>>\n\n", g_usb.ver.no_match);
 		else printf("\n   <<< All TDO outputs matched to the expected values! >>>\n\n");
+		// a device verified after programming is known next time
+		if (skip && g_usb.ver.no_match == 0 && g_usb.ver.compared > 0 && !done_store(&done)) fprintf(stderr, "can't write the digest to %s\n", g_cache_dir);
 	}
+	ckpt_finish(g_mode != 1 || g_usb.ver.no_match == 0);
+	if (stat) print_stat(tp, now_sec() - start);
+	if (report && !write_report(report, fname ? fname : image, tp, now_sec() - start)) fprintf(stderr, "can't write %s\n", report);
 ERROR1:
-	FT_Close(ftHandle);
+	usb_close();
+	stream_free(&cs);
+	tp->close(tp);
 ERROR2:
-	fclose(fp);
+	if (fname) svf_close(&ps);
 	fflush(stderr);
 
 	return 0;